@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+namespace harris {
+
+// Alignment used for image storage.
+// Page aligned memory can be wrapped by OpenCL devices that share host memory (CL_MEM_USE_HOST_PTR) without a copy.
+constexpr size_t kPageSize = 4096;
+
+// Standard library allocator that returns memory aligned to (and padded out to) a multiple of Alignment bytes
+template <class T, size_t Alignment = kPageSize>
+class AlignedAllocator {
+public:
+    using value_type = T;
+
+    template <class U>
+    struct rebind {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() = default;
+
+    template <class U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) {
+    }
+
+    T* allocate(size_t n) {
+        // Padding the size out to the alignment means whole pages can be mapped by a device
+        const auto size = (n * sizeof(T) + Alignment - 1) / Alignment * Alignment;
+        void* ptr = nullptr;
+        if (posix_memalign(&ptr, Alignment, size) != 0) throw std::bad_alloc();
+        return static_cast<T*>(ptr);
+    }
+
+    void deallocate(T* ptr, size_t) {
+        free(ptr);
+    }
+
+    template <class U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+
+    template <class U>
+    bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
+};
+
+// Returns true if a pointer is aligned to the given number of bytes
+inline bool IsAligned(const void* ptr, size_t alignment = kPageSize) {
+    return reinterpret_cast<uintptr_t>(ptr) % alignment == 0;
+}
+
+}
@@ -0,0 +1,196 @@
+#pragma once
+// Picks the fastest Harris implementation for this machine and frame size
+
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+#include "cache_directory.h"
+#include "harris_base.h"
+#include "image.h"
+
+namespace harris {
+
+// Times each registered backend on synthetic frames and picks the fastest.
+// The choice is stored per host, frame size, pixel size, detector parameters and OpenCL options, so later runs on the same machine
+// skip the timing.
+class BackendSelector {
+public:
+
+    using Factory = std::function<std::shared_ptr<HarrisBase>()>;
+
+    // The selected backend and its detector, which has already run a frame of the selected size
+    struct Selection {
+        std::string name;
+        std::shared_ptr<HarrisBase> harris;
+    };
+
+    // Creates a selector that stores its choices in the given directory. An empty directory disables the cache.
+    explicit BackendSelector(std::string cache_directory = DefaultCacheDirectory("backend"), std::ostream& log = std::cout) :
+        directory_(std::move(cache_directory)),
+        log_(log) {
+        SetParameters(5, 5, 0.04f, 0.5f, 9);
+        SetOpenCLOptions(0, 0, false, false);
+    }
+
+    // Sets the detector parameters the backends are created with (the HarrisBase defaults unless this is called).
+    // The parameters change how much work each backend does, so each set of them has its own stored choices.
+    void SetParameters(int smoothing_size, int structure_size, float harris_k, float threshold_ratio, int suppression_size) {
+        std::stringstream parameters_stream;
+        parameters_stream << std::setprecision(9) << smoothing_size << "-" << structure_size << "-" << harris_k << "-" << threshold_ratio << "-" << suppression_size;
+        parameters_ = parameters_stream.str();
+    }
+
+    // Sets the OpenCL device and options the backends are created with (platform 0, device 0 and no options unless this is called).
+    // Each device and set of options has its own stored choices, since tuning and specialization change how fast the OpenCL backends are.
+    void SetOpenCLOptions(int platform, int device, bool tune, bool specialize) {
+        std::stringstream options_stream;
+        options_stream << "cl" << platform << "." << device << (tune ? "-tune" : "") << (specialize ? "-specialize" : "");
+        opencl_options_ = options_stream.str();
+    }
+
+    // Sets whether the backends run in a detection service rather than in this process. Remote choices are stored separately,
+    // since they include the cost of sending each frame to the service.
+    void SetRemote(bool remote) {
+        remote_ = remote;
+    }
+
+    // Registers a backend. Backends that fail to create or run (e.g. without an OpenCL device) are skipped.
+    void Add(const std::string& name, Factory factory) {
+        backends_.emplace_back(name, std::move(factory));
+    }
+
+    // Returns the fastest backend for frames of the given size and pixel type, along with the detector that was created for it.
+    // Each backend runs one untimed frame (to build programs and allocate buffers) and then frames timed frames.
+    // Throws std::runtime_error if no backend could run.
+    template <class P>
+    Selection Select(int width, int height, int frames = 3) {
+        if (backends_.empty()) throw std::invalid_argument("At least one backend is required");
+
+        // A stored backend that can no longer be created (e.g. its device was removed) is timed again along with the others
+        const auto image = SyntheticImage<P>(width, height);
+        const auto path = CachePath(width, height, sizeof(P));
+        const auto cached = Load(path);
+        if (!cached.empty()) {
+            try {
+                const auto harris = Create(cached);
+                harris->FindCorners(image);
+                log_ << "Using the " << cached << " backend selected earlier for " << width << "x" << height << " frames (" << path << ")" << std::endl;
+                return { cached, harris };
+            } catch (const std::exception& e) {
+                log_ << "Backend " << cached << " selected earlier is not available: " << e.what() << std::endl;
+            }
+        }
+
+        Selection best;
+        auto best_ms = std::numeric_limits<double>::max();
+        for (const auto& backend : backends_) {
+            try {
+                auto harris = backend.second();
+                harris->FindCorners(image);
+
+                const auto start = std::chrono::high_resolution_clock::now();
+                for (auto i = 0; i < frames; ++i) {
+                    harris->FindCorners(image);
+                }
+
+                const auto time_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() / frames;
+                log_ << "Backend " << backend.first << ": " << time_ms << "ms per " << width << "x" << height << " frame" << std::endl;
+                if (time_ms < best_ms) {
+                    best = { backend.first, std::move(harris) };
+                    best_ms = time_ms;
+                }
+            } catch (const std::exception& e) {
+                log_ << "Backend " << backend.first << " is not available: " << e.what() << std::endl;
+            }
+        }
+
+        // Nothing is stored, so a backend that becomes available later (e.g. once a driver is installed) is timed next time
+        if (!best.harris) throw std::runtime_error("None of the backends could run on " + std::to_string(width) + "x" + std::to_string(height) + " frames");
+
+        log_ << "Selected the " << best.name << " backend" << std::endl;
+        Store(path, best.name);
+        return best;
+    }
+
+    // Returns the file the choice for a frame size and pixel size (and the current parameters and options) is stored in on this host
+    std::string CachePath(int width, int height, size_t pixel_size) const {
+        char host[256] = {};
+        gethostname(host, sizeof(host) - 1);
+
+        std::stringstream path_stream;
+        path_stream << directory_ << "/" << host << "-" << width << "x" << height << "x" << pixel_size << "-" << parameters_ << "-" <<
+            (remote_ ? "remote" : opencl_options_) << ".backend";
+        return path_stream.str();
+    }
+
+private:
+    std::string directory_;
+    std::ostream& log_;
+    std::string parameters_;
+    std::string opencl_options_;
+    bool remote_ = false;
+    std::vector<std::pair<std::string, Factory>> backends_;
+
+    // Creates a registered backend by name
+    std::shared_ptr<HarrisBase> Create(const std::string& name) const {
+        for (const auto& backend : backends_) {
+            if (backend.first == name) return backend.second();
+        }
+
+        throw std::invalid_argument("Unknown backend " + name);
+    }
+
+    // Creates a frame of blocks with some noise, so every backend finds a realistic number of corners
+    template <class P>
+    static Image<P> SyntheticImage(int width, int height) {
+        Image<P> image(width, height);
+        uint32_t noise = 12345;
+        for (auto y = 0; y < height; ++y) {
+            auto row = image.data() + y * image.stride();
+            for (auto x = 0; x < static_cast<int>(width * sizeof(P)); ++x) {
+                noise = noise * 1664525U + 1013904223U;
+                const auto block = ((x / sizeof(P) / 32) + (y / 32)) % 2 == 0 ? 64 : 192;
+                row[x] = static_cast<uint8_t>(block + (noise >> 28));
+            }
+        }
+
+        return image;
+    }
+
+    // Returns the backend stored in a file if it is still registered, otherwise an empty string
+    std::string Load(const std::string& path) const {
+        if (directory_.empty()) return std::string();
+
+        std::ifstream in(path);
+        std::string name;
+        if (!(in >> name)) return std::string();
+
+        for (const auto& backend : backends_) {
+            if (backend.first == name) return name;
+        }
+
+        return std::string();
+    }
+
+    void Store(const std::string& path, const std::string& name) const {
+        if (directory_.empty()) return;
+        if (!CreateDirectories(directory_)) return;
+
+        WriteFileAtomically(path, [&](std::ostream& out) { out << name << '\n'; });
+    }
+};
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <ostream>
+#include <string>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace harris {
+
+// Returns the directory used to store persistent cache files for the given purpose (e.g. compiled OpenCL programs).
+// The directory is $XDG_CACHE_HOME/harris/<name> or ~/.cache/harris/<name>. An empty string is returned if neither is set.
+std::string DefaultCacheDirectory(const std::string& name) {
+    const auto xdg_cache_home = std::getenv("XDG_CACHE_HOME");
+    if (xdg_cache_home != nullptr && *xdg_cache_home != '\0') return std::string(xdg_cache_home) + "/harris/" + name;
+
+    const auto home = std::getenv("HOME");
+    if (home != nullptr && *home != '\0') return std::string(home) + "/.cache/harris/" + name;
+
+    return std::string();
+}
+
+// Creates a directory and any missing parents. Returns true if the directory exists when done.
+bool CreateDirectories(const std::string& path) {
+    if (path.empty()) return false;
+
+    for (auto slash = path.find('/', 1); ; slash = path.find('/', slash + 1)) {
+        const auto parent = path.substr(0, slash);
+        if (mkdir(parent.c_str(), 0755) != 0 && errno != EEXIST) return false;
+        if (slash == std::string::npos) break;
+    }
+
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+// Writes a file with the given function and returns true if the whole file was written.
+// The file is written to a temporary file first and then renamed, so that concurrent processes never see a partially written
+// file. The temporary file is removed if writing or renaming it fails.
+bool WriteFileAtomically(const std::string& path, const std::function<void(std::ostream&)>& write) {
+    const auto temp_path = path + ".tmp" + std::to_string(getpid());
+    std::ofstream out(temp_path, std::ios::binary);
+    if (out) write(out);
+    out.close();
+    if (out && std::rename(temp_path.c_str(), path.c_str()) == 0) return true;
+
+    std::remove(temp_path.c_str());
+    return false;
+}
+
+}
@@ -0,0 +1,345 @@
+#pragma once
+// Binary corner files: the corner lists of every frame of a video stored in columns with a per-frame index
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "corner_list.h"
+
+namespace harris {
+
+// Layout of a corner file (all values in host byte order):
+//   CornerFileHeader
+//   One block per frame: the x column, then the y column, then the response column (count floats)
+//   One CornerFileIndexEntry per frame
+//   CornerFileFooter
+// Frames are only ever appended, so the index is written after the last frame and found through the footer.
+// With delta encoding the corners of a frame (which are in raster-scan order) are stored as the difference from the previous
+// corner as zigzag varints (x can go back when y changes), which takes one or two bytes for most corners. Without it both
+// columns are plain int32 arrays.
+struct CornerFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+};
+
+struct CornerFileIndexEntry {
+    uint64_t offset;  // Start of the frame's block
+    uint32_t count;   // Number of corners
+    uint32_t x_bytes; // Size of the x column
+    uint32_t y_bytes; // Size of the y column
+    uint32_t reserved;
+};
+
+struct CornerFileFooter {
+    uint64_t index_offset;
+    uint64_t frame_count;
+    char magic[8];
+};
+
+constexpr char kCornerFileMagic[8] = { 'H', 'A', 'R', 'R', 'I', 'S', 'C', 'F' };
+constexpr uint32_t kCornerFileVersion = 1;
+constexpr uint32_t kCornerFileDeltaEncoded = 1;
+
+// Appends a value to a buffer as a LEB128 varint
+inline void AppendVarint(uint32_t value, std::vector<uint8_t>& buffer) {
+    while (value >= 0x80U) {
+        buffer.push_back(static_cast<uint8_t>(value | 0x80U));
+        value >>= 7;
+    }
+
+    buffer.push_back(static_cast<uint8_t>(value));
+}
+
+// Reads a LEB128 varint and moves data past it. Throws if the varint runs past end.
+inline uint32_t ReadVarint(const uint8_t*& data, const uint8_t* end) {
+    uint32_t value = 0;
+    for (auto shift = 0; shift < 35; shift += 7) {
+        if (data == end) break;
+        const auto byte = *data++;
+        value |= static_cast<uint32_t>(byte & 0x7fU) << shift;
+        if ((byte & 0x80U) == 0) return value;
+    }
+
+    throw std::invalid_argument("Corrupted varint in corner file");
+}
+
+// Maps signed values to unsigned ones so that small negative values also get short varints
+inline uint32_t ZigZag(int32_t value) { return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31); }
+inline int32_t UnZigZag(uint32_t value) { return static_cast<int32_t>(value >> 1) ^ -static_cast<int32_t>(value & 1U); }
+
+// Writes the corners of each frame to a corner file.
+// Append only queues the frame. Encoding and writing happen on a background thread, so writing corners costs the frame loop
+// little more than moving the list (or the corner image, whose corners are then also extracted on the background thread).
+// At most max_queued frames are queued at once. Append waits for the writing thread once the queue is full, so frames
+// detected faster than they are written (e.g. full resolution corner images) don't pile up in memory.
+class CornerFileWriter {
+public:
+
+    CornerFileWriter(const std::string& path, bool delta_encode = true, size_t max_queued = 8) :
+        file_(std::fopen(path.c_str(), "wb")),
+        header_(),
+        offset_(0),
+        max_queued_(max_queued),
+        closed_(false),
+        failed_(false) {
+        if (file_ == nullptr) throw std::invalid_argument("Failed to create corner file " + path);
+        if (max_queued == 0) {
+            std::fclose(file_);
+            throw std::invalid_argument("The max_queued parameter must be larger than zero");
+        }
+
+        // Frames are written in large blocks rather than the default buffer size
+        std::setvbuf(file_, nullptr, _IOFBF, 1 << 20);
+
+        std::memcpy(header_.magic, kCornerFileMagic, sizeof(header_.magic));
+        header_.version = kCornerFileVersion;
+        header_.flags = delta_encode ? kCornerFileDeltaEncoded : 0;
+        Write(&header_, sizeof(header_));
+
+        thread_ = std::thread([this]() { WriteFrames(); });
+    }
+
+    // Rule of five: Neither movable nor copyable
+    CornerFileWriter(const CornerFileWriter&) = delete;
+    CornerFileWriter(CornerFileWriter&&) = delete;
+    CornerFileWriter& operator=(const CornerFileWriter&) = delete;
+    CornerFileWriter& operator=(CornerFileWriter&&) = delete;
+
+    ~CornerFileWriter() {
+        Close();
+    }
+
+    // Queues the corners of the next frame
+    void Append(CornerList corners) {
+        Queue(QueuedFrame{ std::move(corners), Image<float>() });
+    }
+
+    // Queues the corner image of the next frame. Its corners are extracted on the writing thread, so the caller doesn't have
+    // to scan the whole image.
+    void Append(Image<float> corners) {
+        Queue(QueuedFrame{ CornerList(), std::move(corners) });
+    }
+
+    // Writes every queued frame and the index, then closes the file. Returns false if any write failed.
+    bool Close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (closed_) return !failed_;
+            closed_ = true;
+        }
+
+        queued_.notify_all();
+        thread_.join();
+
+        CornerFileFooter footer;
+        footer.index_offset = offset_;
+        footer.frame_count = index_.size();
+        std::memcpy(footer.magic, kCornerFileMagic, sizeof(footer.magic));
+        Write(index_.data(), index_.size() * sizeof(CornerFileIndexEntry));
+        Write(&footer, sizeof(footer));
+        if (std::fclose(file_) != 0) failed_ = true;
+        return !failed_;
+    }
+
+private:
+    // A queued frame holds either a corner list or a corner image that hasn't been converted to a list yet
+    struct QueuedFrame {
+        CornerList corners;
+        Image<float> image;
+    };
+
+    FILE* file_;
+    CornerFileHeader header_;
+    uint64_t offset_;
+    std::vector<CornerFileIndexEntry> index_;
+    std::vector<uint8_t> x_column_;
+    std::vector<uint8_t> y_column_;
+    std::vector<float> response_column_;
+
+    std::mutex mutex_;
+    std::condition_variable queued_;    // A frame was queued or the writer was closed
+    std::condition_variable dequeued_;  // The writing thread took a frame from the queue
+    std::deque<QueuedFrame> queue_;
+    size_t max_queued_;
+    bool closed_;
+    bool failed_;
+    std::thread thread_;
+
+    // Adds a frame to the queue, waiting for the writing thread to take a frame if it is full
+    void Queue(QueuedFrame frame) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            dequeued_.wait(lock, [this]() { return queue_.size() < max_queued_; });
+            queue_.push_back(std::move(frame));
+        }
+
+        queued_.notify_one();
+    }
+
+    // Runs on the writing thread until the writer is closed and the queue is empty
+    void WriteFrames() {
+        for (;;) {
+            QueuedFrame frame;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                queued_.wait(lock, [this]() { return closed_ || !queue_.empty(); });
+                if (queue_.empty()) return;
+                frame = std::move(queue_.front());
+                queue_.pop_front();
+            }
+
+            dequeued_.notify_one();
+
+            if (frame.image) frame.corners = ToCornerList(frame.image);
+            WriteFrame(frame.corners);
+        }
+    }
+
+    void WriteFrame(const CornerList& corners) {
+        x_column_.clear();
+        y_column_.clear();
+        response_column_.clear();
+
+        auto previous_x = 0;
+        auto previous_y = 0;
+        for (const auto& corner : corners) {
+            if (header_.flags & kCornerFileDeltaEncoded) {
+                AppendVarint(ZigZag(corner.x - previous_x), x_column_);
+                AppendVarint(ZigZag(corner.y - previous_y), y_column_);
+                previous_x = corner.x;
+                previous_y = corner.y;
+            } else {
+                AppendInt32(corner.x, x_column_);
+                AppendInt32(corner.y, y_column_);
+            }
+
+            response_column_.push_back(corner.response);
+        }
+
+        index_.push_back(CornerFileIndexEntry{ offset_, static_cast<uint32_t>(corners.size()), static_cast<uint32_t>(x_column_.size()), static_cast<uint32_t>(y_column_.size()), 0 });
+        Write(x_column_.data(), x_column_.size());
+        Write(y_column_.data(), y_column_.size());
+        Write(response_column_.data(), response_column_.size() * sizeof(float));
+    }
+
+    static void AppendInt32(int32_t value, std::vector<uint8_t>& buffer) {
+        const auto bytes = reinterpret_cast<const uint8_t*>(&value);
+        buffer.insert(buffer.end(), bytes, bytes + sizeof(value));
+    }
+
+    void Write(const void* data, size_t size) {
+        if (size == 0) return;
+        if (std::fwrite(data, 1, size, file_) != size) failed_ = true;
+        offset_ += size;
+    }
+};
+
+// A memory mapped corner file. Any frame can be read without reading the frames before it.
+class CornerFile {
+public:
+
+    explicit CornerFile(const std::string& path) :
+        size_(0),
+        footer_(),
+        delta_encoded_(false) {
+        const auto fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::invalid_argument("Failed to open corner file " + path);
+
+        struct stat info;
+        size_ = fstat(fd, &info) == 0 ? static_cast<size_t>(info.st_size) : 0;
+        if (size_ < sizeof(CornerFileHeader) + sizeof(CornerFileFooter)) {
+            close(fd);
+            throw std::invalid_argument(path + " is not a corner file");
+        }
+
+        const auto mapping = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) throw std::invalid_argument("Failed to map corner file " + path);
+
+        const auto size = size_;
+        mapping_ = std::shared_ptr<const uint8_t>(static_cast<const uint8_t*>(mapping), [size](const uint8_t* ptr) { munmap(const_cast<uint8_t*>(ptr), size); });
+
+        CornerFileHeader header;
+        std::memcpy(&header, mapping_.get(), sizeof(header));
+        std::memcpy(&footer_, mapping_.get() + size_ - sizeof(footer_), sizeof(footer_));
+        if (std::memcmp(header.magic, kCornerFileMagic, sizeof(header.magic)) != 0) throw std::invalid_argument(path + " is not a corner file");
+        if (std::memcmp(footer_.magic, kCornerFileMagic, sizeof(footer_.magic)) != 0) throw std::invalid_argument(path + " is truncated (was it closed?)");
+        if (header.version != kCornerFileVersion) throw std::invalid_argument(path + " has an unsupported corner file version");
+        if (footer_.index_offset + footer_.frame_count * sizeof(CornerFileIndexEntry) + sizeof(footer_) != size_) throw std::invalid_argument(path + " has an invalid index");
+        delta_encoded_ = (header.flags & kCornerFileDeltaEncoded) != 0;
+    }
+
+    size_t frame_count() const { return footer_.frame_count; }
+    bool delta_encoded() const { return delta_encoded_; }
+
+    // Returns the number of corners in a frame without decoding it
+    size_t CornerCount(size_t frame) const { return Entry(frame).count; }
+
+    // Decodes the corners of a frame
+    CornerList Frame(size_t frame) const {
+        const auto entry = Entry(frame);
+        const auto response_bytes = static_cast<uint64_t>(entry.count) * sizeof(float);
+        if (entry.offset + entry.x_bytes + entry.y_bytes + response_bytes > footer_.index_offset) throw std::invalid_argument("Corrupted frame in corner file");
+
+        const auto x_column = mapping_.get() + entry.offset;
+        const auto y_column = x_column + entry.x_bytes;
+        const auto response_column = y_column + entry.y_bytes;
+
+        CornerList corners(entry.count);
+        if (delta_encoded_) {
+            auto x_data = x_column;
+            auto y_data = y_column;
+            auto x = 0;
+            auto y = 0;
+            for (auto& corner : corners) {
+                x += UnZigZag(ReadVarint(x_data, y_column));
+                y += UnZigZag(ReadVarint(y_data, response_column));
+                corner.x = x;
+                corner.y = y;
+            }
+        } else {
+            if (entry.x_bytes != entry.count * sizeof(int32_t) || entry.y_bytes != entry.count * sizeof(int32_t)) throw std::invalid_argument("Corrupted frame in corner file");
+            for (auto i = 0U; i < entry.count; ++i) {
+                std::memcpy(&corners[i].x, x_column + i * sizeof(int32_t), sizeof(int32_t));
+                std::memcpy(&corners[i].y, y_column + i * sizeof(int32_t), sizeof(int32_t));
+            }
+        }
+
+        // The response column isn't necessarily aligned, so it is copied rather than read in place
+        for (auto i = 0U; i < entry.count; ++i) {
+            std::memcpy(&corners[i].response, response_column + i * sizeof(float), sizeof(float));
+        }
+
+        return corners;
+    }
+
+private:
+    size_t size_;
+    CornerFileFooter footer_;
+    bool delta_encoded_;
+    std::shared_ptr<const uint8_t> mapping_;
+
+    CornerFileIndexEntry Entry(size_t frame) const {
+        if (frame >= footer_.frame_count) throw std::out_of_range("The frame index is out of range");
+
+        CornerFileIndexEntry entry;
+        std::memcpy(&entry, mapping_.get() + footer_.index_offset + frame * sizeof(entry), sizeof(entry));
+        return entry;
+    }
+};
+}
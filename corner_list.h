@@ -0,0 +1,34 @@
+#pragma once
+
+#include <vector>
+
+#include "image.h"
+
+namespace harris {
+
+// A single corner found by the Harris corner detector.
+// The layout matches the Corner struct used by the OpenCL kernels so lists can be copied directly from device memory.
+struct Corner {
+    int x;
+    int y;
+    float response;
+};
+
+// A compact list of corners for a single image
+using CornerList = std::vector<Corner>;
+
+// Extracts every corner (i.e. every pixel with a positive response) from a corner image in raster-scan order
+CornerList ToCornerList(const Image<float>& corners) {
+    CornerList list;
+    for (auto y = 0; y < corners.height(); ++y) {
+        const auto corner_row = corners.RowPtr(y);
+        for (auto x = 0; x < corners.width(); ++x) {
+            if (corner_row[x] <= 0.0f) continue;
+            list.push_back(Corner{ x, y, corner_row[x] });
+        }
+    }
+
+    return list;
+}
+
+}
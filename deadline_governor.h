@@ -0,0 +1,140 @@
+#pragma once
+// Keeps the latency of each frame of a live source within a budget by dropping frames or detecting at a lower resolution
+
+#include <chrono>
+#include <cstddef>
+#include <stdexcept>
+#include <thread>
+
+namespace harris {
+
+// Decides how each frame of a live source is processed so that the time from a frame arriving to its corners being found
+// stays within a budget. Frames arrive at a fixed interval from the first call to WaitForFrame.
+// The governor keeps a moving average of the detection time at full and reduced resolution. A frame is processed at full
+// resolution if that fits in what is left of the budget, at reduced resolution if that fits instead, and dropped otherwise.
+// The newest frame is never dropped (it is processed at reduced resolution) so a detector that can't meet the budget at
+// all still produces results.
+// Full resolution is tried again from time to time while frames are being downscaled, so one slow frame (or a slow patch)
+// doesn't keep the governor at reduced resolution for the rest of the run.
+class DeadlineGovernor {
+public:
+
+    enum class Action {
+        kProcess,    // Detect at full resolution
+        kDownscale,  // Detect at reduced resolution
+        kDrop,       // Skip the frame
+    };
+
+    // budget_ms is the latency budget per frame and frame_interval_ms the time between frames of the source.
+    // Reduced resolution frames are scaled by downscale in each direction.
+    DeadlineGovernor(double budget_ms, double frame_interval_ms, double downscale = 0.5) :
+        budget_ms_(budget_ms),
+        frame_interval_ms_(frame_interval_ms),
+        downscale_(downscale),
+        full_ms_(0.0),
+        downscaled_ms_(0.0),
+        started_(false),
+        processed_(0),
+        full_frames_(0),
+        downscaled_(0),
+        since_full_(0),
+        dropped_(0) {
+        if (budget_ms <= 0.0) throw std::invalid_argument("The budget_ms parameter must be larger than zero");
+        if (frame_interval_ms <= 0.0) throw std::invalid_argument("The frame_interval_ms parameter must be larger than zero");
+        if (downscale <= 0.0 || downscale >= 1.0) throw std::invalid_argument("The downscale parameter must be between zero and one");
+    }
+
+    // Waits until a frame has arrived (when processing is ahead of the source) and returns how long ago it arrived in ms
+    double WaitForFrame(size_t index) {
+        if (!started_) {
+            start_ = Clock::now();
+            started_ = true;
+        }
+
+        const auto arrival = start_ + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::milli>(index * frame_interval_ms_));
+        const auto now = Clock::now();
+        if (now < arrival) {
+            std::this_thread::sleep_until(arrival);
+            return 0.0;
+        }
+
+        return std::chrono::duration<double, std::milli>(now - arrival).count();
+    }
+
+    // Decides how to process a frame that arrived lag_ms ago
+    Action Decide(double lag_ms) {
+        // Until a reduced resolution frame has been timed, assume the time scales with the number of pixels
+        const auto downscaled_ms = downscaled_ > 1 ? downscaled_ms_ : full_ms_ * downscale_ * downscale_;
+
+        Action action;
+        if (lag_ms + full_ms_ <= budget_ms_) action = Action::kProcess;
+        else if (lag_ms + downscaled_ms <= budget_ms_ || lag_ms < frame_interval_ms_) action = Action::kDownscale;
+        else action = Action::kDrop;
+
+        // The full resolution time only changes when full resolution frames run, so try one again when the reduced resolution
+        // time suggests it now fits, and every kProbeInterval reduced resolution frames otherwise. The periodic probe is only
+        // made on a frame that is on time at reduced resolution, never on one that is only kept because it is the newest.
+        const auto scaled_up_ms = downscaled_ms_ / (downscale_ * downscale_);
+        const auto on_time = lag_ms + downscaled_ms <= budget_ms_;
+        if (action == Action::kDownscale && ((since_full_ >= kProbeInterval && on_time) || (downscaled_ > 1 && lag_ms + scaled_up_ms <= budget_ms_))) {
+            action = Action::kProcess;
+        }
+
+        if (action == Action::kDrop) ++dropped_;
+        return action;
+    }
+
+    // Records the detection time of a processed frame.
+    // The first frame at each resolution is left out of the averages since it includes one-off costs (e.g. building OpenCL
+    // programs or allocating buffers for the frame size).
+    void Record(Action action, double time_ms) {
+        if (action == Action::kProcess) {
+            if (full_frames_ > 0) full_ms_ = full_frames_ == 1 ? time_ms : kSmoothing * time_ms + (1.0 - kSmoothing) * full_ms_;
+            ++full_frames_;
+            since_full_ = 0;
+        } else if (action == Action::kDownscale) {
+            if (downscaled_ > 0) downscaled_ms_ = downscaled_ == 1 ? time_ms : kSmoothing * time_ms + (1.0 - kSmoothing) * downscaled_ms_;
+            ++downscaled_;
+            ++since_full_;
+        }
+
+        if (action != Action::kDrop) ++processed_;
+    }
+
+    double downscale() const { return downscale_; }
+
+    // Frames processed at either resolution, frames processed at reduced resolution and frames dropped
+    size_t processed() const { return processed_; }
+    size_t downscaled() const { return downscaled_; }
+    size_t dropped() const { return dropped_; }
+
+    // Returns the rate at which frames have been processed since the first frame arrived
+    double fps() const {
+        if (!started_) return 0.0;
+        const auto elapsed_s = std::chrono::duration<double>(Clock::now() - start_).count();
+        return elapsed_s > 0.0 ? processed_ / elapsed_s : 0.0;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // Weight of the latest time in the moving averages
+    static constexpr double kSmoothing = 0.2;
+
+    // Most reduced resolution frames in a row before full resolution is tried again
+    static constexpr size_t kProbeInterval = 30;
+
+    double budget_ms_;
+    double frame_interval_ms_;
+    double downscale_;
+    double full_ms_;
+    double downscaled_ms_;
+    bool started_;
+    Clock::time_point start_;
+    size_t processed_;
+    size_t full_frames_;
+    size_t downscaled_;
+    size_t since_full_;  // Reduced resolution frames since the last full resolution frame
+    size_t dropped_;
+};
+}
@@ -0,0 +1,578 @@
+#pragma once
+// A local corner detection service: clients pass frames through shared memory and get corner lists back over a UNIX socket
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "corner_list.h"
+#include "frame_stream.h"
+#include "harris_base.h"
+#include "image.h"
+#include "thread_pool.h"
+
+namespace harris {
+
+// Protocol (all messages are fixed-size structs in host byte order on a SOCK_SEQPACKET socket):
+//   1. The client creates a memfd of slot_count slots of slot_size bytes each, seals it against shrinking and sends a
+//      ServiceHello with the memfd attached (SCM_RIGHTS). The hello names the detector and the parameters the client expects
+//      it to have. The service maps the memory and answers with a ServiceReply (sequence 0).
+//   2. For each frame the client writes the pixels into a free slot and sends a ServiceRequest for it. The service runs the
+//      detector directly on the slot, writes the corners back into the same slot as an array of Corner structs and answers
+//      with a ServiceReply giving their count. The slot can be reused once the reply has arrived.
+// Replies to a client arrive in the order of its requests, so a client can keep one request in flight per slot. A client
+// with more requests in flight than slots, or that doesn't read its replies, is disconnected.
+struct ServiceHello {
+    char magic[8];
+    uint32_t version;
+    uint32_t slot_count;
+    uint64_t slot_size;
+    char backend[32];  // Name of the detector to use (nul terminated)
+
+    // Parameters the detector must have been created with
+    int32_t smoothing_size;
+    int32_t structure_size;
+    int32_t suppression_size;
+    float k;
+    float threshold_ratio;
+};
+
+struct ServiceRequest {
+    uint64_t sequence;
+    uint32_t slot;
+    uint32_t pixel_format;  // A StreamPixelFormat
+    uint32_t width;
+    uint32_t height;
+    uint64_t stride;
+};
+
+struct ServiceReply {
+    uint64_t sequence;
+    uint32_t status;  // A ServiceStatus
+    uint32_t count;   // Number of corners written to the slot
+};
+
+enum class ServiceStatus : uint32_t {
+    kOk,
+    kBadRequest,       // The hello or request was malformed or doesn't fit the shared memory
+    kUnknownBackend,   // The service doesn't host the requested detector
+    kFailed,           // The detector threw
+    kTooManyCorners,   // The corners don't fit in the slot
+    kWrongParameters,  // The service's detector has different parameters than the client asked for
+};
+
+constexpr char kServiceMagic[8] = { 'H', 'A', 'R', 'R', 'I', 'S', 'S', 'V' };
+constexpr uint32_t kServiceVersion = 2;
+
+inline const char* ServiceStatusMessage(uint32_t status) {
+    switch (static_cast<ServiceStatus>(status)) {
+        case ServiceStatus::kOk: return "OK";
+        case ServiceStatus::kBadRequest: return "The request was malformed or does not fit in the shared memory";
+        case ServiceStatus::kUnknownBackend: return "The service does not host the requested detector";
+        case ServiceStatus::kFailed: return "The detector failed";
+        case ServiceStatus::kTooManyCorners: return "The corners do not fit in the shared memory slot";
+        case ServiceStatus::kWrongParameters: return "The service's detector was created with different parameters";
+        default: return "Unknown status";
+    }
+}
+
+// Sends a message, optionally with a file descriptor attached. Returns false if the message couldn't be sent (errno is
+// EAGAIN if the socket's buffer was full with MSG_DONTWAIT).
+inline bool SendServiceMessage(int socket_fd, const void* data, size_t size, int attached_fd = -1, int flags = 0) {
+    iovec io = { const_cast<void*>(data), size };
+    msghdr message = {};
+    message.msg_iov = &io;
+    message.msg_iovlen = 1;
+
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    if (attached_fd >= 0) {
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        const auto header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(header), &attached_fd, sizeof(int));
+    }
+
+    return sendmsg(socket_fd, &message, flags | MSG_NOSIGNAL) == static_cast<ssize_t>(size);
+}
+
+// Receives a message and any file descriptor attached to it (or -1). Returns the size of the message, 0 if the socket was
+// closed and -1 on errors (errno is EAGAIN if nothing was waiting with MSG_DONTWAIT).
+inline ssize_t ReceiveServiceMessage(int socket_fd, void* data, size_t size, int& attached_fd, int flags = 0) {
+    iovec io = { data, size };
+    msghdr message = {};
+    message.msg_iov = &io;
+    message.msg_iovlen = 1;
+
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    attached_fd = -1;
+    const auto received = recvmsg(socket_fd, &message, flags | MSG_CMSG_CLOEXEC);
+    for (auto header = CMSG_FIRSTHDR(&message); received >= 0 && header != nullptr; header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) std::memcpy(&attached_fd, CMSG_DATA(header), sizeof(int));
+    }
+
+    // Truncated messages are never valid
+    if (received >= 0 && (message.msg_flags & MSG_TRUNC)) return static_cast<ssize_t>(size + 1);
+    return received;
+}
+
+// Fills in the address of a UNIX socket
+inline sockaddr_un ServiceAddress(const std::string& socket_path) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socket_path.empty() || socket_path.size() >= sizeof(address.sun_path)) throw std::invalid_argument("The socket path must be between 1 and " + std::to_string(sizeof(address.sun_path) - 1) + " characters long");
+    std::memcpy(address.sun_path, socket_path.c_str(), socket_path.size());
+    return address;
+}
+
+// Hosts one detector per backend for any number of local clients.
+// The detectors are created and run once before the first client connects, so clients never pay for creating an OpenCL
+// context or compiling programs. Each detector runs on its own thread. Requests that arrive together from any clients for
+// the same detector are handed to its thread as one batch, and each client's replies are sent in the order of its requests.
+class DetectionServer {
+public:
+
+    using Backend = std::pair<std::string, std::shared_ptr<HarrisBase>>;
+
+    // Listens on the given socket path (an existing socket at that path is replaced)
+    DetectionServer(const std::string& socket_path, std::vector<Backend> backends, std::ostream& log = std::cout) :
+        socket_path_(socket_path),
+        listen_fd_(-1),
+        log_(log),
+        frames_(0),
+        batches_(0) {
+        if (backends.empty()) throw std::invalid_argument("At least one backend is required");
+
+        // Build programs and allocate buffers now rather than on the first request, for every pixel format since each can
+        // have its own kernels and buffers
+        for (auto& backend : backends) {
+            const auto start = std::chrono::high_resolution_clock::now();
+            backend.second->FindCornerList(Image<Argb32>(kWarmUpWidth, kWarmUpHeight));
+            backend.second->FindCornerList(Image<Bgr24>(kWarmUpWidth, kWarmUpHeight));
+            backend.second->FindCornerList(Image<uint8_t>(kWarmUpWidth, kWarmUpHeight));
+            const auto time_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+            log_ << "Warmed up the " << backend.first << " detector in " << time_ms << "ms" << std::endl;
+
+            auto& hosted = backends_[backend.first];
+            hosted.detector = std::move(backend.second);
+            hosted.worker = std::make_unique<ThreadPool>(1);
+        }
+
+        const auto address = ServiceAddress(socket_path);
+        if (pipe2(stop_pipe_, O_CLOEXEC) != 0) throw std::runtime_error("Failed to create the stop pipe");
+
+        // Only replace a stale socket, never some other file
+        struct stat info;
+        if (lstat(socket_path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) unlink(socket_path.c_str());
+
+        listen_fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (listen_fd_ < 0 || bind(listen_fd_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 || listen(listen_fd_, kBacklog) != 0) {
+            const auto error = std::string(std::strerror(errno));
+            CloseFds();
+            throw std::invalid_argument("Failed to listen on " + socket_path + ": " + error);
+        }
+    }
+
+    // Rule of five: Neither movable nor copyable
+    DetectionServer(const DetectionServer&) = delete;
+    DetectionServer(DetectionServer&&) = delete;
+    DetectionServer& operator=(const DetectionServer&) = delete;
+    DetectionServer& operator=(DetectionServer&&) = delete;
+
+    // Finishes every batch that has been started, then disconnects every client
+    ~DetectionServer() {
+        backends_.clear();
+        clients_.clear();
+        CloseFds();
+        unlink(socket_path_.c_str());
+    }
+
+    // Serves clients until Stop is called
+    void Run() {
+        for (;;) {
+            std::vector<pollfd> fds = { { stop_pipe_[0], POLLIN, 0 }, { listen_fd_, POLLIN, 0 } };
+            for (const auto& client : clients_) {
+                fds.push_back({ client->fd, POLLIN, 0 });
+            }
+
+            if (poll(fds.data(), fds.size(), -1) < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error(std::string("Failed to wait for clients: ") + std::strerror(errno));
+            }
+
+            if (fds[0].revents != 0) return;
+            if (fds[1].revents & POLLIN) Accept();
+
+            // Gather every request that is waiting, from every client, before handing them to the detectors
+            std::map<std::string, std::vector<Job>> batches;
+            std::vector<std::shared_ptr<Client>> connected;
+            for (auto i = 0U; i < clients_.size(); ++i) {
+                const auto& client = clients_[i];
+                const auto revents = fds[i + 2].revents;
+                if (revents == 0 || ReadRequests(client, batches)) connected.push_back(client);
+            }
+
+            clients_ = std::move(connected);
+            for (auto& batch : batches) {
+                Dispatch(batch.first, std::move(batch.second));
+            }
+        }
+    }
+
+    // Makes Run return. This only writes to a pipe, so it can be called from any thread or from a signal handler.
+    void Stop() {
+        const char stop = 1;
+        const auto written = write(stop_pipe_[1], &stop, 1);
+        (void)written;
+    }
+
+    // Number of frames processed and batches they were processed in
+    size_t frames() const { return frames_; }
+    size_t batches() const { return batches_; }
+
+private:
+    static constexpr int kBacklog = 64;
+    static constexpr int kWarmUpWidth = 640;
+    static constexpr int kWarmUpHeight = 480;
+
+    // A connected client and its shared memory. In-flight jobs share ownership, so the socket and mapping stay valid until
+    // the last reply has been sent.
+    struct Client {
+        explicit Client(int client_fd) : fd(client_fd), slot_count(0), slot_size(0), in_flight(0) {}
+        ~Client() { close(fd); }
+
+        int fd;
+        std::shared_ptr<uint8_t> slots;
+        uint32_t slot_count;
+        uint64_t slot_size;
+        std::string backend;
+        std::atomic<uint32_t> in_flight;  // Requests read whose reply hasn't been sent yet
+    };
+
+    struct Job {
+        std::shared_ptr<Client> client;
+        ServiceRequest request;
+    };
+
+    struct HostedBackend {
+        std::shared_ptr<HarrisBase> detector;
+        std::unique_ptr<ThreadPool> worker;  // A single thread, since detectors can't be used by two threads at once
+    };
+
+    std::string socket_path_;
+    int listen_fd_;
+    int stop_pipe_[2] = { -1, -1 };
+    std::ostream& log_;
+    std::vector<std::shared_ptr<Client>> clients_;
+    std::map<std::string, HostedBackend> backends_;
+    std::atomic<size_t> frames_;
+    std::atomic<size_t> batches_;
+
+    void CloseFds() {
+        if (listen_fd_ >= 0) close(listen_fd_);
+        if (stop_pipe_[0] >= 0) close(stop_pipe_[0]);
+        if (stop_pipe_[1] >= 0) close(stop_pipe_[1]);
+        listen_fd_ = stop_pipe_[0] = stop_pipe_[1] = -1;
+    }
+
+    void Accept() {
+        const auto fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd >= 0) clients_.push_back(std::make_shared<Client>(fd));
+    }
+
+    // Reads every message waiting from a client. Returns false if the client has gone or broke the protocol.
+    bool ReadRequests(const std::shared_ptr<Client>& client, std::map<std::string, std::vector<Job>>& batches) {
+        for (;;) {
+            union {
+                ServiceHello hello;
+                ServiceRequest request;
+            } message;
+
+            int attached_fd;
+            const auto received = ReceiveServiceMessage(client->fd, &message, sizeof(message), attached_fd, MSG_DONTWAIT);
+            if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+            if (received <= 0) return false;
+
+            if (!client->slots) {
+                const auto status = Connect(*client, message.hello, received, attached_fd);
+                if (attached_fd >= 0) close(attached_fd);
+
+                const ServiceReply reply = { 0, static_cast<uint32_t>(status), 0 };
+                if (!SendServiceMessage(client->fd, &reply, sizeof(reply)) || status != ServiceStatus::kOk) return false;
+                continue;
+            }
+
+            if (attached_fd >= 0) close(attached_fd);
+            if (received != sizeof(ServiceRequest) || client->in_flight >= client->slot_count) return false;
+            ++client->in_flight;
+            batches[client->backend].push_back(Job{ client, message.request });
+        }
+    }
+
+    // Maps the shared memory of a client that has sent its hello
+    ServiceStatus Connect(Client& client, const ServiceHello& hello, ssize_t size, int memory_fd) {
+        if (size != sizeof(ServiceHello) || memory_fd < 0) return ServiceStatus::kBadRequest;
+        if (std::memcmp(hello.magic, kServiceMagic, sizeof(hello.magic)) != 0 || hello.version != kServiceVersion) return ServiceStatus::kBadRequest;
+        if (hello.slot_count == 0 || hello.slot_size == 0 || hello.slot_size > SIZE_MAX / hello.slot_count) return ServiceStatus::kBadRequest;
+
+        const auto backend = std::string(hello.backend, strnlen(hello.backend, sizeof(hello.backend)));
+        if (backends_.count(backend) == 0) return ServiceStatus::kUnknownBackend;
+
+        const auto& detector = *backends_.at(backend).detector;
+        if (hello.smoothing_size != detector.smoothing_size() || hello.structure_size != detector.structure_size() || hello.suppression_size != detector.suppression_size() ||
+            hello.k != detector.k() || hello.threshold_ratio != detector.threshold_ratio()) return ServiceStatus::kWrongParameters;
+
+        // A client could otherwise truncate the memory while the service reads it, which would crash the service (SIGBUS)
+        const auto seals = fcntl(memory_fd, F_GET_SEALS);
+        if (seals < 0 || (seals & F_SEAL_SHRINK) == 0) return ServiceStatus::kBadRequest;
+
+        struct stat info;
+        const auto size_bytes = static_cast<size_t>(hello.slot_count * hello.slot_size);
+        if (fstat(memory_fd, &info) != 0 || static_cast<size_t>(info.st_size) < size_bytes) return ServiceStatus::kBadRequest;
+
+        const auto mapping = mmap(nullptr, size_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, memory_fd, 0);
+        if (mapping == MAP_FAILED) return ServiceStatus::kBadRequest;
+
+        client.slots = std::shared_ptr<uint8_t>(static_cast<uint8_t*>(mapping), [size_bytes](uint8_t* ptr) { munmap(ptr, size_bytes); });
+        client.slot_count = hello.slot_count;
+        client.slot_size = hello.slot_size;
+        client.backend = backend;
+        return ServiceStatus::kOk;
+    }
+
+    // Runs a batch of jobs on the thread of a detector
+    void Dispatch(const std::string& backend, std::vector<Job> jobs) {
+        const auto detector = backends_.at(backend).detector;
+        backends_.at(backend).worker->Submit([this, detector, jobs = std::move(jobs)]() {
+            for (const auto& job : jobs) {
+                Process(*detector, job);
+            }
+
+            ++batches_;
+        });
+    }
+
+    void Process(HarrisBase& detector, const Job& job) {
+        const auto& request = job.request;
+        auto& client = *job.client;
+        ServiceReply reply = { request.sequence, static_cast<uint32_t>(ServiceStatus::kOk), 0 };
+
+        const auto format = static_cast<StreamPixelFormat>(request.pixel_format);
+        const auto valid = request.slot < client.slot_count &&
+            request.width > 0 && request.height > 0 &&
+            request.pixel_format <= static_cast<uint32_t>(StreamPixelFormat::kGrey) &&
+            request.stride >= request.width * BytesPerPixel(format) &&
+            request.stride <= client.slot_size / request.height;
+
+        if (!valid) {
+            reply.status = static_cast<uint32_t>(ServiceStatus::kBadRequest);
+        } else {
+            const auto slot = std::shared_ptr<uint8_t>(client.slots, client.slots.get() + request.slot * client.slot_size);
+            try {
+                const auto corners = FindCornerList(detector, slot, format, request);
+                if (corners.size() * sizeof(Corner) > client.slot_size) {
+                    reply.status = static_cast<uint32_t>(ServiceStatus::kTooManyCorners);
+                } else {
+                    std::memcpy(slot.get(), corners.data(), corners.size() * sizeof(Corner));
+                    reply.count = static_cast<uint32_t>(corners.size());
+                }
+
+                ++frames_;
+            } catch (const std::exception&) {
+                reply.status = static_cast<uint32_t>(ServiceStatus::kFailed);
+            }
+        }
+
+        // Never wait for a client to read its replies, since that would hold up every other client of the detector. A client
+        // whose socket is full is shut down instead, and the polling thread drops it like a client that has gone.
+        --client.in_flight;
+        if (!SendServiceMessage(client.fd, &reply, sizeof(reply), -1, MSG_DONTWAIT)) shutdown(client.fd, SHUT_RDWR);
+    }
+
+    static CornerList FindCornerList(HarrisBase& detector, const std::shared_ptr<uint8_t>& slot, StreamPixelFormat format, const ServiceRequest& request) {
+        switch (format) {
+            case StreamPixelFormat::kBgra: return detector.FindCornerList(Image<Argb32>(slot, request.width, request.height, request.stride));
+            case StreamPixelFormat::kBgr: return detector.FindCornerList(Image<Bgr24>(slot, request.width, request.height, request.stride));
+            default: return detector.FindCornerList(Image<uint8_t>(slot, request.width, request.height, request.stride));
+        }
+    }
+};
+
+// Connects to a detection service and sends it frames through a ring of shared memory slots.
+// Frames can be written straight into a slot (see SlotImage) so that they are never copied; any other image is copied into
+// the slot when it is submitted. Up to one frame per slot can be in flight.
+class DetectionClient {
+public:
+
+    // Connects to the service at socket_path and asks for the given detector, which must have the same parameters as the
+    // given one. Each slot must fit the largest frame (and its corners).
+    DetectionClient(const std::string& socket_path, const std::string& backend, const HarrisBase& parameters, uint32_t slot_count = 4, uint64_t slot_size = kDefaultSlotSize) :
+        fd_(-1),
+        slot_count_(slot_count),
+        slot_size_(slot_size),
+        sequence_(0) {
+        if (slot_count == 0) throw std::invalid_argument("The slot_count parameter must be larger than zero");
+        if (slot_size == 0) throw std::invalid_argument("The slot_size parameter must be larger than zero");
+        if (backend.size() >= sizeof(ServiceHello::backend)) throw std::invalid_argument("The backend name is too long");
+
+        const auto size = static_cast<size_t>(slot_count) * slot_size;
+        const auto memory_fd = memfd_create("harris-frames", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (memory_fd < 0) throw std::runtime_error("Failed to create shared memory for the detection service");
+
+        // The service only accepts memory that can't shrink under it
+        const auto sized = ftruncate(memory_fd, size) == 0 && fcntl(memory_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) == 0;
+        const auto mapping = sized ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, memory_fd, 0) : MAP_FAILED;
+        if (mapping == MAP_FAILED) {
+            close(memory_fd);
+            throw std::runtime_error("Failed to map shared memory for the detection service");
+        }
+
+        slots_ = std::shared_ptr<uint8_t>(static_cast<uint8_t*>(mapping), [size](uint8_t* ptr) { munmap(ptr, size); });
+
+        const auto address = ServiceAddress(socket_path);
+        fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (fd_ < 0 || connect(fd_, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0) {
+            close(memory_fd);
+            if (fd_ >= 0) close(fd_);
+            throw std::invalid_argument("Failed to connect to the detection service at " + socket_path);
+        }
+
+        ServiceHello hello = {};
+        std::memcpy(hello.magic, kServiceMagic, sizeof(hello.magic));
+        hello.version = kServiceVersion;
+        hello.slot_count = slot_count;
+        hello.slot_size = slot_size;
+        std::memcpy(hello.backend, backend.c_str(), backend.size());
+        hello.smoothing_size = parameters.smoothing_size();
+        hello.structure_size = parameters.structure_size();
+        hello.suppression_size = parameters.suppression_size();
+        hello.k = parameters.k();
+        hello.threshold_ratio = parameters.threshold_ratio();
+
+        // The service keeps its own mapping, so the descriptor isn't needed once it has been sent
+        const auto sent = SendServiceMessage(fd_, &hello, sizeof(hello), memory_fd);
+        close(memory_fd);
+
+        ServiceReply reply;
+        if (!sent || !ReceiveReply(reply)) {
+            close(fd_);
+            throw std::runtime_error("The detection service at " + socket_path + " closed the connection");
+        }
+
+        if (reply.status != static_cast<uint32_t>(ServiceStatus::kOk)) {
+            close(fd_);
+            throw std::invalid_argument(std::string(ServiceStatusMessage(reply.status)) + " (" + backend + ")");
+        }
+    }
+
+    // Rule of five: Neither movable nor copyable
+    DetectionClient(const DetectionClient&) = delete;
+    DetectionClient(DetectionClient&&) = delete;
+    DetectionClient& operator=(const DetectionClient&) = delete;
+    DetectionClient& operator=(DetectionClient&&) = delete;
+
+    ~DetectionClient() {
+        close(fd_);
+    }
+
+    size_t slot_count() const { return slot_count_; }
+    uint64_t slot_size() const { return slot_size_; }
+
+    // Returns an image that views a slot, so a frame can be written into shared memory directly
+    template <class P>
+    Image<P> SlotImage(size_t slot, int width, int height) {
+        CheckFits(slot, width, height, width * sizeof(P));
+        return Image<P>(std::shared_ptr<uint8_t>(slots_, SlotData(slot)), width, height, width * sizeof(P));
+    }
+
+    // Sends a frame in a slot. Images that aren't already in the slot are copied into it first.
+    // The slot must not be written to until the corners of the frame have been received.
+    template <class P>
+    void Submit(size_t slot, const Image<P>& image) {
+        auto stride = image.stride();
+        if (image.data() != SlotData(slot)) {
+            stride = image.width() * sizeof(P);
+            CheckFits(slot, image.width(), image.height(), stride);
+            for (auto y = 0; y < image.height(); ++y) {
+                std::memcpy(SlotData(slot) + y * stride, image.RowPtr(y), stride);
+            }
+        }
+
+        CheckFits(slot, image.width(), image.height(), stride);
+        const ServiceRequest request = { ++sequence_, static_cast<uint32_t>(slot), static_cast<uint32_t>(Format<P>()), static_cast<uint32_t>(image.width()), static_cast<uint32_t>(image.height()), stride };
+        if (!SendServiceMessage(fd_, &request, sizeof(request))) throw std::runtime_error("The detection service closed the connection");
+        in_flight_.push_back(slot);
+    }
+
+    // Waits for the corners of the oldest frame that was submitted. Throws if the service couldn't process it.
+    CornerList Receive() {
+        if (in_flight_.empty()) throw std::logic_error("No frames have been submitted");
+
+        ServiceReply reply;
+        if (!ReceiveReply(reply)) throw std::runtime_error("The detection service closed the connection");
+
+        const auto slot = in_flight_.front();
+        in_flight_.pop_front();
+        if (reply.status != static_cast<uint32_t>(ServiceStatus::kOk)) throw std::runtime_error(ServiceStatusMessage(reply.status));
+        if (reply.count > slot_size_ / sizeof(Corner)) throw std::runtime_error("The detection service returned more corners than fit in a slot");
+
+        CornerList corners(reply.count);
+        std::memcpy(corners.data(), SlotData(slot), corners.size() * sizeof(Corner));
+        return corners;
+    }
+
+private:
+    // Large enough for a 4K BGRA frame
+    static constexpr uint64_t kDefaultSlotSize = 3840 * 2160 * sizeof(Argb32);
+
+    int fd_;
+    std::shared_ptr<uint8_t> slots_;
+    uint32_t slot_count_;
+    uint64_t slot_size_;
+    uint64_t sequence_;
+    std::deque<size_t> in_flight_;
+
+    uint8_t* SlotData(size_t slot) const { return slots_.get() + slot * slot_size_; }
+
+    void CheckFits(size_t slot, int width, int height, size_t stride) const {
+        if (slot >= slot_count_) throw std::out_of_range("The slot index is out of range");
+        if (width <= 0 || height <= 0 || stride * height > slot_size_) throw std::invalid_argument("The frame does not fit in a shared memory slot");
+    }
+
+    bool ReceiveReply(ServiceReply& reply) {
+        int attached_fd;
+        const auto received = ReceiveServiceMessage(fd_, &reply, sizeof(reply), attached_fd);
+        if (attached_fd >= 0) close(attached_fd);
+        return received == sizeof(reply);
+    }
+
+    template <class P> static StreamPixelFormat Format();
+};
+
+template <> inline StreamPixelFormat DetectionClient::Format<Argb32>() { return StreamPixelFormat::kBgra; }
+template <> inline StreamPixelFormat DetectionClient::Format<Bgr24>() { return StreamPixelFormat::kBgr; }
+template <> inline StreamPixelFormat DetectionClient::Format<uint8_t>() { return StreamPixelFormat::kGrey; }
+}
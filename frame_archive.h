@@ -0,0 +1,190 @@
+#pragma once
+// Raw frame archives: uncompressed frames stored back to back so they can be memory mapped rather than decoded
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "aligned_allocator.h"
+#include "frame_stream.h"
+#include "image.h"
+
+namespace harris {
+
+// The header at the start of a frame archive (in host byte order).
+// Frames start at data_offset and are frame_size bytes apart. Both are multiples of the page size, so every frame of a
+// mapped archive is page aligned and can be used in place by OpenCL devices that share host memory.
+struct FrameArchiveHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t pixel_format;  // A StreamPixelFormat
+    uint32_t width;
+    uint32_t height;
+    uint64_t stride;
+    uint64_t frame_size;
+    uint64_t frame_count;
+    uint64_t data_offset;
+};
+
+constexpr char kFrameArchiveMagic[8] = { 'H', 'A', 'R', 'R', 'I', 'S', 'F', 'A' };
+constexpr uint32_t kFrameArchiveVersion = 1;
+
+// Writes frames to a new archive. Every frame must have the size and pixel format given to the constructor.
+class FrameArchiveWriter {
+public:
+
+    FrameArchiveWriter(const std::string& path, int width, int height, StreamPixelFormat format) :
+        out_(path, std::ios::binary | std::ios::trunc),
+        header_() {
+        if (width <= 0) throw std::invalid_argument("The width parameter must be larger than zero");
+        if (height <= 0) throw std::invalid_argument("The height parameter must be larger than zero");
+        if (!out_) throw std::invalid_argument("Failed to create frame archive " + path);
+
+        std::memcpy(header_.magic, kFrameArchiveMagic, sizeof(header_.magic));
+        header_.version = kFrameArchiveVersion;
+        header_.pixel_format = static_cast<uint32_t>(format);
+        header_.width = width;
+        header_.height = height;
+        header_.stride = width * BytesPerPixel(format);
+        header_.frame_size = RoundUpToPage(header_.stride * height);
+        header_.frame_count = 0;
+        header_.data_offset = RoundUpToPage(sizeof(FrameArchiveHeader));
+
+        // The header is written again with the final frame count by Close
+        WriteHeader();
+        padding_.assign(kPageSize, '\0');
+        out_.write(padding_.data(), header_.data_offset - sizeof(FrameArchiveHeader));
+    }
+
+    // Rule of five: Neither movable nor copyable
+    FrameArchiveWriter(const FrameArchiveWriter&) = delete;
+    FrameArchiveWriter(FrameArchiveWriter&&) = delete;
+    FrameArchiveWriter& operator=(const FrameArchiveWriter&) = delete;
+    FrameArchiveWriter& operator=(FrameArchiveWriter&&) = delete;
+
+    ~FrameArchiveWriter() {
+        if (out_.is_open()) Close();
+    }
+
+    // Appends a frame of width*height pixels whose rows are stride bytes apart
+    void Append(const uint8_t* data, size_t stride) {
+        if (stride < header_.stride) throw std::invalid_argument("The stride paramter is not large enough to fit the width of the frame");
+
+        for (auto y = 0U; y < header_.height; ++y) {
+            out_.write(reinterpret_cast<const char*>(data + y * stride), header_.stride);
+        }
+
+        out_.write(padding_.data(), header_.frame_size - header_.stride * header_.height);
+        ++header_.frame_count;
+    }
+
+    template <class P>
+    void Append(const Image<P>& image) {
+        if (image.width() != static_cast<int>(header_.width) || image.height() != static_cast<int>(header_.height)) throw std::invalid_argument("Every frame of an archive must be the same size");
+        if (sizeof(P) != BytesPerPixel(static_cast<StreamPixelFormat>(header_.pixel_format))) throw std::invalid_argument("The image pixel type does not match the archive pixel format");
+        Append(image.data(), image.stride());
+    }
+
+    // Writes the final frame count and closes the file. Returns false if any write failed.
+    bool Close() {
+        out_.seekp(0);
+        WriteHeader();
+        out_.close();
+        return !out_.fail();
+    }
+
+    int width() const { return header_.width; }
+    int height() const { return header_.height; }
+    size_t frame_count() const { return header_.frame_count; }
+
+private:
+    std::ofstream out_;
+    FrameArchiveHeader header_;
+    std::string padding_;
+
+    static uint64_t RoundUpToPage(uint64_t size) {
+        return (size + kPageSize - 1) / kPageSize * kPageSize;
+    }
+
+    void WriteHeader() {
+        out_.write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+    }
+};
+
+// A memory mapped frame archive.
+// Frames are returned as views over the mapping, so reading a frame never copies or decodes it. Once the archive is in the
+// page cache, running over it again does not touch the disk at all.
+// The mapping is private and writable, so frames can be drawn on without changing the file.
+class FrameArchive {
+public:
+
+    explicit FrameArchive(const std::string& path) :
+        header_() {
+        const auto fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::invalid_argument("Failed to open frame archive " + path);
+
+        struct stat info;
+        const auto size = fstat(fd, &info) == 0 ? static_cast<size_t>(info.st_size) : 0;
+        if (size < sizeof(FrameArchiveHeader)) {
+            close(fd);
+            throw std::invalid_argument(path + " is not a frame archive");
+        }
+
+        const auto mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) throw std::invalid_argument("Failed to map frame archive " + path);
+
+        // Frames are normally read in order
+        madvise(mapping, size, MADV_SEQUENTIAL);
+        mapping_ = std::shared_ptr<uint8_t>(static_cast<uint8_t*>(mapping), [size](uint8_t* ptr) { munmap(ptr, size); });
+
+        std::memcpy(&header_, mapping_.get(), sizeof(header_));
+        if (std::memcmp(header_.magic, kFrameArchiveMagic, sizeof(header_.magic)) != 0) throw std::invalid_argument(path + " is not a frame archive");
+        if (header_.version != kFrameArchiveVersion) throw std::invalid_argument(path + " has an unsupported frame archive version");
+        if (header_.pixel_format > static_cast<uint32_t>(StreamPixelFormat::kGrey)) throw std::invalid_argument(path + " has an unsupported pixel format");
+        if (header_.width == 0 || header_.height == 0) throw std::invalid_argument(path + " has frames without any pixels");
+
+        // The sizes are checked with divisions rather than products, which a corrupt header could make wrap around
+        if (header_.stride < header_.width * BytesPerPixel(format()) || header_.frame_size / header_.height < header_.stride) throw std::invalid_argument(path + " has an invalid frame layout");
+        if (header_.data_offset > size || header_.frame_count > (size - header_.data_offset) / header_.frame_size) throw std::invalid_argument(path + " is truncated");
+    }
+
+    // Returns true if a file starts with the frame archive magic number
+    static bool IsArchive(const std::string& path) {
+        std::ifstream in(path, std::ios::binary);
+        char magic[sizeof(kFrameArchiveMagic)];
+        return in.read(magic, sizeof(magic)) && std::memcmp(magic, kFrameArchiveMagic, sizeof(magic)) == 0;
+    }
+
+    int width() const { return header_.width; }
+    int height() const { return header_.height; }
+    size_t stride() const { return header_.stride; }
+    size_t frame_count() const { return header_.frame_count; }
+    StreamPixelFormat format() const { return static_cast<StreamPixelFormat>(header_.pixel_format); }
+
+    // Returns a pointer to the first pixel of a frame
+    uint8_t* FrameData(size_t index) {
+        if (index >= header_.frame_count) throw std::out_of_range("The frame index is out of range");
+        return mapping_.get() + header_.data_offset + index * header_.frame_size;
+    }
+
+    // Returns a frame as an image that views the mapping. The mapping is kept alive by the image.
+    template <class P>
+    Image<P> Frame(size_t index) {
+        if (sizeof(P) != BytesPerPixel(format())) throw std::invalid_argument("The image pixel type does not match the archive pixel format");
+        return Image<P>(std::shared_ptr<uint8_t>(mapping_, FrameData(index)), width(), height(), stride());
+    }
+
+private:
+    FrameArchiveHeader header_;
+    std::shared_ptr<uint8_t> mapping_;
+};
+}
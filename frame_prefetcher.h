@@ -0,0 +1,127 @@
+#pragma once
+// Decodes video frames on a separate thread ahead of the frame loop
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "opencv2/opencv.hpp"
+
+namespace harris {
+
+// Reads frames from a cv::VideoCapture on a background thread so that decoding overlaps with corner detection.
+// Decoded frames are kept in a ring of cv::Mats that is reused for the whole video, so no frame is allocated after the first
+// few. The ring is a single producer, single consumer queue without locks: the decoding thread only advances the head and
+// the thread calling Next only advances the tail.
+// Up to depth frames are decoded ahead of the frame returned by Next, so decode latency is hidden as long as processing a
+// frame takes longer than decoding one. Several frames can be held at once with Take and Release, without copying them.
+class FramePrefetcher {
+public:
+
+    // Starts decoding an opened video. depth is the number of frames decoded ahead.
+    // The video must outlive the prefetcher and must not be used by anything else until the prefetcher is destroyed.
+    FramePrefetcher(cv::VideoCapture& video, int depth = 4) :
+        video_(video),
+        slots_(),
+        head_(0),
+        tail_(0),
+        held_(0),
+        finished_(false),
+        stopped_(false) {
+        if (depth <= 0) throw std::invalid_argument("The depth parameter must be larger than zero");
+        if (!video_.isOpened()) throw std::invalid_argument("The video must be opened");
+
+        slots_.resize(depth + 1);
+        thread_ = std::thread([this]() { Decode(); });
+    }
+
+    // Rule of five: Neither movable nor copyable
+    FramePrefetcher(const FramePrefetcher&) = delete;
+    FramePrefetcher(FramePrefetcher&&) = delete;
+    FramePrefetcher& operator=(const FramePrefetcher&) = delete;
+    FramePrefetcher& operator=(FramePrefetcher&&) = delete;
+
+    ~FramePrefetcher() {
+        stopped_.store(true, std::memory_order_release);
+        thread_.join();
+    }
+
+    // Waits for the next frame and points frame at it. Returns false at the end of the video.
+    // The frame shares the memory of its slot in the ring. It stays valid until the next call to Next, after which the slot
+    // is reused for a later frame.
+    bool Next(cv::Mat& frame) {
+        // Hand the previous frames back to the decoding thread
+        tail_.store(tail_.load(std::memory_order_relaxed) + held_, std::memory_order_release);
+        held_ = 0;
+        return Take(frame);
+    }
+
+    // Like Next, but keeps every frame taken before valid as well (e.g. while they are in flight on a HarrisScheduler).
+    // Each frame stays valid until it is handed back with Release, oldest first. Up to depth() + 1 frames can be held.
+    bool Take(cv::Mat& frame) {
+        if (held_ >= slots_.size()) throw std::logic_error("Every frame of the prefetcher is already held");
+
+        const auto next = tail_.load(std::memory_order_relaxed) + held_;
+        for (auto spins = 0; head_.load(std::memory_order_acquire) == next; ++spins) {
+            // Check finished_ before head_ again so a frame published just before the end is not missed
+            if (finished_.load(std::memory_order_acquire) && head_.load(std::memory_order_acquire) == next) return false;
+            Wait(spins);
+        }
+
+        frame = slots_[next % slots_.size()];
+        ++held_;
+        return true;
+    }
+
+    // Hands the oldest frame held back to the decoding thread, so its slot can be reused
+    void Release() {
+        if (held_ == 0) throw std::logic_error("No frames are held");
+        tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        --held_;
+    }
+
+    size_t depth() const { return slots_.size() - 1; }
+
+private:
+    cv::VideoCapture& video_;
+    std::vector<cv::Mat> slots_;
+
+    // Number of frames decoded (written by the decoding thread) and released (written by Next).
+    // They are kept on separate cache lines so the two threads do not invalidate each other's line on every frame.
+    alignas(64) std::atomic<size_t> head_;
+    alignas(64) std::atomic<size_t> tail_;
+
+    size_t held_;  // Frames returned by Next or Take that haven't been handed back yet
+    std::atomic<bool> finished_;
+    std::atomic<bool> stopped_;
+    std::thread thread_;
+
+    // Runs on the decoding thread until the video ends or the prefetcher is destroyed
+    void Decode() {
+        auto head = head_.load(std::memory_order_relaxed);
+        while (!stopped_.load(std::memory_order_acquire)) {
+            // Wait for a free slot. One slot is always left for the frame held by the consumer.
+            for (auto spins = 0; head - tail_.load(std::memory_order_acquire) >= slots_.size(); ++spins) {
+                if (stopped_.load(std::memory_order_acquire)) return;
+                Wait(spins);
+            }
+
+            // Decoding into the same Mat reuses its memory once the first frame has been decoded into it
+            if (!video_.read(slots_[head % slots_.size()])) break;
+            head_.store(++head, std::memory_order_release);
+        }
+
+        finished_.store(true, std::memory_order_release);
+    }
+
+    // Backs off while waiting on the other thread: yields at first, then sleeps so a full or empty ring does not take a core
+    // away from the detector
+    static void Wait(int spins) {
+        if (spins < 64) std::this_thread::yield();
+        else std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+};
+}
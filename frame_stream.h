@@ -0,0 +1,181 @@
+#pragma once
+// Reads uncompressed frames from a stream (e.g. stdin or a FIFO) and writes corner lists as text lines
+
+#include <cstdio>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "corner_list.h"
+#include "image.h"
+
+namespace harris {
+
+// Pixel formats of the frames in a stream
+enum class StreamPixelFormat {
+    kBgra,  // Argb32 (B, G, R, A bytes)
+    kBgr,   // Bgr24
+    kGrey,  // One byte per pixel (the Y plane of Y4M streams)
+};
+
+// Returns the number of bytes per pixel of a stream pixel format
+inline size_t BytesPerPixel(StreamPixelFormat format) {
+    switch (format) {
+        case StreamPixelFormat::kBgra: return sizeof(Argb32);
+        case StreamPixelFormat::kBgr: return sizeof(Bgr24);
+        default: return sizeof(uint8_t);
+    }
+}
+
+// Reads fixed-size uncompressed frames from a stream directly into reused images.
+// Two stream formats are supported:
+//   - YUV4MPEG2 (Y4M) with 8 bit 420, 422, 444 or mono chroma. Only the Y plane is kept, as a greyscale frame.
+//   - A one line header "HARRIS-RAW <width> <height> <bgra|bgr|grey>" followed by frames of width*height pixels with no padding.
+// Streams are read sequentially, so pipes and FIFOs work as well as files.
+class FrameStreamReader {
+public:
+
+    // Reads the stream header. The file is not closed by the reader.
+    explicit FrameStreamReader(FILE* file) :
+        file_(file),
+        width_(0),
+        height_(0),
+        format_(StreamPixelFormat::kGrey),
+        is_y4m_(false),
+        skip_bytes_(0) {
+        if (file_ == nullptr) throw std::invalid_argument("The file parameter must not be null");
+
+        std::string magic;
+        std::istringstream header(ReadLine());
+        header >> magic;
+        if (magic == "YUV4MPEG2") ParseY4mHeader(header);
+        else if (magic == "HARRIS-RAW") ParseRawHeader(header);
+        else throw std::invalid_argument("The stream must start with a YUV4MPEG2 or HARRIS-RAW header");
+
+        if (width_ <= 0 || height_ <= 0) throw std::invalid_argument("The stream header must give a width and height larger than zero");
+    }
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+    StreamPixelFormat format() const { return format_; }
+
+    // Reads the next frame into an image of width() x height(), which is only allocated if it is empty.
+    // The pixel type of the image must match format(). Returns false at the end of the stream.
+    template <class P>
+    bool Read(Image<P>& image) {
+        if (sizeof(P) != BytesPerPixel(format_)) throw std::invalid_argument("The image pixel type does not match the stream pixel format");
+        if (image.empty()) image = Image<P>(width_, height_);
+
+        if (is_y4m_) {
+            const auto frame_header = ReadLine();
+            if (frame_header.empty() && std::feof(file_)) return false;
+            if (frame_header.compare(0, 5, "FRAME") != 0) throw std::invalid_argument("Expected a Y4M FRAME header");
+        }
+
+        const auto row_size = width_ * sizeof(P);
+        for (auto y = 0; y < height_; ++y) {
+            if (std::fread(image.RowPtr(y), 1, row_size, file_) != row_size) {
+                if (y == 0 && !is_y4m_ && std::feof(file_)) return false;
+                throw std::invalid_argument("The stream ended in the middle of a frame");
+            }
+        }
+
+        // Chroma planes can't be skipped with fseek on a pipe, so they are read into a scratch buffer
+        if (skip_bytes_ > 0) {
+            skip_buffer_.resize(skip_bytes_);
+            if (std::fread(skip_buffer_.data(), 1, skip_bytes_, file_) != skip_bytes_) throw std::invalid_argument("The stream ended in the middle of a frame");
+        }
+
+        return true;
+    }
+
+private:
+    FILE* file_;
+    int width_;
+    int height_;
+    StreamPixelFormat format_;
+    bool is_y4m_;
+    size_t skip_bytes_;
+    std::vector<uint8_t> skip_buffer_;
+
+    // Reads up to (and discards) the next newline. Returns an empty string at the end of the stream.
+    std::string ReadLine() {
+        std::string line;
+        for (auto c = std::getc(file_); c != EOF && c != '\n'; c = std::getc(file_)) {
+            line.push_back(static_cast<char>(c));
+        }
+
+        return line;
+    }
+
+    void ParseY4mHeader(std::istringstream& header) {
+        is_y4m_ = true;
+        format_ = StreamPixelFormat::kGrey;
+
+        // Chroma subsampling defaults to 420 when the header doesn't give one
+        std::string colour_space = "420";
+        std::string token;
+        while (header >> token) {
+            if (token[0] == 'W') width_ = std::stoi(token.substr(1));
+            else if (token[0] == 'H') height_ = std::stoi(token.substr(1));
+            else if (token[0] == 'C') colour_space = token.substr(1);
+        }
+
+        const auto chroma_width = (width_ + 1) / 2;
+        const auto chroma_height = (height_ + 1) / 2;
+        const auto high_bit_depth = colour_space.find("p1") != std::string::npos || colour_space.find("p9") != std::string::npos;
+        if (high_bit_depth) throw std::invalid_argument("Only 8 bit Y4M streams are supported");
+        if (colour_space.compare(0, 3, "420") == 0) skip_bytes_ = 2 * chroma_width * chroma_height;
+        else if (colour_space == "422") skip_bytes_ = 2 * chroma_width * height_;
+        else if (colour_space == "444") skip_bytes_ = 2 * width_ * height_;
+        else if (colour_space == "mono") skip_bytes_ = 0;
+        else throw std::invalid_argument("Unsupported Y4M colour space C" + colour_space);
+    }
+
+    void ParseRawHeader(std::istringstream& header) {
+        std::string format;
+        header >> width_ >> height_ >> format;
+        if (format == "bgra") format_ = StreamPixelFormat::kBgra;
+        else if (format == "bgr") format_ = StreamPixelFormat::kBgr;
+        else if (format == "grey") format_ = StreamPixelFormat::kGrey;
+        else throw std::invalid_argument("Unsupported HARRIS-RAW pixel format " + format);
+    }
+};
+
+// Writes the corners of a frame as a single line: "<frame> <count> <x> <y> <response> <x> <y> <response> ..."
+// The line is formatted into a reused buffer and written with one call so a frame is never split between writes.
+class CornerLineWriter {
+public:
+
+    // Writes to the given file (e.g. stdout). The file is not closed by the writer.
+    explicit CornerLineWriter(FILE* file) :
+        file_(file) {
+        if (file_ == nullptr) throw std::invalid_argument("The file parameter must not be null");
+    }
+
+    void Write(size_t frame, const CornerList& corners) {
+        line_.clear();
+        Append("%zu %zu", frame, corners.size());
+        for (const auto& corner : corners) {
+            Append(" %d %d %.9g", corner.x, corner.y, corner.response);
+        }
+
+        line_.push_back('\n');
+        std::fwrite(line_.data(), 1, line_.size(), file_);
+    }
+
+    void Flush() { std::fflush(file_); }
+
+private:
+    FILE* file_;
+    std::string line_;
+
+    template <class... Args>
+    void Append(const char* format, Args... args) {
+        char field[64];
+        const auto length = std::snprintf(field, sizeof(field), format, args...);
+        line_.append(field, length);
+    }
+};
+}
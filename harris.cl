@@ -1,34 +1,139 @@
 __constant sampler_t reflect_sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_MIRRORED_REPEAT | CLK_FILTER_NEAREST;
 __constant sampler_t clamp_sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
 
-// Converts ARGB image into a greyscale image
-__kernel void Argb32ToFloat (
-    __read_only image2d_t src,
-    __write_only image2d_t dest) {
-    const int2 pos = {get_global_id(0), get_global_id(1)};
-    const float4 in = read_imagef(src, clamp_sampler, pos);
-    const float4 out = (float4)(in.x * 0.2126f + in.y * 0.7152f + in.z * 0.0722f);
-    write_imagef(dest, pos, out);
+// The algorithm parameters are passed to the kernels as arguments so they can change without rebuilding the program.
+// A program can still be specialized for one parameter set by defining these at build time, in which case the
+// kernel arguments are ignored and the compiler can unroll the window loops.
+#ifndef HALF_SMOOTHING
+#define HALF_SMOOTHING half_smoothing
+#endif
+
+#ifndef HALF_STRUCTURE
+#define HALF_STRUCTURE half_structure
+#endif
+
+#ifndef HALF_SUPPRESSION
+#define HALF_SUPPRESSION half_suppression
+#endif
+
+#ifndef HARRIS_K
+#define HARRIS_K harris_k
+#endif
+
+#ifndef THRESHOLD_RATIO
+#define THRESHOLD_RATIO threshold_ratio
+#endif
+
+// The 2D kernels may be run over a global range that has been rounded up to a multiple of the local work size,
+// so each of them ignores work items that are outside the image.
+
+// Reflects a coordinate into the range [0, max] (i.e. a value 2 beyond the edge is reflected 2 from the edge).
+// Values more than max beyond an edge keep being reflected between the edges, so thin bands and tiles are never read outside.
+int ReflectIndex(int value, int max) {
+    if (max <= 0) return 0;
+    value = (value < 0 ? -value : value) % (max + max);
+    return value > max ? max + max - value : value;
 }
 
-// Runs a gaussian smoothing kernel over an image
-__kernel void Smoothing (
-    __read_only image2d_t src,
+// Each work item of the buffer kernels computes VECTOR_WIDTH horizontally adjacent pixels.
+// VECTOR_WIDTH is set when the program is built (4 or 8 to match the SIMD width of the device).
+#ifndef VECTOR_WIDTH
+#define VECTOR_WIDTH 4
+#endif
+
+#if VECTOR_WIDTH == 8
+typedef float8 floatv;
+typedef uint8 uintv;
+#define VLOAD vload8
+#define VSTORE vstore8
+#define CONVERT_FLOATV convert_float8
+#define LANE_INDICES (uint8)(0, 1, 2, 3, 4, 5, 6, 7)
+#elif VECTOR_WIDTH == 4
+typedef float4 floatv;
+typedef uint4 uintv;
+#define VLOAD vload4
+#define VSTORE vstore4
+#define CONVERT_FLOATV convert_float4
+#define LANE_INDICES (uint4)(0, 1, 2, 3)
+#else
+#error VECTOR_WIDTH must be 4 or 8
+#endif
+
+// The input is read straight from the packed bytes of the host image (src_pitch bytes per row) in the pixel format selected
+// when the program is built and converted to luma (Rec.709, as in harris::ToFloat) as it is loaded.
+#define PIXEL_ARGB32 0
+#define PIXEL_BGR24 1
+#define PIXEL_GREY8 2
+
+#ifndef PIXEL_FORMAT
+#define PIXEL_FORMAT PIXEL_ARGB32
+#endif
+
+// Returns the luma of the input pixel at (x, y). Pixels outside the image are reflected back into it.
+float Luma(__global const uchar* src, int src_pitch, int x, int y, int width, int height) {
+    __global const uchar* row = src + ReflectIndex(y, height - 1) * src_pitch;
+    x = ReflectIndex(x, width - 1);
+#if PIXEL_FORMAT == PIXEL_ARGB32
+    // Argb32 pixels are stored as BGRA bytes, so red is byte 2 (bits 16-23 of the pixel, as in Argb32::red) and blue is byte 0
+    const uint pixel = ((__global const uint*)row)[x];
+    return ((pixel >> 16) & 0xffu) / 255.0f * 0.2126f + ((pixel >> 8) & 0xffu) / 255.0f * 0.7152f + (pixel & 0xffu) / 255.0f * 0.0722f;
+#elif PIXEL_FORMAT == PIXEL_BGR24
+    __global const uchar* pixel = row + 3 * x;
+    return pixel[2] / 255.0f * 0.2126f + pixel[1] / 255.0f * 0.7152f + pixel[0] / 255.0f * 0.0722f;
+#else
+    return row[x] / 255.0f;
+#endif
+}
+
+// Returns the luma of the VECTOR_WIDTH input pixels starting at (x, y). Pixels outside the image are reflected back into it.
+floatv LumaV(__global const uchar* src, int src_pitch, int x, int y, int width, int height) {
+#if PIXEL_FORMAT == PIXEL_ARGB32
+    if (x >= 0 && x + VECTOR_WIDTH - 1 < width) {
+        const uintv in = VLOAD(0, (__global const uint*)(src + ReflectIndex(y, height - 1) * src_pitch) + x);
+        const floatv r = CONVERT_FLOATV((in >> 16) & 0xffu) / 255.0f;
+        const floatv g = CONVERT_FLOATV((in >> 8) & 0xffu) / 255.0f;
+        const floatv b = CONVERT_FLOATV(in & 0xffu) / 255.0f;
+        return r * 0.2126f + g * 0.7152f + b * 0.0722f;
+    }
+#elif PIXEL_FORMAT == PIXEL_GREY8
+    if (x >= 0 && x + VECTOR_WIDTH - 1 < width) {
+        return CONVERT_FLOATV(VLOAD(0, src + ReflectIndex(y, height - 1) * src_pitch + x)) / 255.0f;
+    }
+#endif
+
+    // 24 bit pixels (and pixels near the edges) are loaded one at a time
+    float values[VECTOR_WIDTH];
+    for (int i = 0; i < VECTOR_WIDTH; ++i) {
+        values[i] = Luma(src, src_pitch, x + i, y, width, height);
+    }
+
+    return VLOAD(0, values);
+}
+
+// Runs a gaussian smoothing kernel over the luma of the input.
+// This is the first stage of the algorithm, so the luma conversion is fused into it rather than written to its own image.
+__kernel void SmoothingPacked (
+    __global const uchar* src,
+    int src_pitch,
     __constant float* filterWeights,
-    __write_only image2d_t dest) {
+    __write_only image2d_t dest,
+    int half_smoothing) {
 
     const int2 pos = {get_global_id(0), get_global_id(1)};
+    const int width = get_image_width(dest);
+    const int height = get_image_height(dest);
+    if (pos.x >= width || pos.y >= height) return;
 
-    float4 sum = (float4)(0.0f);
+    float sum = 0.0f;
     int i = 0;
     for (int y = -HALF_SMOOTHING; y <= HALF_SMOOTHING; ++y) {
         for (int x = -HALF_SMOOTHING; x <= HALF_SMOOTHING; ++x) {
-            sum += filterWeights[i] * read_imagef(src, reflect_sampler, pos + (int2)(x,y));
+            sum += filterWeights[i] * Luma(src, src_pitch, pos.x + x, pos.y + y, width, height);
             ++i;
         }
     }
 
-    write_imagef(dest, pos, sum);
+    write_imagef(dest, pos, (float4)(sum));
 }
 
 // Computes dx image
@@ -37,6 +142,7 @@ __kernel void DiffX (
     __write_only image2d_t dest) {
 
     const int2 pos = {get_global_id(0), get_global_id(1)};
+    if (pos.x >= get_image_width(dest) || pos.y >= get_image_height(dest)) return;
     float4 sum = read_imagef(src, reflect_sampler, pos - (int2)(1,0)) - read_imagef(src, reflect_sampler, pos + (int2)(1,0));
     write_imagef(dest, (int2)(pos.x, pos.y), sum);
 }
@@ -47,6 +153,7 @@ __kernel void DiffY (
     __write_only image2d_t dest) {
 
     const int2 pos = {get_global_id(0), get_global_id(1)};
+    if (pos.x >= get_image_width(dest) || pos.y >= get_image_height(dest)) return;
     float4 sum = read_imagef(src, reflect_sampler, pos - (int2)(0,1)) - read_imagef(src, reflect_sampler, pos + (int2)(0,1));
     write_imagef (dest, (int2)(pos.x, pos.y), sum);
 }
@@ -55,9 +162,11 @@ __kernel void DiffY (
 __kernel void Structure (
     __read_only image2d_t i_x,
     __read_only image2d_t i_y,
-    __write_only image2d_t dest) {
+    __write_only image2d_t dest,
+    int half_structure) {
 
     const int2 pos = {get_global_id(0), get_global_id(1)};
+    if (pos.x >= get_image_width(dest) || pos.y >= get_image_height(dest)) return;
     float4 s = (float4)(0.0f);
 
     for (int y = -HALF_STRUCTURE; y <= HALF_STRUCTURE; ++y) {
@@ -77,12 +186,14 @@ __kernel void Structure (
 // Computes the Harris response from the structure tensor image
 __kernel void Response (
     __read_only image2d_t src,
-    __write_only image2d_t dest) {
+    __write_only image2d_t dest,
+    float harris_k) {
 
     const int2 pos = {get_global_id(0), get_global_id(1)};
+    if (pos.x >= get_image_width(dest) || pos.y >= get_image_height(dest)) return;
 
     const float4 s = read_imagef(src, reflect_sampler, pos);
-    const float4 r;
+    float4 r = (float4)(0.0f);
     r.x = (s.x * s.y - s.z * s.z) - HARRIS_K * (s.x + s.y) * (s.x + s.y);
 
     write_imagef(dest, pos, r);
@@ -120,30 +231,346 @@ __kernel void Max (
     row_max_values[0] = row_max;
 }
 
+// A corner as stored in the compact corner list (must match the layout of harris::Corner)
+typedef struct {
+    int x;
+    int y;
+    float response;
+} Corner;
+
+// Returns the response at pos if it is above threshold and the maximum of its suppression window, otherwise 0
+float SuppressedResponse(__read_only image2d_t src, float threshold, int2 pos, int half_suppression) {
+    const float4 max = read_imagef(src, clamp_sampler, pos);
+
+    if (max.x < threshold) return 0.0f;
+
+    for (int y = -HALF_SUPPRESSION; y <= HALF_SUPPRESSION; y++) {
+        for (int x = -HALF_SUPPRESSION; x <= HALF_SUPPRESSION; ++x) {
+            const float4 r = read_imagef(src, reflect_sampler, pos + (int2)(x,y));
+            if (r.x > max.x) return 0.0f;
+        }
+    }
+
+    return max.x;
+}
+
 // Runs non-maximal suppression with a global minimum threshold
 __kernel void NonMaxSuppression (
     __read_only image2d_t src,
     __constant float* src_max,
-    __write_only image2d_t dest) {
+    __write_only image2d_t dest,
+    int half_suppression,
+    float threshold_ratio) {
 
-    float threshold = src_max[0] * THRESHOLD_RATIO;
+    const float threshold = src_max[0] * THRESHOLD_RATIO;
     const int2 pos = {get_global_id(0), get_global_id(1)};
-    const float4 max = read_imagef(src, clamp_sampler, pos);
+    if (pos.x >= get_image_width(dest) || pos.y >= get_image_height(dest)) return;
+    const float response = SuppressedResponse(src, threshold, pos, half_suppression);
+    write_imagef(dest, pos, (float4)(response));
+}
+
+// Runs non-maximal suppression with a global minimum threshold and appends each corner to a compact list.
+// corner_count must be zeroed before the kernel runs. When it ends up larger than capacity, the list was truncated
+// and the kernel needs to be run again with a larger list.
+__kernel void NonMaxSuppressionCompact (
+    __read_only image2d_t src,
+    __constant float* src_max,
+    __global volatile int* corner_count,
+    int capacity,
+    __global Corner* corners,
+    int half_suppression,
+    float threshold_ratio) {
+
+    const float threshold = src_max[0] * THRESHOLD_RATIO;
+    const int2 pos = {get_global_id(0), get_global_id(1)};
+    if (pos.x >= get_image_width(src) || pos.y >= get_image_height(src)) return;
+    const float response = SuppressedResponse(src, threshold, pos, half_suppression);
+    if (response <= 0.0f) return;
+
+    const int index = atomic_inc(corner_count);
+    if (index >= capacity) return;
 
-    if (max.x < threshold) {
-        write_imagef(dest, pos, (float4)0.0f);
+    corners[index].x = pos.x;
+    corners[index].y = pos.y;
+    corners[index].response = response;
+}
+
+// The kernels below are equivalent to the ones above but work on plain float buffers (densely packed, width x height)
+// rather than images. CPU runtimes emulate image sampling in software, so these are much faster there.
+// Except for non-maximal suppression, each work item computes VECTOR_WIDTH horizontally adjacent pixels.
+
+// Loads the VECTOR_WIDTH pixels starting at (x, y). Pixels outside the image are reflected back into it.
+floatv LoadV(__global const float* src, int x, int y, int width, int height) {
+    __global const float* row = src + ReflectIndex(y, height - 1) * width;
+    if (x >= 0 && x + VECTOR_WIDTH - 1 < width) return VLOAD(0, row + x);
+
+    float values[VECTOR_WIDTH];
+    for (int i = 0; i < VECTOR_WIDTH; ++i) {
+        values[i] = row[ReflectIndex(x + i, width - 1)];
+    }
+
+    return VLOAD(0, values);
+}
+
+// Stores the VECTOR_WIDTH pixels starting at (x, y), skipping any that are past the right edge of the image
+void StoreV(floatv value, __global float* dest, int x, int y, int width) {
+    __global float* row = dest + y * width;
+    if (x + VECTOR_WIDTH - 1 < width) {
+        VSTORE(value, 0, row + x);
         return;
     }
 
-    for (int y = -HALF_SUPPRESSION; y <= HALF_SUPPRESSION; y++) {
-        for (int x = -HALF_SUPPRESSION; x <= HALF_SUPPRESSION; ++x) {
-            const float4 r = read_imagef(src, reflect_sampler, pos + (int2)(x,y));
-            if (r.x > max.x) {
-                write_imagef(dest, pos, (float4)0.0f);
-                return;
+    float values[VECTOR_WIDTH];
+    VSTORE(value, 0, values);
+    for (int i = 0; x + i < width; ++i) {
+        row[x + i] = values[i];
+    }
+}
+
+// Returns the VECTOR_WIDTH pixels starting offset pixels into the 2 * VECTOR_WIDTH adjacent pixels held by lo and hi.
+// Sliding this along a window row means each pixel of the row is only loaded once for all of the outputs of a work item.
+floatv Window(floatv lo, floatv hi, int offset) {
+    return shuffle2(lo, hi, LANE_INDICES + (uint)offset);
+}
+
+// Runs a gaussian smoothing kernel over the luma of the input into a buffer (see SmoothingPacked)
+__kernel void SmoothingPackedBuffer (
+    __global const uchar* src,
+    int src_pitch,
+    __constant float* filterWeights,
+    __global float* dest,
+    int half_smoothing,
+    int width,
+    int height) {
+
+    const int x = get_global_id(0) * VECTOR_WIDTH;
+    const int y = get_global_id(1);
+    if (x >= width || y >= height) return;
+
+    floatv sum = (floatv)(0.0f);
+    int i = 0;
+    for (int w_y = -HALF_SMOOTHING; w_y <= HALF_SMOOTHING; ++w_y) {
+        floatv lo = LumaV(src, src_pitch, x - HALF_SMOOTHING, y + w_y, width, height);
+        floatv hi = LumaV(src, src_pitch, x - HALF_SMOOTHING + VECTOR_WIDTH, y + w_y, width, height);
+        int offset = 0;
+        for (int w_x = -HALF_SMOOTHING; w_x <= HALF_SMOOTHING; ++w_x) {
+            if (offset == VECTOR_WIDTH) {
+                lo = hi;
+                hi = LumaV(src, src_pitch, x + w_x + VECTOR_WIDTH, y + w_y, width, height);
+                offset = 0;
             }
+
+            sum += filterWeights[i] * Window(lo, hi, offset);
+            ++offset;
+            ++i;
+        }
+    }
+
+    StoreV(sum, dest, x, y, width);
+}
+
+// Computes dx buffer
+__kernel void DiffXBuffer (
+    __global const float* src,
+    __global float* dest,
+    int width,
+    int height) {
+
+    const int x = get_global_id(0) * VECTOR_WIDTH;
+    const int y = get_global_id(1);
+    if (x >= width || y >= height) return;
+
+    const floatv lo = LoadV(src, x - 1, y, width, height);
+    const floatv hi = LoadV(src, x - 1 + VECTOR_WIDTH, y, width, height);
+    StoreV(lo - Window(lo, hi, 2), dest, x, y, width);
+}
+
+// Computes dy buffer
+__kernel void DiffYBuffer (
+    __global const float* src,
+    __global float* dest,
+    int width,
+    int height) {
+
+    const int x = get_global_id(0) * VECTOR_WIDTH;
+    const int y = get_global_id(1);
+    if (x >= width || y >= height) return;
+
+    const floatv sum = LoadV(src, x, y - 1, width, height) - LoadV(src, x, y + 1, width, height);
+    StoreV(sum, dest, x, y, width);
+}
+
+// Computes the structure tensor buffer (xx, yy, xy, 0 for each pixel) from dx and dy buffers
+__kernel void StructureBuffer (
+    __global const float* i_x,
+    __global const float* i_y,
+    __global float4* dest,
+    int half_structure,
+    int width,
+    int height) {
+
+    const int x = get_global_id(0) * VECTOR_WIDTH;
+    const int y = get_global_id(1);
+    if (x >= width || y >= height) return;
+
+    floatv xx = (floatv)(0.0f);
+    floatv yy = (floatv)(0.0f);
+    floatv xy = (floatv)(0.0f);
+    for (int w_y = -HALF_STRUCTURE; w_y <= HALF_STRUCTURE; ++w_y) {
+        floatv x_lo = LoadV(i_x, x - HALF_STRUCTURE, y + w_y, width, height);
+        floatv x_hi = LoadV(i_x, x - HALF_STRUCTURE + VECTOR_WIDTH, y + w_y, width, height);
+        floatv y_lo = LoadV(i_y, x - HALF_STRUCTURE, y + w_y, width, height);
+        floatv y_hi = LoadV(i_y, x - HALF_STRUCTURE + VECTOR_WIDTH, y + w_y, width, height);
+        int offset = 0;
+        for (int w_x = -HALF_STRUCTURE; w_x <= HALF_STRUCTURE; ++w_x) {
+            if (offset == VECTOR_WIDTH) {
+                x_lo = x_hi;
+                y_lo = y_hi;
+                x_hi = LoadV(i_x, x + w_x + VECTOR_WIDTH, y + w_y, width, height);
+                y_hi = LoadV(i_y, x + w_x + VECTOR_WIDTH, y + w_y, width, height);
+                offset = 0;
+            }
+
+            const floatv s_x = Window(x_lo, x_hi, offset);
+            const floatv s_y = Window(y_lo, y_hi, offset);
+            xx += s_x * s_x;
+            yy += s_y * s_y;
+            xy += s_x * s_y;
+            ++offset;
+        }
+    }
+
+    float xx_values[VECTOR_WIDTH];
+    float yy_values[VECTOR_WIDTH];
+    float xy_values[VECTOR_WIDTH];
+    VSTORE(xx, 0, xx_values);
+    VSTORE(yy, 0, yy_values);
+    VSTORE(xy, 0, xy_values);
+
+    __global float4* row = dest + y * width;
+    for (int i = 0; i < VECTOR_WIDTH && x + i < width; ++i) {
+        row[x + i] = (float4)(xx_values[i], yy_values[i], xy_values[i], 0.0f);
+    }
+}
+
+// Computes the Harris response buffer from the structure tensor buffer
+__kernel void ResponseBuffer (
+    __global const float4* src,
+    __global float* dest,
+    float harris_k,
+    int width,
+    int height) {
+
+    const int x = get_global_id(0) * VECTOR_WIDTH;
+    const int y = get_global_id(1);
+    if (x >= width || y >= height) return;
+
+    __global const float4* row = src + y * width;
+    float xx_values[VECTOR_WIDTH];
+    float yy_values[VECTOR_WIDTH];
+    float xy_values[VECTOR_WIDTH];
+    for (int i = 0; i < VECTOR_WIDTH; ++i) {
+        const float4 s = row[min(x + i, width - 1)];
+        xx_values[i] = s.x;
+        yy_values[i] = s.y;
+        xy_values[i] = s.z;
+    }
+
+    const floatv xx = VLOAD(0, xx_values);
+    const floatv yy = VLOAD(0, yy_values);
+    const floatv xy = VLOAD(0, xy_values);
+
+    const floatv r = (xx * yy - xy * xy) - HARRIS_K * (xx + yy) * (xx + yy);
+    StoreV(r, dest, x, y, width);
+}
+
+// Find the max value of each row of a buffer and places it in a row_max_array
+__kernel void RowMaxBuffer (
+    __global const float* src,
+    __global float* row_max_values,
+    int width) {
+
+    const int y = get_global_id(0);
+    __global const float* row = src + y * width;
+    floatv row_max = (floatv)(0.0f);
+
+    int x = 0;
+    for (; x + VECTOR_WIDTH - 1 < width; x += VECTOR_WIDTH) {
+        row_max = max(row_max, VLOAD(0, row + x));
+    }
+
+    float values[VECTOR_WIDTH];
+    VSTORE(row_max, 0, values);
+    float result = 0.0f;
+    for (int i = 0; i < VECTOR_WIDTH; ++i) {
+        result = max(result, values[i]);
+    }
+
+    for (; x < width; ++x) {
+        result = max(result, row[x]);
+    }
+
+    row_max_values[y] = result;
+}
+
+// Returns the response at (x, y) if it is above threshold and the maximum of its suppression window, otherwise 0
+float SuppressedResponseBuffer(__global const float* src, float threshold, int x, int y, int width, int height, int half_suppression) {
+    const float max = src[y * width + x];
+
+    if (max < threshold) return 0.0f;
+
+    for (int w_y = -HALF_SUPPRESSION; w_y <= HALF_SUPPRESSION; ++w_y) {
+        __global const float* row = src + ReflectIndex(y + w_y, height - 1) * width;
+        for (int w_x = -HALF_SUPPRESSION; w_x <= HALF_SUPPRESSION; ++w_x) {
+            if (row[ReflectIndex(x + w_x, width - 1)] > max) return 0.0f;
         }
     }
 
-    write_imagef(dest, pos, max);
+    return max;
+}
+
+// Runs non-maximal suppression with a global minimum threshold over a buffer
+__kernel void NonMaxSuppressionBuffer (
+    __global const float* src,
+    __constant float* src_max,
+    __global float* dest,
+    int half_suppression,
+    float threshold_ratio,
+    int width,
+    int height) {
+
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+    if (x >= width || y >= height) return;
+
+    const float threshold = src_max[0] * THRESHOLD_RATIO;
+    dest[y * width + x] = SuppressedResponseBuffer(src, threshold, x, y, width, height, half_suppression);
+}
+
+// Runs non-maximal suppression over a buffer and appends each corner to a compact list (see NonMaxSuppressionCompact)
+__kernel void NonMaxSuppressionCompactBuffer (
+    __global const float* src,
+    __constant float* src_max,
+    __global volatile int* corner_count,
+    int capacity,
+    __global Corner* corners,
+    int half_suppression,
+    float threshold_ratio,
+    int width,
+    int height) {
+
+    const int x = get_global_id(0);
+    const int y = get_global_id(1);
+    if (x >= width || y >= height) return;
+
+    const float threshold = src_max[0] * THRESHOLD_RATIO;
+    const float response = SuppressedResponseBuffer(src, threshold, x, y, width, height, half_suppression);
+    if (response <= 0.0f) return;
+
+    const int index = atomic_inc(corner_count);
+    if (index >= capacity) return;
+
+    corners[index].x = x;
+    corners[index].y = y;
+    corners[index].response = response;
 }
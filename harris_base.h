@@ -1,10 +1,21 @@
 #pragma once
 
+#include <string>
+#include <vector>
+
+#include "corner_list.h"
 #include "image.h"
 #include "image_conversion.h"
 
 namespace harris {
 
+// Time taken by one stage of the algorithm (e.g. a single kernel) while processing the last frame
+struct StageTiming {
+    std::string name;
+    double queued_ms;   // Time the stage waited between being queued and starting to run
+    double run_ms;      // Time the stage took to run
+};
+
 class HarrisBase {
 public:
 
@@ -14,11 +25,7 @@ public:
     k_(harris_k),
     threshold_ratio_(threshold_ratio),
     suppression_size_(suppression_size) {
-        if(smoothing_size <= 0 || smoothing_size % 2 == 0) throw std::invalid_argument("smoothing_size must be a positive odd number");
-        if(structure_size <= 0 || structure_size % 2 == 0) throw std::invalid_argument("structure_size must be a positive odd number");
-        if(suppression_size <= 0 || suppression_size % 2 == 0) throw std::invalid_argument("suppression_size must be a positive odd number");
-        if(harris_k <= 0) throw std::invalid_argument("harris_k must be positive");
-        if(threshold_ratio < 0 || threshold_ratio > 1) throw std::invalid_argument("threshold_ratio must be between 0 and 1");
+        ValidateParameters(smoothing_size, structure_size, harris_k, threshold_ratio, suppression_size);
     }
 
     // Rule of five: Neither movable nor copyable
@@ -30,13 +37,42 @@ public:
 
     virtual Image<float> FindCorners(const Image<Argb32>& image) = 0;
 
+    // Runs the Harris corner detector on 24 bit BGR or 8 bit greyscale images.
+    // By default these are converted to Argb32. Implementations that can read them directly should override these.
+    virtual Image<float> FindCorners(const Image<Bgr24>& image) { return FindCorners(ToArgb32(image)); }
+    virtual Image<float> FindCorners(const Image<uint8_t>& image) { return FindCorners(ToArgb32(image)); }
+
+    // Runs the Harris corner detector and returns only the corners that survived non-maximal suppression.
+    // Implementations that can produce the list without building a full corner image should override this.
+    virtual CornerList FindCornerList(const Image<Argb32>& image) { return ToCornerList(FindCorners(image)); }
+    virtual CornerList FindCornerList(const Image<Bgr24>& image) { return ToCornerList(FindCorners(image)); }
+    virtual CornerList FindCornerList(const Image<uint8_t>& image) { return ToCornerList(FindCorners(image)); }
+
+    // Returns the time taken by each stage of the last frame.
+    // Only implementations that can measure individual stages (and have been asked to) return anything.
+    virtual std::vector<StageTiming> StageTimings() const { return {}; }
+
     int smoothing_size() const { return smoothing_size_; }
     int structure_size() const { return structure_size_; }
     int suppression_size() const { return suppression_size_; }
     float k() const { return k_; }
     float threshold_ratio() const { return threshold_ratio_; }
 
+    // Returns the number of pixels on each side of a pixel that affect whether it is a corner
+    // (the combined radius of the smoothing, derivative, structure tensor and suppression windows).
+    // A part of an image extended by this many pixels gives the same corners as the whole image.
+    int halo() const { return smoothing_size_ / 2 + 1 + structure_size_ / 2 + suppression_size_ / 2; }
+
 protected:
+    // Throws std::invalid_argument if any of the algorithm parameters are out of range
+    static void ValidateParameters(int smoothing_size, int structure_size, float harris_k, float threshold_ratio, int suppression_size) {
+        if(smoothing_size <= 0 || smoothing_size % 2 == 0) throw std::invalid_argument("smoothing_size must be a positive odd number");
+        if(structure_size <= 0 || structure_size % 2 == 0) throw std::invalid_argument("structure_size must be a positive odd number");
+        if(suppression_size <= 0 || suppression_size % 2 == 0) throw std::invalid_argument("suppression_size must be a positive odd number");
+        if(harris_k <= 0) throw std::invalid_argument("harris_k must be positive");
+        if(threshold_ratio < 0 || threshold_ratio > 1) throw std::invalid_argument("threshold_ratio must be between 0 and 1");
+    }
+
     int smoothing_size_;
     int structure_size_;
     float k_;
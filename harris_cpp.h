@@ -30,9 +30,26 @@ public:
 
     // Runs the pure C++ Harris corner detector
     Image<float> FindCorners(const Image<Argb32>& image) override {
-        // Convert to float image
-        const auto float_image = ToFloat(image);
+        return FindCornersFloat(ToFloat(image));
+    }
+
+    // Runs the pure C++ Harris corner detector on BGR pixels without converting them to Argb32 first
+    Image<float> FindCorners(const Image<Bgr24>& image) override {
+        return FindCornersFloat(ToFloat(image));
+    }
+
+    // Runs the pure C++ Harris corner detector on greyscale pixels, which are used as luma directly
+    Image<float> FindCorners(const Image<uint8_t>& image) override {
+        return FindCornersFloat(ToFloat(image));
+    }
 
+private:
+    FilterKernel gaussian_kernel_;
+    FilterKernel diff_x_;
+    FilterKernel diff_y_;
+
+    // Runs the Harris corner detector on a luma image
+    Image<float> FindCornersFloat(const Image<float>& float_image) {
         // Compute the structure tensor image
         const auto structure_tensor = StructureTensorImage(float_image);
 
@@ -49,11 +66,6 @@ public:
         return corners;
     }
 
-private:
-    FilterKernel gaussian_kernel_;
-    FilterKernel diff_x_;
-    FilterKernel diff_y_;
-
     // Computes the structure tensor image for a given image.
     Image<StructureTensor> StructureTensorImage(const Image<float>& src) {
         int half_window = structure_size_ / 2;
@@ -1,8 +1,13 @@
 #pragma once
 // Harris corner detection algorithm implemented using OpenCL
 
-#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <iomanip>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <set>
 #include <sstream>
 #include <stdexcept>
 
@@ -10,16 +15,27 @@
 
 #include "cl.hpp"
 #include "harris_base.h"
+#include "harris_cl_source.h"
 #include "filter_2d.h"
+#include "program_cache.h"
+#include "work_size_cache.h"
 
 namespace harris {
 
 class HarrisOpenCL : public HarrisBase {
 public:
 
-    HarrisOpenCL(int platform_num = 0, int device_num = -1, int smoothing_size = 5, int structure_size = 5, float harris_k = 0.04, float threshold_ratio = 0.5, int suppression_size = 9) :
+    // Program binaries are cached in cache_directory so later instances can skip compiling the kernels.
+    // Use an empty cache_directory to always compile from source.
+    // The algorithm parameters are passed to the kernels as arguments, so they can be changed with SetParameters without
+    // rebuilding the program. If specialize is set, a variant of the program with the parameters compiled in is built (and
+    // kept) for each parameter set instead. This is slower to switch but lets the compiler unroll the window loops.
+    HarrisOpenCL(int platform_num = 0, int device_num = -1, int smoothing_size = 5, int structure_size = 5, float harris_k = 0.04, float threshold_ratio = 0.5, int suppression_size = 9, const std::string& cache_directory = DefaultCacheDirectory("opencl"), bool specialize = false) :
         HarrisBase(smoothing_size, structure_size, harris_k, threshold_ratio, suppression_size),
-        gaussian_(GaussianKernel(smoothing_size)) {
+        gaussian_(GaussianKernel(smoothing_size)),
+        program_cache_(cache_directory),
+        work_size_cache_(cache_directory),
+        specialize_(specialize) {
 
         cl::Platform::get(&platforms_);
         std::cout << "Found " << platforms_.size() << " platform(s)" << std::endl;
@@ -47,22 +63,41 @@ public:
             if (device_num < 0) device_num = 0;
         }
 
-        context_ = cl::Context(devices_[device_num]);
+        device_ = devices_[device_num];
+        context_ = cl::Context(device_);
 
-        // GPU and CPU types use different single channel image formats (CL_R or CL_Rx) so I need to figure out which one to use.
-        // TODO: It might be better to just switch these all to float*
+        // Devices that share memory with the host (CPUs and integrated GPUs) can work directly on host images
+        zero_copy_ = device_.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() == CL_TRUE;
+        std::cout << "Zero-copy host memory is " << (zero_copy_ ? "enabled" : "disabled") << std::endl;
+
+        // The image kernels need a single channel float image format, and GPU and CPU types use different ones (CL_R or CL_Rx).
+        // Devices without either use the float buffer kernels, which don't need an image format at all.
         std::vector<cl::ImageFormat> supportedFormats;
         context_.getSupportedImageFormats(CL_MEM_READ_WRITE, CL_MEM_OBJECT_IMAGE2D, &supportedFormats);
         std::cout << "Found " << supportedFormats.size() << " supported format(s)" << std::endl;
-        cl::ImageFormat float_format;
+        auto has_float_format = false;
         for (const auto& format : supportedFormats) {
-            if (format.image_channel_data_type == CL_FLOAT && (format.image_channel_order == CL_R || format.image_channel_order == CL_Rx)) float_format_ = format;
+            if (format.image_channel_data_type == CL_FLOAT && (format.image_channel_order == CL_R || format.image_channel_order == CL_Rx)) {
+                float_format_ = format;
+                has_float_format = true;
+            }
         }
 
+        // CPU runtimes emulate image sampling in software, so they use the float buffer kernels instead
+        use_buffers_ = !has_float_format || device_.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU;
+        std::cout << "Using " << (use_buffers_ ? "buffer" : "image") << " kernels" << std::endl;
+
+        // Frames that don't fit these limits are processed in tiles (see FindCornersTiled)
+        image_max_width_ = device_.getInfo<CL_DEVICE_IMAGE2D_MAX_WIDTH>();
+        image_max_height_ = device_.getInfo<CL_DEVICE_IMAGE2D_MAX_HEIGHT>();
+        max_alloc_size_ = device_.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+        global_mem_size_ = device_.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
 
-        program_ = CreateProgram("harris.cl", context_);
-        BuildProgram(program_, std::vector<cl::Device>({ devices_[device_num] }));
-        queue_ = cl::CommandQueue(context_, devices_[device_num]);
+        // The buffer kernels compute as many adjacent pixels per work item as the device prefers to process at once
+        vector_width_ = device_.getInfo<CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT>() >= 8 ? 8 : 4;
+
+        SelectProgram();
+        queue_ = cl::CommandQueue(context_, device_);
     }
 
     // Rule of five: Neither movable nor copyable
@@ -72,219 +107,633 @@ public:
     HarrisOpenCL& operator=(HarrisOpenCL&&) = delete;
     ~HarrisOpenCL() override = default;
 
-    // Runs the OpenCL Harris corner detector
-    Image<float> FindCorners(const Image<Argb32>& image) override {
+    // Changes the algorithm parameters used for subsequent frames.
+    // Unless the detector specializes its program, this does not require the program to be rebuilt.
+    void SetParameters(int smoothing_size, int structure_size, float harris_k, float threshold_ratio, int suppression_size) {
+        ValidateParameters(smoothing_size, structure_size, harris_k, threshold_ratio, suppression_size);
+        smoothing_size_ = smoothing_size;
+        structure_size_ = structure_size;
+        k_ = harris_k;
+        threshold_ratio_ = threshold_ratio;
+        suppression_size_ = suppression_size;
+        gaussian_ = GaussianKernel(smoothing_size);
+        SelectProgram();
+    }
+
+    // Selects between the float buffer kernels and the image kernels.
+    // The default is chosen by device type, this is mostly useful for testing and benchmarking.
+    void SetBufferKernels(bool enabled) {
+        use_buffers_ = enabled;
+    }
+
+    bool buffer_kernels() const { return use_buffers_; }
+
+    // Selects between using page aligned host memory in place (CL_MEM_USE_HOST_PTR, with mapped readback) and copying it.
+    // The default is zero-copy on devices that report CL_DEVICE_HOST_UNIFIED_MEMORY. Other devices give the same corners
+    // either way, so this is mostly useful for testing and benchmarking.
+    void SetZeroCopy(bool enabled) {
+        zero_copy_ = enabled;
+    }
+
+    bool zero_copy() const { return zero_copy_; }
+
+    // Sets the number of adjacent pixels each work item of the buffer kernels computes (4 or 8).
+    // The default follows CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT. Changing it selects (and if needed builds) another program variant.
+    void SetVectorWidth(int vector_width) {
+        if (vector_width != 4 && vector_width != 8) throw std::invalid_argument("vector_width must be 4 or 8");
+        vector_width_ = vector_width;
+        SelectProgram();
+    }
+
+    int vector_width() const { return vector_width_; }
+
+    // Limits the number of rows of a frame processed at once. Taller frames are processed in tiles (see FindCornersTiled).
+    // By default the limit is derived from the device memory and image size limits. Use 0 to restore the default.
+    void SetMaxTileRows(int max_tile_rows) {
+        if (max_tile_rows < 0) throw std::invalid_argument("max_tile_rows must not be negative");
+        max_tile_rows_ = max_tile_rows;
+    }
+
+    int max_tile_rows() const { return max_tile_rows_; }
+
+    // Enables autotuning of the local work sizes. The first frame of each size uses the sizes stored in the work size cache
+    // for this device, or runs Tune on the frame if there are none.
+    void SetAutotune(bool enabled) {
+        autotune_ = enabled;
+    }
+
+    bool autotune() const { return autotune_; }
+
+    // Returns the local work size used for each 2D kernel (kernels that are not listed are left to the driver)
+    const LocalSizeMap& local_sizes() const { return local_sizes_; }
+
+    // Times a set of candidate local work sizes for each 2D kernel on the given frame and keeps the fastest one.
+    // Kernels are tuned one at a time while the others use the best sizes found so far. The driver's own choice is always
+    // one of the candidates, so tuning never makes a kernel slower. The result is stored in the work size cache.
+    template <class P>
+    void Tune(const Image<P>& image) {
+        const auto was_profiling = profiling_;
+        SetProfiling(true);
+        tuning_ = true;
+        local_sizes_.clear();
+
+        // Run each variant once so every kernel has been built and the 2D kernels are known
+        tunable_kernels_.clear();
+        FindCorners(image);
+        FindCornerList(image);
+
+        for (const auto& name : tunable_kernels_) {
+            const auto max_work_group_size = cl::Kernel(program_, name.c_str()).getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device_);
+            const auto max_work_item_sizes = device_.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+
+            auto best_local_size = LocalSize{ 0, 0 };
+            auto best_time_ms = std::numeric_limits<double>::max();
+            for (const auto& candidate : kLocalSizeCandidates) {
+                if (candidate.first * candidate.second > max_work_group_size) continue;
+                if (candidate.first > max_work_item_sizes[0] || candidate.second > max_work_item_sizes[1]) continue;
+
+                local_sizes_[name] = candidate;
+                const auto time_ms = TimeKernel(image, name);
+                if (time_ms < best_time_ms) {
+                    best_time_ms = time_ms;
+                    best_local_size = candidate;
+                }
+            }
+
+            local_sizes_[name] = best_local_size;
+        }
+
+        tuning_ = false;
+        SetProfiling(was_profiling);
+        tuned_size_ = TunedSize(image);
+        variant_local_sizes_[KernelVariant(image)] = { tuned_size_, local_sizes_ };
+        work_size_cache_.Store(device_, image.width(), image.height(), KernelVariant(image), local_sizes_);
+    }
+
+    // Enables collecting the time taken by each stage of the algorithm (see StageTimings).
+    // The command queue is recreated with CL_QUEUE_PROFILING_ENABLE when profiling is enabled.
+    void SetProfiling(bool enabled) {
+        profiling_ = enabled;
+        queue_ = cl::CommandQueue(context_, device_, enabled ? CL_QUEUE_PROFILING_ENABLE : 0);
+    }
+
+    bool profiling() const { return profiling_; }
+
+    // Returns the timing of each kernel, upload and readback of the last frame (empty unless profiling is enabled)
+    std::vector<StageTiming> StageTimings() const override { return stage_timings_; }
+
+    // Runs the OpenCL Harris corner detector.
+    // Argb32, Bgr24 and greyscale pixels are all read as they are by the first kernel, which converts them to luma.
+    Image<float> FindCorners(const Image<Argb32>& image) override { return FindCornersPacked(image); }
+    Image<float> FindCorners(const Image<Bgr24>& image) override { return FindCornersPacked(image); }
+    Image<float> FindCorners(const Image<uint8_t>& image) override { return FindCornersPacked(image); }
+
+    // Runs the OpenCL Harris corner detector and reads back only the compacted list of corners.
+    // Non-maximal suppression appends each corner to a device-side list so only the corner count and the list itself
+    // are copied back to the host rather than a full corner image.
+    CornerList FindCornerList(const Image<Argb32>& image) override { return FindCornerListPacked(image); }
+    CornerList FindCornerList(const Image<Bgr24>& image) override { return FindCornerListPacked(image); }
+    CornerList FindCornerList(const Image<uint8_t>& image) override { return FindCornerListPacked(image); }
+
+    // Multi-device support (see HarrisOpenCLMulti). A frame can be split into bands of rows processed by different devices.
+    // FindBandMaximum runs the stages up to the Harris response for a band and returns the maximum response of its rows
+    // [first_row, last_row). The remaining rows overlap neighbouring bands and are only there to give the kept rows correct inputs.
+    template <class P>
+    float FindBandMaximum(const Image<P>& band, int first_row, int last_row) {
+        band_width_ = static_cast<size_t>(band.width());
+        band_height_ = static_cast<size_t>(band.height());
+
+        try
+        {
+            // While tiling, the events of every tile are kept until the frame's timings are collected
+            if (!tiling_) frame_events_.clear();
+
+            const auto row_max_complete = EnqueueResponse(band, band_response_, band_row_max_);
+
+            std::vector<float> row_max(band_height_);
+            std::vector<cl::Event> read_prereqs({ row_max_complete });
+            ReadBuffer(band_row_max_, sizeof(float) * band_height_, row_max.data(), &read_prereqs);
+
+            return *std::max_element(row_max.begin() + first_row, row_max.begin() + last_row);
+        }
+        catch(const cl::Error& e)
+        {
+            std::cerr << e.what() << ": " << e.err() << '\n';
+            throw;
+        }
+    }
+
+    // Runs non-maximal suppression on the band started by FindBandMaximum using the maximum response of the whole frame
+    // and returns the corner image of the whole band.
+    Image<float> FindBandCorners(float max_response) {
+        try
+        {
+            // The suppression kernels read the maximum response from the start of the row maxima
+            cl::Event max_written;
+            queue_.enqueueWriteBuffer(band_row_max_, CL_FALSE, 0, sizeof(float), &max_response, nullptr, &max_written);
+            Record("Upload", max_written);
+
+            auto corners = Suppress(band_response_, band_row_max_, max_written, band_width_, band_height_);
+            band_response_ = cl::Memory();
+            band_row_max_ = cl::Buffer();
+
+            CollectTimings();
+            return corners;
+        }
+        catch(const cl::Error& e)
+        {
+            std::cerr << e.what() << ": " << e.err() << '\n';
+            throw;
+        }
+    }
+
+    // Processes a frame in horizontal tiles of tile_rows rows (plus the halo on each side) so that frames larger than the
+    // device memory or image size limits can still be processed. Tiles view the rows of the frame in place, and every tile has
+    // the same size so the device buffers and images are reused for all of them.
+    // The threshold needs the maximum response of the whole frame, so each tile is run twice: once to find its maximum and
+    // again to suppress it using the maximum of all tiles. The second pass runs backwards so the last tile of the first pass,
+    // whose response is still on the device, doesn't need to be recomputed.
+    // The stage timings of the frame are the totals over every tile. With autotuning the local sizes are selected for the size
+    // of the tiles, which is the size every kernel runs at.
+    template <class P>
+    Image<float> FindCornersTiled(const Image<P>& image, int tile_rows) {
+        if (autotune_ && !tuning_) SelectLocalSizes(TileImage(image, TileWindow(image.height(), { 0, tile_rows }, tile_rows)));
+        frame_events_.clear();
+        stage_timings_.clear();
+        tiling_ = true;
+        try
+        {
+            auto corners = FindTiles(image, tile_rows);
+            tiling_ = false;
+            return corners;
+        }
+        catch(...)
+        {
+            tiling_ = false;
+            throw;
+        }
+    }
+
+    // Returns the name of the device used by this detector
+    std::string device_name() const { return device_.getInfo<CL_DEVICE_NAME>(); }
+
+private:
+    std::vector<cl::Device> devices_;
+    std::vector<cl::Platform> platforms_;
+    cl::Device device_;
+    cl::Context context_;
+    cl::Program program_;
+    std::map<std::string, cl::Program> programs_;
+    cl::CommandQueue queue_;
+    cl::ImageFormat float_format_;
+    FilterKernel gaussian_;
+    ProgramCache program_cache_;
+    WorkSizeCache work_size_cache_;
+    LocalSizeMap local_sizes_;
+    std::map<std::string, std::pair<std::string, LocalSizeMap>> variant_local_sizes_;  // The tuned size and local sizes of each kernel variant
+    std::set<std::string> tunable_kernels_;
+    std::string tuned_size_;
+    bool autotune_ = false;
+    bool tuning_ = false;
+    bool tiling_ = false;
+    bool specialize_;
+    bool zero_copy_;
+    bool use_buffers_;
+    int vector_width_;
+    int pixel_format_ = kPixelArgb32;
+    int max_tile_rows_ = 0;
+    size_t image_max_width_;
+    size_t image_max_height_;
+    cl_ulong max_alloc_size_;
+    cl_ulong global_mem_size_;
+    std::map<std::string, cl::Buffer> pooled_buffers_;
+    std::map<std::string, cl::Image2D> pooled_images_;
+    bool profiling_ = false;
+    size_t corner_capacity_ = 1024;
+    std::vector<std::pair<std::string, cl::Event>> frame_events_;
+    std::vector<StageTiming> stage_timings_;
+    cl::Memory band_response_;
+    cl::Buffer band_row_max_;
+    size_t band_width_ = 0;
+    size_t band_height_ = 0;
+
+    // Runs the OpenCL Harris corner detector on any of the packed pixel formats
+    template <class P>
+    Image<float> FindCornersPacked(const Image<P>& image) {
+        CheckFrameSize(image);
         const auto width = static_cast<size_t>(image.width());
         const auto height = static_cast<size_t>(image.height());
 
+        // Frames wider than the largest image the device supports can only use the buffer kernels
+        if (!use_buffers_ && width > image_max_width_) return FindCornersWithBuffers(image);
+
+        const auto tile_rows = TileRows(image);
+        if (tile_rows < image.height()) return FindCornersTiled(image, tile_rows);
+
         try
         {
-            cl::Image2D argb_image(
-                context_, 
-                CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 
-                cl::ImageFormat{ CL_RGBA, CL_UNORM_INT8 },
-                width,
-                height,
-                image.stride(),
-                const_cast<uint8_t*>(image.data()));
-
-            cl::Kernel argb32_to_float_kernel(program_, "Argb32ToFloat");
-
-            cl::Image2D float_image(
-                context_, 
-                CL_MEM_READ_WRITE,
-                float_format_,
-                width,
-                height);
-
-            argb32_to_float_kernel.setArg(0, argb_image);
-            argb32_to_float_kernel.setArg(1, float_image);
-
-            cl::Event argb32_to_float_complete;
-            queue_.enqueueNDRangeKernel(
-                argb32_to_float_kernel,
-                cl::NullRange,
-                cl::NDRange{ width, height },
-                cl::NullRange,
-                nullptr,
-                &argb32_to_float_complete);
-
-            cl::Kernel smoothing_kernel(program_, "Smoothing");
-
-            cl::Buffer gaussian_buffer(
-                context_, 
-                CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, 
-                sizeof(float) * gaussian_.width() * gaussian_.height(), 
-                gaussian_.data());
-
-            cl::Image2D smooth_image(
-                context_, 
-                CL_MEM_READ_WRITE, 
-                float_format_,
-                width,
-                height);
-
-            smoothing_kernel.setArg(0, float_image);
-            smoothing_kernel.setArg(1, gaussian_buffer);
-            smoothing_kernel.setArg(2, smooth_image);
-
-            cl::Event smoothing_complete;
-            std::vector<cl::Event> smoothing_prereqs({ argb32_to_float_complete });
-            queue_.enqueueNDRangeKernel(
-                smoothing_kernel,
-                cl::NullRange,
-                cl::NDRange{ width, height},
-                cl::NullRange,
-                &smoothing_prereqs,
-                &smoothing_complete);
-
-            cl::Kernel diff_x_kernel(program_, "DiffX");
-
-            cl::Image2D i_x_image(
-                context_, 
-                CL_MEM_READ_WRITE, 
-                float_format_,
-                width,
-                height);
-
-            diff_x_kernel.setArg(0, smooth_image);
-            diff_x_kernel.setArg(1, i_x_image);
-
-            cl::Event diff_x_complete;
-            std::vector<cl::Event> diff_x_prereqs({ smoothing_complete });
-            queue_.enqueueNDRangeKernel(
-                diff_x_kernel,
-                cl::NullRange,
-                cl::NDRange{ width, height },
-                cl::NullRange,
-                &diff_x_prereqs,
-                &diff_x_complete);
-
-            cl::Kernel diff_y_kernel(program_, "DiffY");
-
-            cl::Image2D i_y_image(
-                context_, 
-                CL_MEM_READ_WRITE, 
-                float_format_,
-                width,
-                height);
-
-            diff_y_kernel.setArg(0, smooth_image);
-            diff_y_kernel.setArg(1, i_y_image);
-
-            cl::Event diff_y_complete;
-            std::vector<cl::Event> diff_y_prereqs({ smoothing_complete });
-            queue_.enqueueNDRangeKernel(
-                diff_y_kernel,
-                cl::NullRange,
-                cl::NDRange{ width, height },
-                cl::NullRange,
-                &diff_y_prereqs,
-                &diff_y_complete);
-
-            cl::Kernel structure_kernel(program_, "Structure");
-
-            cl::Image2D structure_image(
-                context_, 
-                CL_MEM_READ_WRITE, 
-                cl::ImageFormat{ CL_RGBA, CL_FLOAT },
-                width,
-                height);
-
-            structure_kernel.setArg(0, i_x_image);
-            structure_kernel.setArg(1, i_y_image);
-            structure_kernel.setArg(2, structure_image);
-
-            cl::Event structure_complete;
-            std::vector<cl::Event> structure_prereqs({ diff_x_complete, diff_y_complete });
-            queue_.enqueueNDRangeKernel(
-                structure_kernel,
-                cl::NullRange,
-                cl::NDRange{ width, height },
-                cl::NullRange,
-                &structure_prereqs,
-                &structure_complete);
-
-            cl::Kernel response_kernel(program_, "Response");
-
-            cl::Image2D response_image(
-                context_, 
-                CL_MEM_READ_WRITE, 
-                float_format_,
-                width,
-                height);
-
-            response_kernel.setArg(0, structure_image);
-            response_kernel.setArg(1, response_image);
-
-            cl::Event response_complete;
-            std::vector<cl::Event> response_prereqs({ structure_complete });
-            queue_.enqueueNDRangeKernel(
-                response_kernel,
-                cl::NullRange,
-                cl::NDRange{ width, height },
-                cl::NullRange,
-                &response_prereqs,
-                &response_complete);
-
-            cl::Kernel row_max_kernel(program_, "RowMax");
-
-            cl::Buffer row_max_buffer(
-                context_, 
-                CL_MEM_READ_WRITE, 
-                sizeof(float) * height);
-
-            row_max_kernel.setArg(0, response_image);
-            row_max_kernel.setArg(1, row_max_buffer);
-
-            cl::Event row_max_complete;
-            std::vector<cl::Event> row_max_prereqs({ response_complete });
-            queue_.enqueueNDRangeKernel(
-                row_max_kernel,
-                cl::NullRange,
-                cl::NDRange{ height },
-                cl::NullRange,
-                &row_max_prereqs,
-                &row_max_complete);
-
-            cl::Kernel max_kernel(program_, "Max");
-
-            max_kernel.setArg(0, height);
-            max_kernel.setArg(1, row_max_buffer);
-
-            cl::Event max_complete;
-            std::vector<cl::Event> max_prereqs({ row_max_complete });
-            queue_.enqueueTask(
-                max_kernel,
-                &max_prereqs,
-                &max_complete
-            );
-
-            cl::Kernel suppression_kernel(program_, "NonMaxSuppression");
-
-            cl::Image2D corner_image(
+            if (autotune_ && !tuning_) SelectLocalSizes(image);
+            frame_events_.clear();
+
+            cl::Memory response;
+            cl::Buffer row_max_buffer;
+            const auto row_max_complete = EnqueueResponse(image, response, row_max_buffer);
+            const auto max_complete = EnqueueMax(row_max_buffer, height, row_max_complete);
+            auto corners = Suppress(response, row_max_buffer, max_complete, width, height);
+
+            CollectTimings();
+            return corners;
+        }
+        catch(const cl::Error& e)
+        {
+            std::cerr << e.what() << ": " << e.err() << '\n';
+            throw;
+        }
+    }
+
+    // Runs the OpenCL Harris corner detector on any of the packed pixel formats and reads back the compacted corner list
+    template <class P>
+    CornerList FindCornerListPacked(const Image<P>& image) {
+        CheckFrameSize(image);
+        const auto width = static_cast<size_t>(image.width());
+        const auto height = static_cast<size_t>(image.height());
+
+        // Frames that need to be tiled only produce corner images
+        if ((!use_buffers_ && width > image_max_width_) || TileRows(image) < image.height()) return ToCornerList(FindCorners(image));
+
+        try
+        {
+            if (autotune_ && !tuning_) SelectLocalSizes(image);
+            frame_events_.clear();
+
+            cl::Memory response;
+            cl::Buffer row_max_buffer;
+            const auto row_max_complete = EnqueueResponse(image, response, row_max_buffer);
+            const auto max_complete = EnqueueMax(row_max_buffer, height, row_max_complete);
+
+            cl::Kernel compact_kernel(program_, KernelName("NonMaxSuppressionCompact").c_str());
+
+            cl::Buffer count_buffer(
                 context_,
-                CL_MEM_READ_WRITE,
-                float_format_,
-                width,
-                height);
+                CL_MEM_READ_WRITE | HostAllocFlag(),
+                sizeof(cl_int));
+
+            compact_kernel.setArg(0, response);
+            compact_kernel.setArg(1, row_max_buffer);
+            compact_kernel.setArg(2, count_buffer);
+            compact_kernel.setArg(5, static_cast<cl_int>(suppression_size_ / 2));
+            compact_kernel.setArg(6, threshold_ratio_);
+            if (use_buffers_) {
+                compact_kernel.setArg(7, static_cast<cl_int>(width));
+                compact_kernel.setArg(8, static_cast<cl_int>(height));
+            }
+
+            // The list is sized from the previous frame. If it overflows, it is grown and the suppression is re-run.
+            while (true) {
+                cl::Buffer corner_buffer(
+                    context_,
+                    CL_MEM_WRITE_ONLY | HostAllocFlag(),
+                    sizeof(Corner) * corner_capacity_);
+
+                compact_kernel.setArg(3, static_cast<cl_int>(corner_capacity_));
+                compact_kernel.setArg(4, corner_buffer);
+
+                const cl_int zero = 0;
+                cl::Event count_cleared;
+                queue_.enqueueWriteBuffer(count_buffer, CL_FALSE, 0, sizeof(cl_int), &zero, nullptr, &count_cleared);
+                Record("Upload", count_cleared);
+
+                const auto compact_complete = EnqueueKernel(compact_kernel, cl::NDRange{ width, height }, { max_complete, count_cleared });
+
+                cl_int count = 0;
+                std::vector<cl::Event> read_prereqs({ compact_complete });
+                ReadBuffer(count_buffer, sizeof(cl_int), &count, &read_prereqs);
+
+                const auto num_corners = static_cast<size_t>(count);
+                if (num_corners > corner_capacity_) {
+                    corner_capacity_ = num_corners;
+                    continue;
+                }
+
+                CornerList corners(num_corners);
+                if (num_corners > 0) {
+                    ReadBuffer(corner_buffer, sizeof(Corner) * num_corners, corners.data());
+                }
+
+                CollectTimings();
+                return corners;
+            }
+        }
+        catch(const cl::Error& e)
+        {
+            std::cerr << e.what() << ": " << e.err() << '\n';
+            throw;
+        }
+    }
+
+    // Throws std::invalid_argument for frames smaller than the windows of the algorithm, as the C++ implementation does.
+    // (The kernels keep reflecting coordinates that are further out, so bands and tiles of any size are still read safely.)
+    template <class P>
+    void CheckFrameSize(const Image<P>& image) const {
+        const auto min_size = std::max({ smoothing_size_ / 2, structure_size_ / 2, suppression_size_ / 2, 1 }) + 1;
+        if (image.width() < min_size || image.height() < min_size) throw std::invalid_argument("The frame must be at least " + std::to_string(min_size) + " pixels wide and high");
+    }
+
+    // Enqueues the first stages of the algorithm (everything up to the Harris response and the maximum of each row).
+    // On return response and row_max_buffer hold the (pending) response and row maxima (see EnqueueMax for the overall maximum).
+    // The response is an image or a float buffer depending on which family of kernels is in use.
+    // The returned event completes once both are available.
+    template <class P>
+    cl::Event EnqueueResponse(const Image<P>& image, cl::Memory& response, cl::Buffer& row_max_buffer) {
+        SelectPixelFormat(PixelFormatOf(image));
+        return use_buffers_ ? EnqueueResponseBuffers(image, response, row_max_buffer) : EnqueueResponseImages(image, response, row_max_buffer);
+    }
+
+    // Image version of EnqueueResponse
+    template <class P>
+    cl::Event EnqueueResponseImages(const Image<P>& image, cl::Memory& response, cl::Buffer& row_max_buffer) {
+        const auto width = static_cast<size_t>(image.width());
+        const auto height = static_cast<size_t>(image.height());
+
+        std::vector<cl::Event> upload_complete;
+        const auto input_buffer = UploadInput(image, upload_complete);
+
+        cl::Buffer gaussian_buffer(
+            context_,
+            CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            sizeof(float) * gaussian_.width() * gaussian_.height(),
+            gaussian_.data());
+        const auto smooth_image = PooledImage("smooth", float_format_, width, height);
 
-            suppression_kernel.setArg(0, response_image);
-            suppression_kernel.setArg(1, row_max_buffer);
+        cl::Kernel smoothing_kernel(program_, "SmoothingPacked");
+        smoothing_kernel.setArg(0, input_buffer);
+        smoothing_kernel.setArg(1, static_cast<cl_int>(image.stride()));
+        smoothing_kernel.setArg(2, gaussian_buffer);
+        smoothing_kernel.setArg(3, smooth_image);
+        smoothing_kernel.setArg(4, static_cast<cl_int>(smoothing_size_ / 2));
+        const auto smoothing_complete = EnqueueKernel(smoothing_kernel, cl::NDRange{ width, height }, upload_complete);
+
+        const auto i_x_image = PooledImage("i_x", float_format_, width, height);
+
+        cl::Kernel diff_x_kernel(program_, "DiffX");
+        diff_x_kernel.setArg(0, smooth_image);
+        diff_x_kernel.setArg(1, i_x_image);
+        const auto diff_x_complete = EnqueueKernel(diff_x_kernel, cl::NDRange{ width, height }, { smoothing_complete });
+
+        const auto i_y_image = PooledImage("i_y", float_format_, width, height);
+
+        cl::Kernel diff_y_kernel(program_, "DiffY");
+        diff_y_kernel.setArg(0, smooth_image);
+        diff_y_kernel.setArg(1, i_y_image);
+        const auto diff_y_complete = EnqueueKernel(diff_y_kernel, cl::NDRange{ width, height }, { smoothing_complete });
+
+        const auto structure_image = PooledImage("structure", cl::ImageFormat{ CL_RGBA, CL_FLOAT }, width, height);
+
+        cl::Kernel structure_kernel(program_, "Structure");
+        structure_kernel.setArg(0, i_x_image);
+        structure_kernel.setArg(1, i_y_image);
+        structure_kernel.setArg(2, structure_image);
+        structure_kernel.setArg(3, static_cast<cl_int>(structure_size_ / 2));
+        const auto structure_complete = EnqueueKernel(structure_kernel, cl::NDRange{ width, height }, { diff_x_complete, diff_y_complete });
+
+        const auto response_image = PooledImage("response", float_format_, width, height);
+
+        cl::Kernel response_kernel(program_, "Response");
+        response_kernel.setArg(0, structure_image);
+        response_kernel.setArg(1, response_image);
+        response_kernel.setArg(2, k_);
+        const auto response_complete = EnqueueKernel(response_kernel, cl::NDRange{ width, height }, { structure_complete });
+
+        row_max_buffer = PooledBuffer("row_max", sizeof(float) * height);
+
+        cl::Kernel row_max_kernel(program_, "RowMax");
+        row_max_kernel.setArg(0, response_image);
+        row_max_kernel.setArg(1, row_max_buffer);
+        const auto row_max_complete = EnqueueKernel(row_max_kernel, cl::NDRange{ height }, { response_complete });
+
+        response = response_image;
+        return row_max_complete;
+    }
+
+    // Float buffer version of EnqueueResponse (see the *Buffer kernels in harris.cl).
+    // The vectorized kernels compute vector_width_ pixels of a row per work item.
+    template <class P>
+    cl::Event EnqueueResponseBuffers(const Image<P>& image, cl::Memory& response, cl::Buffer& row_max_buffer) {
+        const auto width = static_cast<size_t>(image.width());
+        const auto height = static_cast<size_t>(image.height());
+        const auto width_arg = static_cast<cl_int>(width);
+        const auto height_arg = static_cast<cl_int>(height);
+        const auto float_size = sizeof(float) * width * height;
+        const cl::NDRange vector_range{ (width + vector_width_ - 1) / vector_width_, height };
+
+        std::vector<cl::Event> upload_complete;
+        const auto input_buffer = UploadInput(image, upload_complete);
+
+        cl::Buffer gaussian_buffer(
+            context_,
+            CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+            sizeof(float) * gaussian_.width() * gaussian_.height(),
+            gaussian_.data());
+        const auto smooth_buffer = PooledBuffer("smooth", float_size);
+
+        cl::Kernel smoothing_kernel(program_, "SmoothingPackedBuffer");
+        smoothing_kernel.setArg(0, input_buffer);
+        smoothing_kernel.setArg(1, static_cast<cl_int>(image.stride()));
+        smoothing_kernel.setArg(2, gaussian_buffer);
+        smoothing_kernel.setArg(3, smooth_buffer);
+        smoothing_kernel.setArg(4, static_cast<cl_int>(smoothing_size_ / 2));
+        smoothing_kernel.setArg(5, width_arg);
+        smoothing_kernel.setArg(6, height_arg);
+        const auto smoothing_complete = EnqueueKernel(smoothing_kernel, vector_range, upload_complete);
+
+        const auto i_x_buffer = PooledBuffer("i_x", float_size);
+
+        cl::Kernel diff_x_kernel(program_, "DiffXBuffer");
+        diff_x_kernel.setArg(0, smooth_buffer);
+        diff_x_kernel.setArg(1, i_x_buffer);
+        diff_x_kernel.setArg(2, width_arg);
+        diff_x_kernel.setArg(3, height_arg);
+        const auto diff_x_complete = EnqueueKernel(diff_x_kernel, vector_range, { smoothing_complete });
+
+        const auto i_y_buffer = PooledBuffer("i_y", float_size);
+
+        cl::Kernel diff_y_kernel(program_, "DiffYBuffer");
+        diff_y_kernel.setArg(0, smooth_buffer);
+        diff_y_kernel.setArg(1, i_y_buffer);
+        diff_y_kernel.setArg(2, width_arg);
+        diff_y_kernel.setArg(3, height_arg);
+        const auto diff_y_complete = EnqueueKernel(diff_y_kernel, vector_range, { smoothing_complete });
+
+        const auto structure_buffer = PooledBuffer("structure", 4 * float_size);
+
+        cl::Kernel structure_kernel(program_, "StructureBuffer");
+        structure_kernel.setArg(0, i_x_buffer);
+        structure_kernel.setArg(1, i_y_buffer);
+        structure_kernel.setArg(2, structure_buffer);
+        structure_kernel.setArg(3, static_cast<cl_int>(structure_size_ / 2));
+        structure_kernel.setArg(4, width_arg);
+        structure_kernel.setArg(5, height_arg);
+        const auto structure_complete = EnqueueKernel(structure_kernel, vector_range, { diff_x_complete, diff_y_complete });
+
+        const auto response_buffer = PooledBuffer("response", float_size);
+
+        cl::Kernel response_kernel(program_, "ResponseBuffer");
+        response_kernel.setArg(0, structure_buffer);
+        response_kernel.setArg(1, response_buffer);
+        response_kernel.setArg(2, k_);
+        response_kernel.setArg(3, width_arg);
+        response_kernel.setArg(4, height_arg);
+        const auto response_complete = EnqueueKernel(response_kernel, vector_range, { structure_complete });
+
+        row_max_buffer = PooledBuffer("row_max", sizeof(float) * height);
+
+        cl::Kernel row_max_kernel(program_, "RowMaxBuffer");
+        row_max_kernel.setArg(0, response_buffer);
+        row_max_kernel.setArg(1, row_max_buffer);
+        row_max_kernel.setArg(2, width_arg);
+        const auto row_max_complete = EnqueueKernel(row_max_kernel, cl::NDRange{ height }, { response_complete });
+
+        response = response_buffer;
+        return row_max_complete;
+    }
+
+    // Makes the packed input pixels available to the device. Shared memory devices use the host image in place, everything else
+    // gets an explicit upload (whose event is added to upload_complete). Either way the pixels are left in their original format.
+    template <class P>
+    cl::Buffer UploadInput(const Image<P>& image, std::vector<cl::Event>& upload_complete) {
+        const auto size = image.stride() * image.height();
+        if (HostPtrFlag(image.data()) == CL_MEM_USE_HOST_PTR) {
+            return cl::Buffer(context_, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, size, const_cast<uint8_t*>(image.data()));
+        }
+
+        const auto input_buffer = PooledBuffer("input", size);
+        cl::Event write_complete;
+        queue_.enqueueWriteBuffer(input_buffer, CL_FALSE, 0, size, image.data(), nullptr, &write_complete);
+        Record("Upload", write_complete);
+        upload_complete.push_back(write_complete);
+        return input_buffer;
+    }
+
+    // Pixel formats of the input (these must match the PIXEL_* values in harris.cl)
+    static constexpr int kPixelArgb32 = 0;
+    static constexpr int kPixelBgr24 = 1;
+    static constexpr int kPixelGrey8 = 2;
+
+    static int PixelFormatOf(const Image<Argb32>&) { return kPixelArgb32; }
+    static int PixelFormatOf(const Image<Bgr24>&) { return kPixelBgr24; }
+    static int PixelFormatOf(const Image<uint8_t>&) { return kPixelGrey8; }
+
+    // Selects the program variant that reads the given pixel format (see PIXEL_FORMAT in harris.cl)
+    void SelectPixelFormat(int pixel_format) {
+        if (pixel_format == pixel_format_) return;
+        pixel_format_ = pixel_format;
+        SelectProgram();
+    }
+
+    // Enqueues the reduction of the row maxima into the maximum response value (stored in the first element of row_max_buffer)
+    cl::Event EnqueueMax(const cl::Buffer& row_max_buffer, size_t height, const cl::Event& row_max_complete) {
+        cl::Kernel max_kernel(program_, "Max");
+        max_kernel.setArg(0, static_cast<cl_int>(height));
+        max_kernel.setArg(1, row_max_buffer);
+
+        cl::Event max_complete;
+        std::vector<cl::Event> max_prereqs({ row_max_complete });
+        queue_.enqueueTask(max_kernel, &max_prereqs, &max_complete);
+        Record("Max", max_complete);
+
+        return max_complete;
+    }
+
+    // Enqueues non-maximal suppression of a response computed by EnqueueResponse and reads back the corner image
+    Image<float> Suppress(const cl::Memory& response, const cl::Buffer& row_max_buffer, const cl::Event& max_complete, size_t width, size_t height) {
+        cl::Kernel suppression_kernel(program_, KernelName("NonMaxSuppression").c_str());
+
+        // On shared memory devices the kernel writes straight into the output image
+        Image<float> corners(width, height);
+        const auto use_host_corners = HostPtrFlag(corners.data()) == CL_MEM_USE_HOST_PTR;
+        cl::Image2D corner_image;
+        cl::Buffer corner_buffer;
+        if (use_buffers_) {
+            corner_buffer = use_host_corners
+                ? cl::Buffer(context_, CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR, corners.stride() * height, corners.data())
+                : PooledBuffer("corners", corners.stride() * height);
+            suppression_kernel.setArg(2, corner_buffer);
+            suppression_kernel.setArg(5, static_cast<cl_int>(width));
+            suppression_kernel.setArg(6, static_cast<cl_int>(height));
+        } else {
+            corner_image = use_host_corners
+                ? cl::Image2D(context_, CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR, float_format_, width, height, corners.stride(), corners.data())
+                : PooledImage("corners", float_format_, width, height);
             suppression_kernel.setArg(2, corner_image);
+        }
 
-            cl::Event suppression_complete;
-            std::vector<cl::Event> suppression_prereqs({ response_complete });
-            queue_.enqueueNDRangeKernel(
-                suppression_kernel,
-                cl::NullRange,
-                cl::NDRange{ width, height },
-                cl::NullRange,
-                &suppression_prereqs,
-                &suppression_complete);
-
-            Image<float> corners(width, height);
-            std::vector<cl::Event> read_prereqs({ suppression_complete });
+        suppression_kernel.setArg(0, response);
+        suppression_kernel.setArg(1, row_max_buffer);
+        suppression_kernel.setArg(3, static_cast<cl_int>(suppression_size_ / 2));
+        suppression_kernel.setArg(4, threshold_ratio_);
+        const auto suppression_complete = EnqueueKernel(suppression_kernel, cl::NDRange{ width, height }, { max_complete });
+
+        std::vector<cl::Event> read_prereqs({ suppression_complete });
+        cl::Event read_complete;
+        if (use_buffers_) {
+            // Buffers created from host memory are synchronized by the mapping in ReadBuffer
+            ReadBuffer(corner_buffer, corners.stride() * height, corners.data(), &read_prereqs);
+        } else if (use_host_corners) {
+            // Mapping guarantees the device writes are visible in the host memory the image was created from
+            size_t row_pitch;
+            const auto mapped = queue_.enqueueMapImage(
+                corner_image,
+                CL_TRUE,
+                CL_MAP_READ,
+                sizes({}),
+                sizes({ width, height, 1 }),
+                &row_pitch,
+                nullptr,
+                &read_prereqs,
+                &read_complete);
+            queue_.enqueueUnmapMemObject(corner_image, mapped);
+            Record("Readback", read_complete);
+        } else {
             queue_.enqueueReadImage(
                 corner_image,
                 CL_TRUE,
@@ -293,46 +742,315 @@ public:
                 corners.stride(),
                 0,
                 corners.data(),
-                &read_prereqs);
+                &read_prereqs,
+                &read_complete);
+            Record("Readback", read_complete);
+        }
+
+        return corners;
+    }
+
+    // Local work sizes tried by Tune. (0, 0) is the driver's own choice.
+    static constexpr LocalSize kLocalSizeCandidates[] = {
+        { 0, 0 }, { 8, 4 }, { 8, 8 }, { 16, 4 }, { 16, 8 }, { 16, 16 }, { 32, 4 }, { 32, 8 }, { 64, 1 }, { 64, 4 }, { 128, 1 }, { 256, 1 }
+    };
+
+    // Number of frames each candidate is timed over (the fastest is used)
+    static constexpr int kTuningRuns = 2;
+
+    // Enqueues a kernel over global_range once all of the prerequisite events have completed.
+    // 2D kernels use the tuned local size (if any). The global range is rounded up to a multiple of it, so every 2D kernel
+    // must ignore work items outside the image.
+    cl::Event EnqueueKernel(const cl::Kernel& kernel, const cl::NDRange& global_range, const std::vector<cl::Event>& prereqs) {
+        const auto name = kernel.getInfo<CL_KERNEL_FUNCTION_NAME>();
+
+        auto global = global_range;
+        auto local = cl::NullRange;
+        if (global_range.dimensions() == 2) {
+            if (tuning_) tunable_kernels_.insert(name);
+
+            const auto local_size = local_sizes_.find(name);
+            if (local_size != local_sizes_.end() && local_size->second.first > 0) {
+                const auto local_x = local_size->second.first;
+                const auto local_y = local_size->second.second;
+                global = cl::NDRange{ RoundUp(global_range[0], local_x), RoundUp(global_range[1], local_y) };
+                local = cl::NDRange{ local_x, local_y };
+            }
+        }
+
+        cl::Event complete;
+        queue_.enqueueNDRangeKernel(
+            kernel,
+            cl::NullRange,
+            global,
+            local,
+            prereqs.empty() ? nullptr : &prereqs,
+            &complete);
+
+        Record(name, complete);
+        return complete;
+    }
+
+    // Rounds value up to a multiple of multiple
+    static size_t RoundUp(size_t value, size_t multiple) {
+        return (value + multiple - 1) / multiple * multiple;
+    }
+
+    // Returns the name of the kernels in use (the best local sizes are different for each family)
+    std::string KernelFamily() const { return use_buffers_ ? "buffer" + std::to_string(vector_width_) : "image"; }
+
+    // Returns the kernel variant used for an image: the kernel family and the pixel format, since the first kernel reads the
+    // pixels of each format directly and so has different best local sizes for each
+    template <class P>
+    std::string KernelVariant(const Image<P>& image) const {
+        return KernelFamily() + "-pixel" + std::to_string(PixelFormatOf(image));
+    }
+
+    // Returns a key identifying the frame size and kernel variant the local sizes were tuned for
+    template <class P>
+    std::string TunedSize(const Image<P>& image) const {
+        return std::to_string(image.width()) + "x" + std::to_string(image.height()) + KernelVariant(image);
+    }
+
+    // Makes sure the local sizes match the frame size and kernel variant, either by loading them from the work size cache or
+    // by tuning them. The sizes of each variant are kept, so frames that alternate between variants (e.g. the buffer kernels
+    // for frames too wide for the image kernels) don't reload the cache every frame.
+    template <class P>
+    void SelectLocalSizes(const Image<P>& image) {
+        const auto key = TunedSize(image);
+        if (tuned_size_ == key) return;
+
+        auto& variant_sizes = variant_local_sizes_[KernelVariant(image)];
+        if (variant_sizes.first != key) {
+            auto loaded = work_size_cache_.Load(device_, image.width(), image.height(), KernelVariant(image));
+            if (loaded.empty()) {
+                std::cout << "Tuning OpenCL work group sizes for " << image.width() << "x" << image.height() << " frames" << std::endl;
+                Tune(image);
+                return;
+            }
+
+            variant_sizes = { key, std::move(loaded) };
+        }
+
+        local_sizes_ = variant_sizes.second;
+        tuned_size_ = key;
+    }
+
+    // Returns the shortest total run time of a kernel over kTuningRuns frames.
+    // Returns the maximum double if the local size can not be used with the kernel.
+    template <class P>
+    double TimeKernel(const Image<P>& image, const std::string& name) {
+        auto best_time_ms = std::numeric_limits<double>::max();
+        try
+        {
+            for (auto run = 0; run < kTuningRuns; ++run) {
+                if (name.find("Compact") != std::string::npos) FindCornerList(image);
+                else FindCorners(image);
+
+                auto time_ms = 0.0;
+                for (const auto& timing : stage_timings_) {
+                    if (timing.name == name) time_ms += timing.run_ms;
+                }
+
+                best_time_ms = std::min(best_time_ms, time_ms);
+            }
+        }
+        catch(const cl::Error&)
+        {
+            // e.g. CL_INVALID_WORK_GROUP_SIZE when the kernel's resource usage rules the size out
+            return std::numeric_limits<double>::max();
+        }
+
+        return best_time_ms;
+    }
+
+    // Keeps the event of a stage of the current frame so its profiling information can be collected
+    void Record(const std::string& name, const cl::Event& event) {
+        if (profiling_) frame_events_.emplace_back(name, event);
+    }
+
+    // Converts the profiling information of the events recorded for the last frame into stage timings.
+    // While tiling, the timings are added to those of the earlier tiles, with one total per stage.
+    // This must only be called once all of the recorded events have completed.
+    void CollectTimings() {
+        if (!tiling_) stage_timings_.clear();
+        for (const auto& stage : frame_events_) {
+            const auto queued = stage.second.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+            const auto start = stage.second.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+            const auto end = stage.second.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+            const StageTiming timing{ stage.first, (start - queued) / 1e6, (end - start) / 1e6 };
+
+            const auto total = !tiling_ ? stage_timings_.end() : std::find_if(stage_timings_.begin(), stage_timings_.end(), [&](const StageTiming& existing) { return existing.name == timing.name; });
+            if (total == stage_timings_.end()) {
+                stage_timings_.push_back(timing);
+            } else {
+                total->queued_ms += timing.queued_ms;
+                total->run_ms += timing.run_ms;
+            }
+        }
+
+        frame_events_.clear();
+    }
+
+    // Approximate device memory used per pixel of a frame (input, greyscale, smoothed, derivatives, structure tensor,
+    // response and corners)
+    static constexpr size_t kBytesPerPixel = 48;
+
+    // Returns the number of rows of a frame that are processed at once (the height of the frame unless it needs to be tiled)
+    template <class P>
+    int TileRows(const Image<P>& image) const {
+        const auto width = static_cast<cl_ulong>(image.width());
+
+        // The structure tensor (4 floats per pixel) is the largest allocation.
+        // Only half of the device memory is used so the driver and other applications keep some.
+        auto rows = std::min(max_alloc_size_ / (4 * sizeof(float) * width), global_mem_size_ / 2 / (kBytesPerPixel * width));
+        if (!use_buffers_) rows = std::min<cl_ulong>(rows, image_max_height_);
+
+        // Each tile also computes the halo rows on either side of it
+        auto tile_rows = rows >= static_cast<cl_ulong>(image.height()) ? image.height() : static_cast<int>(rows) - 2 * halo();
+        if (max_tile_rows_ > 0) tile_rows = std::min(tile_rows, max_tile_rows_);
+        if (tile_rows <= 0) throw std::runtime_error("The frame is too wide to fit in the OpenCL device memory");
+        return tile_rows;
+    }
+
+    // Runs both passes of FindCornersTiled
+    template <class P>
+    Image<float> FindTiles(const Image<P>& image, int tile_rows) {
+        std::vector<std::pair<int, int>> tiles;
+        for (auto first_row = 0; first_row < image.height(); first_row += tile_rows) {
+            tiles.emplace_back(first_row, std::min(image.height(), first_row + tile_rows));
+        }
+
+        auto max_response = 0.0f;
+        for (const auto& tile : tiles) {
+            max_response = std::max(max_response, FindTileMaximum(image, tile, tile_rows));
+        }
+
+        Image<float> corners(image.width(), image.height());
+        for (auto i = tiles.size(); i-- > 0;) {
+            if (i + 1 != tiles.size()) FindTileMaximum(image, tiles[i], tile_rows);
+
+            const auto tile_first = TileWindow(image.height(), tiles[i], tile_rows).first;
+            const auto tile_corners = FindBandCorners(max_response);
+            for (auto y = tiles[i].first; y < tiles[i].second; ++y) {
+                std::memcpy(corners.RowPtr(y), tile_corners.RowPtr(y - tile_first), sizeof(float) * image.width());
+            }
+        }
+
+        return corners;
+    }
+
+    // Returns the rows [first, last) of a frame that are computed for a tile: the tile's own rows and the halo on either side.
+    // Every tile computes the same number of rows, so the pooled device images keep their size from tile to tile. The first
+    // and last tiles start at the edge of the frame and take their extra rows from inside it instead.
+    std::pair<int, int> TileWindow(int image_height, const std::pair<int, int>& tile, int tile_rows) const {
+        const auto rows = std::min(image_height, tile_rows + 2 * halo());
+        const auto first = Clamp(tile.first - halo(), 0, image_height - rows);
+        return { first, first + rows };
+    }
+
+    // Returns the rows of a frame computed for a tile (see TileWindow) as an image that views them without copying them
+    template <class P>
+    static Image<P> TileImage(const Image<P>& image, const std::pair<int, int>& window) {
+        const auto tile_data = const_cast<uint8_t*>(image.data()) + window.first * image.stride();
+        return Image<P>(std::shared_ptr<uint8_t>(std::shared_ptr<uint8_t>(), tile_data), image.width(), window.second - window.first, image.stride());
+    }
+
+    // Runs the stages up to the Harris response for the rows [tile.first, tile.second) of a frame and their halo
+    // and returns the maximum response of the tile's own rows
+    template <class P>
+    float FindTileMaximum(const Image<P>& image, const std::pair<int, int>& tile, int tile_rows) {
+        const auto window = TileWindow(image.height(), tile, tile_rows);
+        return FindBandMaximum(TileImage(image, window), tile.first - window.first, tile.second - window.first);
+    }
 
+    // Runs FindCorners on a frame that is too wide for the image kernels with the buffer kernels
+    template <class P>
+    Image<float> FindCornersWithBuffers(const Image<P>& image) {
+        use_buffers_ = true;
+        try
+        {
+            auto corners = FindCorners(image);
+            use_buffers_ = false;
             return corners;
         }
-        catch(const cl::Error& e)
+        catch(...)
         {
-            std::cerr << e.what() << ": " << e.err() << '\n';
+            use_buffers_ = false;
             throw;
         }
     }
 
-private:
-    std::vector<cl::Device> devices_;
-    std::vector<cl::Platform> platforms_;
-    cl::Context context_;
-    cl::Program program_;
-    cl::CommandQueue queue_;
-    cl::ImageFormat float_format_;
-    FilterKernel gaussian_;
+    // Returns a device buffer of at least size bytes that is kept between frames.
+    // Each name refers to a single buffer, which is only reallocated when a larger one is needed.
+    cl::Buffer PooledBuffer(const std::string& name, size_t size) {
+        auto& buffer = pooled_buffers_[name];
+        if (buffer() == nullptr || buffer.getInfo<CL_MEM_SIZE>() < size) {
+            buffer = cl::Buffer(context_, CL_MEM_READ_WRITE, size);
+        }
+
+        return buffer;
+    }
 
-    cl::Program CreateProgram(const std::string& source_file, const cl::Context& context)
-    {
-        std::ifstream in(source_file);
-        std::stringstream source_stream;
-        source_stream << in.rdbuf();
-        auto source = source_stream.str();
+    // Returns a device image of exactly width x height that is kept between frames.
+    // Each name refers to a single image. The image kernels take the frame size from their images, so unlike a buffer an image
+    // is reallocated whenever the size changes (every tile of a tiled frame has the same size, see TileWindow).
+    cl::Image2D PooledImage(const std::string& name, const cl::ImageFormat& format, size_t width, size_t height) {
+        auto& image = pooled_images_[name];
+        if (image() == nullptr || image.getImageInfo<CL_IMAGE_WIDTH>() != width || image.getImageInfo<CL_IMAGE_HEIGHT>() != height) {
+            image = cl::Image2D(context_, CL_MEM_READ_WRITE, format, width, height);
+        }
+
+        return image;
+    }
 
-        return cl::Program(context, source);
+    // Returns the name of the variant of a kernel that matches the memory objects in use
+    std::string KernelName(const std::string& name) const {
+        return use_buffers_ ? name + "Buffer" : name;
     }
 
-    void BuildProgram(cl::Program& program, const std::vector<cl::Device>& devices) {
+    // Returns the build options used to specialize the program for the current parameters.
+    // The kernels use these values in place of their parameter arguments when they are defined.
+    std::string SpecializationOptions() const {
         std::stringstream options_stream;
+        options_stream << std::setprecision(9);
         options_stream << " -D HALF_SMOOTHING=" << smoothing_size_ / 2; 
         options_stream << " -D HALF_STRUCTURE=" << structure_size_ / 2; 
         options_stream << " -D HALF_SUPPRESSION=" << suppression_size_ / 2; 
         options_stream << " -D HARRIS_K=" << k_;
         options_stream << " -D THRESHOLD_RATIO=" << threshold_ratio_;
-        const auto options = options_stream.str();
+        return options_stream.str();
+    }
 
-        
+    // Selects the program used for the current parameters, vector width and input pixel format.
+    // Programs are kept by their build options so each variant is only loaded or built once per detector.
+    void SelectProgram() {
+        auto options = specialize_ ? SpecializationOptions() : std::string();
+        options += " -D VECTOR_WIDTH=" + std::to_string(vector_width_);
+        options += " -D PIXEL_FORMAT=" + std::to_string(pixel_format_);
+        auto program = programs_.find(options);
+        if (program == programs_.end()) {
+            program = programs_.emplace(options, LoadOrBuildProgram(options)).first;
+        }
+
+        program_ = program->second;
+    }
+
+    // Loads a program from the program cache or builds it from source (and caches it) if it isn't available
+    cl::Program LoadOrBuildProgram(const std::string& options) {
+        // The kernel source is embedded at build time (see harris_cl_source.h.in)
+        const std::string source(kHarrisClSource);
+        auto program = program_cache_.Load(context_, device_, source, options);
+        if (program() == nullptr) {
+            program = cl::Program(context_, source);
+            BuildProgram(program, std::vector<cl::Device>({ device_ }), options);
+            program_cache_.Store(program, device_, source, options);
+        }
+
+        return program;
+    }
+
+    void BuildProgram(cl::Program& program, const std::vector<cl::Device>& devices, const std::string& options) {
         try
         {
             program.build(devices, options.c_str());
@@ -353,6 +1071,34 @@ private:
         }
     }
 
+    // Returns the flag used to create device memory from host memory.
+    // Shared memory devices use page aligned host memory in place, otherwise it is copied to the device.
+    cl_mem_flags HostPtrFlag(const void* host_ptr) const {
+        return zero_copy_ && IsAligned(host_ptr) ? CL_MEM_USE_HOST_PTR : CL_MEM_COPY_HOST_PTR;
+    }
+
+    // Returns the flag used to allocate buffers that are read back by the host.
+    // Shared memory devices allocate them in host accessible memory so they can be mapped rather than copied.
+    cl_mem_flags HostAllocFlag() const {
+        return zero_copy_ ? CL_MEM_ALLOC_HOST_PTR : 0;
+    }
+
+    // Reads the start of a buffer into host memory once all prerequisite events have completed
+    void ReadBuffer(const cl::Buffer& buffer, size_t size, void* dest, const std::vector<cl::Event>* prereqs = nullptr) {
+        cl::Event read_complete;
+        if (!zero_copy_) {
+            queue_.enqueueReadBuffer(buffer, CL_TRUE, 0, size, dest, prereqs, &read_complete);
+            Record("Readback", read_complete);
+            return;
+        }
+
+        // Buffers created from dest (CL_MEM_USE_HOST_PTR) map onto dest itself so there is nothing to copy
+        const auto mapped = queue_.enqueueMapBuffer(buffer, CL_TRUE, CL_MAP_READ, 0, size, prereqs, &read_complete);
+        if (mapped != dest) std::memcpy(dest, mapped, size);
+        queue_.enqueueUnmapMemObject(buffer, mapped);
+        Record("Readback", read_complete);
+    }
+
     // cl.hpp has no usueful way to make a size_t<3> even though it uses them all over the place. **sigh**
     cl::size_t<3> sizes(std::initializer_list<size_t> size_values) {
         cl::size_t<3> result;
@@ -0,0 +1,199 @@
+#pragma once
+// Harris corner detection split across several OpenCL devices
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "harris_opencl.h"
+
+namespace harris {
+
+// Runs the OpenCL Harris corner detector on several devices at once (e.g. a CPU and an integrated GPU, or two GPUs).
+// Each frame is split into horizontal bands, one per device. Every band is extended by a halo of rows shared with its
+// neighbours so that the rows a device keeps are computed exactly as they would be for the whole frame.
+// The threshold depends on the maximum response of the whole frame, so each device first computes the response of its band
+// and reports its maximum, then all devices run non-maximal suppression using the maximum over all bands.
+// The height of each band is rebalanced after every frame according to how quickly each device processed its last band.
+// Every device keeps a band of at least the halo height, so a device that was slow once (e.g. while its first frame allocated
+// its buffers) is still timed on every frame and gets its share back when it speeds up.
+class HarrisOpenCLMulti : public HarrisBase {
+public:
+
+    // Index of a device as (platform index, device index) passed to HarrisOpenCL
+    using DeviceIndex = std::pair<int, int>;
+
+    // Uses the given devices. The same device can be listed more than once (which is mostly useful for testing).
+    // See HarrisOpenCL for the remaining parameters.
+    HarrisOpenCLMulti(const std::vector<DeviceIndex>& devices, int smoothing_size = 5, int structure_size = 5, float harris_k = 0.04, float threshold_ratio = 0.5, int suppression_size = 9, const std::string& cache_directory = DefaultCacheDirectory("opencl"), bool specialize = false) :
+        HarrisBase(smoothing_size, structure_size, harris_k, threshold_ratio, suppression_size) {
+        if (devices.empty()) throw std::invalid_argument("At least one OpenCL device is required");
+
+        for (const auto& device : devices) {
+            detectors_.push_back(std::make_unique<HarrisOpenCL>(device.first, device.second, smoothing_size, structure_size, harris_k, threshold_ratio, suppression_size, cache_directory, specialize));
+        }
+
+        // Nothing is known about the devices yet, so the first frame is split evenly
+        rows_per_ms_.assign(detectors_.size(), 1.0);
+    }
+
+    // Rule of five: Neither movable nor copyable
+    HarrisOpenCLMulti(const HarrisOpenCLMulti&) = delete;
+    HarrisOpenCLMulti(HarrisOpenCLMulti&&) = delete;
+    HarrisOpenCLMulti& operator=(const HarrisOpenCLMulti&) = delete;
+    HarrisOpenCLMulti& operator=(HarrisOpenCLMulti&&) = delete;
+    ~HarrisOpenCLMulti() override = default;
+
+    // Returns every device of the given platform, or every device of every platform if platform_num is negative
+    static std::vector<DeviceIndex> AllDevices(int platform_num = -1) {
+        std::vector<cl::Platform> platforms;
+        cl::Platform::get(&platforms);
+
+        std::vector<DeviceIndex> devices;
+        for (auto i = 0; i < static_cast<int>(platforms.size()); ++i) {
+            if (platform_num >= 0 && i != platform_num) continue;
+
+            std::vector<cl::Device> platform_devices;
+            platforms[i].getDevices(CL_DEVICE_TYPE_ALL, &platform_devices);
+            for (auto j = 0; j < static_cast<int>(platform_devices.size()); ++j) {
+                devices.emplace_back(i, j);
+            }
+        }
+
+        return devices;
+    }
+
+    // Enables per-stage profiling on every device (see HarrisOpenCL::SetProfiling)
+    void SetProfiling(bool enabled) {
+        for (auto& detector : detectors_) {
+            detector->SetProfiling(enabled);
+        }
+    }
+
+    // Returns the stage timings of every device. Each stage name is prefixed by the index of its device.
+    std::vector<StageTiming> StageTimings() const override {
+        std::vector<StageTiming> timings;
+        for (auto i = 0; i < detectors_.size(); ++i) {
+            for (auto timing : detectors_[i]->StageTimings()) {
+                timing.name = std::to_string(i) + ": " + timing.name;
+                timings.push_back(timing);
+            }
+        }
+
+        return timings;
+    }
+
+    size_t device_count() const { return detectors_.size(); }
+
+    // Splits the rows of an image into one [first, last) range per device, sized by the measured rate of each device.
+    // Every device gets at least min_rows rows (or an equal share of the rows if there aren't enough for that).
+    static std::vector<std::pair<int, int>> SplitRows(int height, const std::vector<double>& rows_per_ms, int min_rows) {
+        const auto device_count = static_cast<int>(rows_per_ms.size());
+        min_rows = std::min(min_rows, height / device_count);
+
+        auto total_rate = 0.0;
+        for (const auto rate : rows_per_ms) {
+            total_rate += rate;
+        }
+
+        // The rows left after every device has its minimum are shared out by rate
+        const auto shared_rows = height - min_rows * device_count;
+        std::vector<std::pair<int, int>> bands;
+        auto cumulative_rate = 0.0;
+        auto first_row = 0;
+        for (auto i = 0; i < device_count; ++i) {
+            cumulative_rate += rows_per_ms[i];
+            const auto last_row = min_rows * (i + 1) + static_cast<int>(shared_rows * cumulative_rate / total_rate + 0.5);
+            bands.emplace_back(first_row, std::max(first_row, std::min(last_row, height)));
+            first_row = bands.back().second;
+        }
+
+        bands.back().second = height;
+        return bands;
+    }
+
+    // Runs the OpenCL Harris corner detector with each device processing a band of the image.
+    // Every device reads Argb32, Bgr24 and greyscale pixels directly (see HarrisOpenCL).
+    Image<float> FindCorners(const Image<Argb32>& image) override { return FindCornersBands(image); }
+    Image<float> FindCorners(const Image<Bgr24>& image) override { return FindCornersBands(image); }
+    Image<float> FindCorners(const Image<uint8_t>& image) override { return FindCornersBands(image); }
+
+private:
+    std::vector<std::unique_ptr<HarrisOpenCL>> detectors_;
+    std::vector<double> rows_per_ms_;
+    int frame_count_ = 0;
+
+    template <class P>
+    Image<float> FindCornersBands(const Image<P>& image) {
+        const auto width = image.width();
+        const auto height = image.height();
+
+        const auto halo = this->halo();
+
+        const auto bands = SplitRows(height, rows_per_ms_, halo);
+        std::vector<double> band_time_ms(bands.size());
+
+        // First pass: compute the response of every band and the maximum of the rows each device keeps
+        std::vector<std::future<float>> band_maximums;
+        for (auto i = 0; i < bands.size(); ++i) {
+            band_maximums.push_back(std::async(std::launch::async, [&, i]() {
+                const auto first_row = bands[i].first;
+                const auto last_row = bands[i].second;
+                if (first_row == last_row) return 0.0f;
+
+                const auto start = std::chrono::high_resolution_clock::now();
+                const auto band_first = std::max(0, first_row - halo);
+                const auto band_last = std::min(height, last_row + halo);
+                const auto band_data = const_cast<uint8_t*>(image.data()) + band_first * image.stride();
+                const Image<P> band(std::shared_ptr<uint8_t>(std::shared_ptr<uint8_t>(), band_data), width, band_last - band_first, image.stride());
+                const auto max_response = detectors_[i]->FindBandMaximum(band, first_row - band_first, last_row - band_first);
+                band_time_ms[i] = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+                return max_response;
+            }));
+        }
+
+        auto max_response = 0.0f;
+        for (auto& band_maximum : band_maximums) {
+            max_response = std::max(max_response, band_maximum.get());
+        }
+
+        // Second pass: suppress each band with the maximum of the whole frame and keep the rows owned by the band
+        Image<float> corners(width, height);
+        std::vector<std::future<void>> band_corners;
+        for (auto i = 0; i < bands.size(); ++i) {
+            band_corners.push_back(std::async(std::launch::async, [&, i]() {
+                const auto first_row = bands[i].first;
+                const auto last_row = bands[i].second;
+                if (first_row == last_row) return;
+
+                const auto start = std::chrono::high_resolution_clock::now();
+                const auto band_first = std::max(0, first_row - halo);
+                const auto band = detectors_[i]->FindBandCorners(max_response);
+                for (auto y = first_row; y < last_row; ++y) {
+                    std::memcpy(corners.RowPtr(y), band.RowPtr(y - band_first), sizeof(float) * width);
+                }
+                band_time_ms[i] += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+            }));
+        }
+
+        for (auto& band_corner : band_corners) {
+            band_corner.get();
+        }
+
+        // Give each device a share of the next frame proportional to the rate it processed this one. The first frame isn't
+        // used, since it includes one-off costs (such as allocating the device buffers) that differ from device to device.
+        if (frame_count_++ > 0) {
+            for (auto i = 0; i < bands.size(); ++i) {
+                const auto rows = bands[i].second - bands[i].first;
+                if (rows > 0 && band_time_ms[i] > 0) rows_per_ms_[i] = rows / band_time_ms[i];
+            }
+        }
+
+        return corners;
+    }
+};
+}
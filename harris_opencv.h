@@ -1,6 +1,10 @@
 #pragma once
 // This is an OpenCV implementation of the algorithm used as a reference for other implementations.
 
+#include <cmath>
+#include <limits>
+#include <memory>
+
 #include "harris_base.h"
 #include "opencv2/opencv.hpp"
 
@@ -10,8 +14,10 @@ namespace harris {
 class HarrisOpenCV : public HarrisBase {
 public:
 
-    HarrisOpenCV(int smoothing_size = 5, int structure_size = 5, float harris_k = 0.04, float threshold_ratio = 0.5, int suppression_size = 9) :
-        HarrisBase(smoothing_size, structure_size, harris_k, threshold_ratio, suppression_size) {
+    // When use_umat is set the whole pipeline runs on cv::UMat so that OpenCV can dispatch each step to OpenCL (T-API)
+    HarrisOpenCV(int smoothing_size = 5, int structure_size = 5, float harris_k = 0.04, float threshold_ratio = 0.5, int suppression_size = 9, bool use_umat = false) :
+        HarrisBase(smoothing_size, structure_size, harris_k, threshold_ratio, suppression_size),
+        use_umat_(use_umat) {
     }
 
     // Rule of five: Neither movable nor copyable
@@ -21,62 +27,111 @@ public:
     HarrisOpenCV& operator=(HarrisOpenCV&&) = delete;
     ~HarrisOpenCV() override = default;
 
+    bool use_umat() const { return use_umat_; }
+
+    // The returned images are views over the memory of the OpenCV result rather than copies of it
     Image<float> FindCorners(const Image<Argb32>& image) override {
-        cv::Mat image_mat(image.height(), image.width(), CV_8UC4, const_cast<uint8_t*>(image.data()), image.stride());
-        cv::Mat gray_mat;
-        cv::Mat float_mat;
-        cv::Mat corners_mat;
-        cv::cvtColor(image_mat, gray_mat, cv::COLOR_BGRA2GRAY);
-        gray_mat.convertTo(float_mat, CV_32F, 1.0/255.0);
-        FindCornersOpenCV(float_mat, corners_mat);
-        return Image<float>(corners_mat.data, corners_mat.cols, corners_mat.rows, corners_mat.step[0]);
+        return FindCornersMat(ToMat(image, CV_8UC4), cv::COLOR_BGRA2GRAY);
     }
 
-private:
-    // Non-Maximal suppresion with thresholding implemented using standard OpenCV components
-    void NonMaxSuppression(cv::Mat src, cv::Mat& dest, int block_size, double threshold) {
+    // BGR pixels are converted straight to greyscale without going through Argb32
+    Image<float> FindCorners(const Image<Bgr24>& image) override {
+        return FindCornersMat(ToMat(image, CV_8UC3), cv::COLOR_BGR2GRAY);
+    }
+
+    // Greyscale pixels are used without any colour conversion
+    Image<float> FindCorners(const Image<uint8_t>& image) override {
+        return FindCornersMat(ToMat(image, CV_8UC1), kNoConversion);
+    }
+
+    // Non-Maximal suppresion with thresholding implemented using standard OpenCV components.
+    // A pixel is kept if it is at least threshold and no pixel in the block around it (clamped to the image) is larger.
+    // The block maximum comes from a max filter (cv::dilate) with a border that never wins, which gives the same clamped windows.
+    // As with a direct scan of the window, pixels that pass the threshold but are not positive are kept as they are.
+    // M is either cv::Mat or cv::UMat. Every intermediate uses the same type so UMat data stays on the OpenCL device.
+    template <class M>
+    static void NonMaxSuppression(const M& src, M& dest, int block_size, double threshold) {
         if (src.type() != CV_32F) throw std::invalid_argument("src must be float image");
+
+        M window_max;
+        const auto block = cv::getStructuringElement(cv::MORPH_RECT, cv::Size(block_size, block_size));
+        cv::dilate(src, window_max, block, cv::Point(-1, -1), 1, cv::BORDER_CONSTANT, cv::Scalar::all(-std::numeric_limits<float>::max()));
+
+        M is_max;
+        M not_positive;
+        M above_threshold;
+        cv::compare(src, window_max, is_max, cv::CMP_GE);
+        cv::compare(src, 0.0, not_positive, cv::CMP_LE);
+        cv::compare(src, SmallestFloatAtLeast(threshold), above_threshold, cv::CMP_GE);
+
+        M keep;
+        cv::bitwise_or(is_max, not_positive, keep);
+        cv::bitwise_and(keep, above_threshold, keep);
+
         dest.create(src.rows, src.cols, CV_32F);
-        const auto half_block = block_size / 2;
-        for (auto row = 0; row < src.rows; ++row) {
-            auto src_row = src.ptr<float>(row);
-            auto dest_row = dest.ptr<float>(row);
-            for (auto col = 0; col < src.cols; ++col) {
-                const auto src_pixel = src_row[col];
-                if (src_pixel < threshold) {
-                    dest_row[col] = 0.0f;
-                    continue;
-                }
-
-                auto dest_pixel = src_pixel;
-                for (auto w_row = row - half_block; dest_pixel > 0.0 && w_row <= row + half_block; ++w_row) {
-                    if (w_row < 0) continue;
-                    if (w_row >= src.rows) continue;
-                    auto window_row = src.ptr<float>(w_row);
-                    for (auto w_col = col - half_block; w_col <= col + half_block; ++w_col) {
-                        if (w_col < 0) continue;
-                        if (w_col >= src.cols) continue;
-                        const auto window_pixel = window_row[w_col];
-                        if (window_pixel > dest_pixel) {
-                            dest_pixel = 0.0f;
-                            break;
-                        }
-                    }
-                }
-                dest_row[col] = dest_pixel;
-            }
-        }
+        dest.setTo(cv::Scalar::all(0.0));
+        src.copyTo(dest, keep);
     }
 
-    // Harris corener detection implemented using standard OpenCV components
-    void FindCornersOpenCV(const cv::Mat& float_image, cv::Mat& corners_mat) {
-        cv::Mat harris_img;
-        cv::Mat bw_image;
+private:
+    // The result of the UMat pipeline mapped into host memory.
+    // The Mat is declared last so that it is unmapped before the UMat that owns the memory is released.
+    struct UMatCorners {
+        cv::UMat umat;
+        cv::Mat mat;
+    };
+
+    // Colour conversion code used for images that are already greyscale
+    static constexpr int kNoConversion = -1;
+
+    bool use_umat_;
+
+    // Wraps the pixels of an image in a cv::Mat without copying them
+    template <class P>
+    static cv::Mat ToMat(const Image<P>& image, int type) {
+        return cv::Mat(image.height(), image.width(), type, const_cast<uint8_t*>(image.data()), image.stride());
+    }
+
+    // Runs the pipeline on cv::Mat or cv::UMat and returns a view over the result
+    Image<float> FindCornersMat(const cv::Mat& image_mat, int color_conversion) {
+        if (use_umat_) return FindCornersUMat(image_mat, color_conversion);
+
+        auto corners_mat = std::make_shared<cv::Mat>();
+        FindCornersOpenCV(image_mat, color_conversion, *corners_mat);
+        return Image<float>(std::shared_ptr<uint8_t>(corners_mat, corners_mat->data), corners_mat->cols, corners_mat->rows, corners_mat->step[0]);
+    }
+
+    // Runs the pipeline on cv::UMat and returns a view over the mapped result.
+    // Devices that share memory with the host can map the result without copying it. The result is mapped for reading and
+    // writing, since callers may modify the image they are given (and nothing else uses the cv::UMat).
+    Image<float> FindCornersUMat(const cv::Mat& image_mat, int color_conversion) {
+        auto corners = std::make_shared<UMatCorners>();
+        FindCornersOpenCV(image_mat.getUMat(cv::ACCESS_READ), color_conversion, corners->umat);
+        corners->mat = corners->umat.getMat(cv::ACCESS_RW);
+        const auto& mat = corners->mat;
+        return Image<float>(std::shared_ptr<uint8_t>(corners, mat.data), mat.cols, mat.rows, mat.step[0]);
+    }
+
+    // Returns the smallest float that is not less than value.
+    // cv::compare converts its scalar to the type of the image, so this keeps "pixel >= threshold" exact for float pixels.
+    static float SmallestFloatAtLeast(double value) {
+        const auto float_value = static_cast<float>(value);
+        return float_value < value ? std::nextafter(float_value, std::numeric_limits<float>::infinity()) : float_value;
+    }
+
+    // Harris corener detection implemented using standard OpenCV components.
+    // M is either cv::Mat or cv::UMat. The image is converted to greyscale with color_conversion unless it is kNoConversion.
+    template <class M>
+    void FindCornersOpenCV(const M& image, int color_conversion, M& corners) {
+        M gray_image;
+        M float_image;
+        M harris_img;
+        if (color_conversion != kNoConversion) cv::cvtColor(image, gray_image, color_conversion);
+        (color_conversion != kNoConversion ? gray_image : image).convertTo(float_image, CV_32F, 1.0/255.0);
         cv::cornerHarris(float_image, harris_img, structure_size_, smoothing_size_, k_);
         double min, max;
         cv::minMaxLoc(harris_img, &min, &max);
-        NonMaxSuppression(harris_img, corners_mat, suppression_size_, min + threshold_ratio_ * (max - min));
+        NonMaxSuppression(harris_img, corners, suppression_size_, min + threshold_ratio_ * (max - min));
     }
 };
 }
-
@@ -0,0 +1,56 @@
+#pragma once
+// Harris corner detection run by a detection service in another process
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "detection_service.h"
+#include "harris_base.h"
+
+namespace harris {
+
+// Sends each frame to a detection service (see DetectionServer) and waits for its corners.
+// The service must have been started with the same detector parameters as this class, otherwise the constructor throws.
+// Each frame is copied into the client's single shared memory slot and waited for before the next is sent, so only one frame
+// is in flight. The service reads the slot in place and only the corner list comes back. (Use DetectionClient directly to
+// write frames straight into several slots with a request in flight for each.)
+class HarrisRemote : public HarrisBase {
+public:
+
+    // Connects to the service at socket_path and uses its detector for the given backend (e.g. "opencl")
+    HarrisRemote(const std::string& socket_path, const std::string& backend, int smoothing_size = 5, int structure_size = 5, float harris_k = 0.04, float threshold_ratio = 0.5, int suppression_size = 9) :
+        HarrisBase(smoothing_size, structure_size, harris_k, threshold_ratio, suppression_size),
+        client_(socket_path, backend, *this, 1) {
+    }
+
+    Image<float> FindCorners(const Image<Argb32>& image) override { return ToCornerImage(FindCornerList(image), image.width(), image.height()); }
+    Image<float> FindCorners(const Image<Bgr24>& image) override { return ToCornerImage(FindCornerList(image), image.width(), image.height()); }
+    Image<float> FindCorners(const Image<uint8_t>& image) override { return ToCornerImage(FindCornerList(image), image.width(), image.height()); }
+
+    CornerList FindCornerList(const Image<Argb32>& image) override { return FindCornerListRemote(image); }
+    CornerList FindCornerList(const Image<Bgr24>& image) override { return FindCornerListRemote(image); }
+    CornerList FindCornerList(const Image<uint8_t>& image) override { return FindCornerListRemote(image); }
+
+private:
+    DetectionClient client_;
+
+    template <class P>
+    CornerList FindCornerListRemote(const Image<P>& image) {
+        client_.Submit(0, image);
+        return client_.Receive();
+    }
+
+    // Builds a corner image (zero everywhere but the corners) from a corner list.
+    // The list comes from another process, so corners outside the frame are rejected rather than written.
+    static Image<float> ToCornerImage(const CornerList& corners, int width, int height) {
+        Image<float> image(width, height);
+        for (const auto& corner : corners) {
+            if (corner.x < 0 || corner.x >= width || corner.y < 0 || corner.y >= height) throw std::runtime_error("The detection service returned a corner outside the frame");
+            image.RowPtr(corner.y)[corner.x] = corner.response;
+        }
+
+        return image;
+    }
+};
+}
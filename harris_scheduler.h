@@ -0,0 +1,294 @@
+#pragma once
+// Harris corner detection spread over several detectors (e.g. the C++ and OpenCL implementations) one frame at a time
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "harris_base.h"
+
+namespace harris {
+
+// Runs several Harris corner detectors at once, each on its own thread, and sends every frame to a detector that is free.
+// Frames are queued with Submit and their corners are returned by Next in the order the frames were submitted, however
+// the frames were spread over the detectors. Several frames need to be in flight to keep every detector busy.
+// A detector that is free only takes the next frame if it would finish it before a busier but faster detector could.
+// The time per frame of each detector is a moving average of the frames it has processed, so a slow detector (e.g. the CPU
+// next to a discrete GPU) takes a share of the frames in proportion to its throughput, and none at all if waiting for the
+// fast one is always quicker.
+// The first frame of each detector isn't timed, since it includes one-off costs such as building OpenCL programs. A detector
+// that hasn't had a frame for a while takes the next one anyway and starts its average again from that frame, so an
+// estimate made slow by a one-off stall recovers. Corners are returned in order, so a probe that takes longer than the other
+// detectors need for the frames queued behind it holds them up. Each such probe doubles the number of frames before the
+// detector probes again, so a detector that really is slow costs less and less.
+class HarrisScheduler : public HarrisBase {
+public:
+
+    // Uses the given detectors, which must all have the same parameters
+    explicit HarrisScheduler(std::vector<std::shared_ptr<HarrisBase>> detectors) :
+        HarrisBase(First(detectors).smoothing_size(), First(detectors).structure_size(), First(detectors).k(), First(detectors).threshold_ratio(), First(detectors).suppression_size()),
+        detectors_(std::move(detectors)),
+        states_(detectors_.size()),
+        stopped_(false) {
+        for (auto i = 0U; i < detectors_.size(); ++i) {
+            workers_.emplace_back([this, i]() { RunFrames(i); });
+        }
+    }
+
+    // Rule of five: Neither movable nor copyable
+    HarrisScheduler(const HarrisScheduler&) = delete;
+    HarrisScheduler(HarrisScheduler&&) = delete;
+    HarrisScheduler& operator=(const HarrisScheduler&) = delete;
+    HarrisScheduler& operator=(HarrisScheduler&&) = delete;
+
+    // Finishes every submitted frame before returning
+    ~HarrisScheduler() override {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopped_ = true;
+        }
+
+        changed_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    size_t size() const { return detectors_.size(); }
+
+    // Queues a frame. Images that view memory owned elsewhere (e.g. a cv::Mat) aren't copied, so their pixels must not change
+    // until Next has returned the corners of the frame.
+    template <class P>
+    void Submit(Image<P> image) {
+        Task task;
+        task.run = [image = std::move(image)](HarrisBase& detector) { return detector.FindCorners(image); };
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            results_.push_back(task.result.get_future());
+            queue_.push_back(std::move(task));
+        }
+
+        changed_.notify_all();
+    }
+
+    // Returns the corners of the oldest frame that hasn't been returned yet, waiting for it if needed.
+    // Rethrows anything the detector threw for that frame.
+    Image<float> Next() {
+        std::future<Image<float>> result;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (results_.empty()) throw std::logic_error("No frames have been submitted");
+            result = std::move(results_.front());
+            results_.pop_front();
+        }
+
+        return result.get();
+    }
+
+    // Number of frames submitted whose corners haven't been returned by Next yet
+    size_t pending() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return results_.size();
+    }
+
+    // Number of frames processed by a detector and its average time per frame
+    size_t frame_count(size_t detector) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return states_.at(detector).frames;
+    }
+
+    double average_ms(size_t detector) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return states_.at(detector).average_ms;
+    }
+
+    // Finds the corners of a single frame. No other frames can be in flight, so only one detector is used at a time.
+    Image<float> FindCorners(const Image<Argb32>& image) override { return FindCornersNow(image); }
+    Image<float> FindCorners(const Image<Bgr24>& image) override { return FindCornersNow(image); }
+    Image<float> FindCorners(const Image<uint8_t>& image) override { return FindCornersNow(image); }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // Weight of the latest time in the moving averages
+    static constexpr double kSmoothing = 0.2;
+
+    // Frames processed by other detectors before an idle detector takes one to time itself again, at first and at most
+    static constexpr size_t kProbeInterval = 20;
+    static constexpr size_t kMaxProbeInterval = kProbeInterval << 8;
+
+    struct DetectorState {
+        bool busy = false;
+        Clock::time_point busy_until;  // Estimated time the current frame will be done
+        double average_ms = 0.0;       // Zero until a frame after the first has been timed
+        size_t frames = 0;
+        size_t idle_frames = 0;        // Frames processed by other detectors since this one last took a frame
+        size_t probe_interval = kProbeInterval;
+        bool probing = false;          // The current frame was taken only to time the detector again
+        double probe_budget_ms = 0.0;  // Time the other detectors needed for the frames queued when the probe started
+    };
+
+    // A queued frame. The result is only set once the detector's statistics include the frame.
+    struct Task {
+        std::function<Image<float>(HarrisBase&)> run;
+        std::promise<Image<float>> result;
+    };
+
+    std::vector<std::shared_ptr<HarrisBase>> detectors_;
+    mutable std::mutex mutex_;
+    std::condition_variable changed_;
+    std::deque<Task> queue_;
+    std::deque<std::future<Image<float>>> results_;
+    std::vector<DetectorState> states_;
+    bool stopped_;
+    std::vector<std::thread> workers_;
+
+    static const HarrisBase& First(const std::vector<std::shared_ptr<HarrisBase>>& detectors) {
+        if (detectors.empty() || !detectors.front()) throw std::invalid_argument("At least one detector is required");
+        return *detectors.front();
+    }
+
+    template <class P>
+    Image<float> FindCornersNow(const Image<P>& image) {
+        if (pending() != 0) throw std::logic_error("FindCorners can't be used while frames submitted with Submit are in flight");
+        Submit(image);
+        return Next();
+    }
+
+    // Runs on the thread of a detector until the scheduler is destroyed and the queue is empty
+    void RunFrames(size_t index) {
+        auto& state = states_[index];
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            if (queue_.empty()) {
+                if (stopped_) return;
+                changed_.wait(lock);
+                continue;
+            }
+
+            const auto probe = state.idle_frames >= state.probe_interval;
+            if (!probe && !ShouldTake(index)) {
+                // Look again when a busy detector is expected to finish, or when something changes
+                const auto wake = NextExpectedFinish();
+                if (wake == Clock::time_point::max()) changed_.wait(lock);
+                else changed_.wait_until(lock, wake);
+                continue;
+            }
+
+            auto task = std::move(queue_.front());
+            queue_.pop_front();
+            for (auto& other : states_) {
+                ++other.idle_frames;
+            }
+
+            const auto start = Clock::now();
+            state.busy = true;
+            state.probing = probe;
+            if (probe) state.probe_budget_ms = QueuedWorkMs(index);
+            state.idle_frames = 0;
+            state.busy_until = start + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double, std::milli>(state.average_ms));
+            lock.unlock();
+
+            Image<float> corners;
+            std::exception_ptr error;
+            try {
+                corners = task.run(*detectors_[index]);
+            } catch (...) {
+                error = std::current_exception();
+            }
+
+            const auto time_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+            lock.lock();
+            if (state.frames == 0) {
+                // The first frame isn't timed
+            } else if (state.frames == 1 || state.probing) {
+                state.average_ms = time_ms;
+            } else {
+                state.average_ms = kSmoothing * time_ms + (1.0 - kSmoothing) * state.average_ms;
+            }
+
+            if (state.probing) {
+                // A probe that held up the other detectors is only repeated after twice as many frames
+                state.probe_interval = time_ms > state.probe_budget_ms ? std::min(2 * state.probe_interval, kMaxProbeInterval) : kProbeInterval;
+            }
+
+            state.busy = false;
+            ++state.frames;
+            if (error) task.result.set_exception(error);
+            else task.result.set_value(std::move(corners));
+            changed_.notify_all();
+        }
+    }
+
+    // Returns true if a free detector should take the frame at the front of the queue.
+    // The queued frames are handed out in order, each to the detector that would finish it first (a busy detector can only
+    // start once its current frame is done). The detector takes a frame if any of them would be handed to it.
+    bool ShouldTake(size_t index) const {
+        const auto now = Clock::now();
+        std::vector<double> free_in_ms(states_.size(), 0.0);
+        for (auto i = 0U; i < states_.size(); ++i) {
+            if (states_[i].busy) free_in_ms[i] = std::max(0.0, std::chrono::duration<double, std::milli>(states_[i].busy_until - now).count());
+        }
+
+        for (auto frame = 0U; frame < queue_.size(); ++frame) {
+            auto best = index;
+            for (auto i = 0U; i < states_.size(); ++i) {
+                if (free_in_ms[i] + states_[i].average_ms < free_in_ms[best] + states_[best].average_ms) best = i;
+            }
+
+            if (best == index) return true;
+            free_in_ms[best] += states_[best].average_ms;
+        }
+
+        return false;
+    }
+
+    // Returns the time the other detectors are expected to need to finish their current frames and every queued frame,
+    // handing the frames out as ShouldTake does
+    double QueuedWorkMs(size_t index) const {
+        const auto now = Clock::now();
+        std::vector<double> free_in_ms(states_.size(), 0.0);
+        for (auto i = 0U; i < states_.size(); ++i) {
+            if (states_[i].busy) free_in_ms[i] = std::max(0.0, std::chrono::duration<double, std::milli>(states_[i].busy_until - now).count());
+        }
+
+        for (auto frame = 0U; frame < queue_.size(); ++frame) {
+            auto best = states_.size();
+            for (auto i = 0U; i < states_.size(); ++i) {
+                if (i != index && (best == states_.size() || free_in_ms[i] + states_[i].average_ms < free_in_ms[best] + states_[best].average_ms)) best = i;
+            }
+
+            if (best == states_.size()) break;
+            free_in_ms[best] += states_[best].average_ms;
+        }
+
+        auto work_ms = 0.0;
+        for (auto i = 0U; i < states_.size(); ++i) {
+            if (i != index) work_ms = std::max(work_ms, free_in_ms[i]);
+        }
+
+        return work_ms;
+    }
+
+    // Returns the earliest time a busy detector is expected to finish that hasn't passed yet.
+    // A detector that overruns its estimate wakes the others when it finishes.
+    Clock::time_point NextExpectedFinish() const {
+        const auto now = Clock::now();
+        auto wake = Clock::time_point::max();
+        for (const auto& state : states_) {
+            if (state.busy && state.busy_until > now) wake = std::min(wake, state.busy_until);
+        }
+
+        return wake;
+    }
+};
+}
@@ -1,8 +1,10 @@
 #pragma once
 
+#include "aligned_allocator.h"
 #include "numerics.h"
 
 #include <initializer_list>
+#include <memory>
 #include <vector>
 
 namespace harris {
@@ -43,6 +45,17 @@ struct Argb32 {
     uint8_t blue() const { return static_cast<uint8_t>(data & 0xffU); }
 };
 
+// A 24 bits per pixel full color (sRGB) pixel stored as blue, green and red bytes (OpenCV's default CV_8UC3 layout)
+struct Bgr24 {
+    uint8_t blue;
+    uint8_t green;
+    uint8_t red;
+
+    float RedFloat() const { return static_cast<float>(red) / 255.0f; }
+    float GreenFloat() const { return static_cast<float>(green) / 255.0f; }
+    float BlueFloat() const { return static_cast<float>(blue) / 255.0f; }
+};
+
 // A pixel containing a structure tensor.
 struct StructureTensor {
 
@@ -61,6 +74,7 @@ struct StructureTensor {
 
 // Templated image type.
 // All images must provide a pixel type and can be accessed via row pointer for that type.
+// Image data is page aligned so that it can be shared with OpenCL devices without copying (except for views over memory owned elsewhere).
 template <class P>
 class Image {
 public:
@@ -96,10 +110,10 @@ public:
         width_(width),
         height_(height),
         stride_(stride),
-        data_(std::move(data)) {
+        data_(data.begin(), data.end()) {
             if (width <= 0) throw std::invalid_argument("The width parameter must be larger than zero");
             if (height <= 0) throw std::invalid_argument("The height parameter must be larger than zero");
-            if (stride < width*4) throw std::invalid_argument("The stride paramter is not large enough to fit the width of the image");
+            if (stride < width*sizeof(P)) throw std::invalid_argument("The stride paramter is not large enough to fit the width of the image");
             if (data_.size() < stride*height) throw std::invalid_argument("The data parameter is not large enough to fit the entire image.");
         }
 
@@ -114,6 +128,21 @@ public:
             if (stride < width*sizeof(P)) throw std::invalid_argument("The stride paramter is not large enough to fit the width of the image");
         }
 
+    // Creates an image that views memory owned by something else (e.g. a cv::Mat) without copying it.
+    // The memory stays alive for as long as the image or any copy of it exists. Copies share the same memory.
+    // (Use the aliasing constructor of std::shared_ptr to tie the data pointer to the lifetime of its owner)
+    Image(std::shared_ptr<uint8_t> data, int width, int height, size_t stride) :
+        width_(width),
+        height_(height),
+        stride_(stride),
+        data_(),
+        view_(std::move(data)) {
+            if (width <= 0) throw std::invalid_argument("The width parameter must be larger than zero");
+            if (height <= 0) throw std::invalid_argument("The height parameter must be larger than zero");
+            if (stride < width*sizeof(P)) throw std::invalid_argument("The stride paramter is not large enough to fit the width of the image");
+            if (!view_) throw std::invalid_argument("The data parameter must not be null");
+        }
+
     // Accessors
 
     int width() const { return width_; }
@@ -123,32 +152,38 @@ public:
     // Const data accessor.
     // This will be a buffer with size at least height*stride bytes organized in raster-scan order.
     // (i.e. each pixel is indexed at data()[y * stride + x])
-    const uint8_t* data() const { return data_.data(); }
+    const uint8_t* data() const { return view_ ? view_.get() : data_.data(); }
 
     // Non-const data accessor.
     // This will be a buffer with size at least height*stride bytes organized in raster-scan order.
     // (i.e. each pixel is indexed at data()[y * stride + x])
-    uint8_t* data() { return data_.data(); }
+    uint8_t* data() { return view_ ? view_.get() : data_.data(); }
 
     // Used to check for an empty image
     bool empty() const { return width_ <= 0; }
     operator bool() const { return !empty(); }
 
+    // Used to check whether the image views memory owned by something else.
+    // Copies of a view share its memory, so writing to the pixels of one changes the pixels of all of them (copies of other
+    // images have pixels of their own).
+    bool is_view() const { return static_cast<bool>(view_); }
+
     // Const pixel accessor.
     // This will be a pointer to the first pixel in the given row.
     // Accessing by row provides generally more performant way to access pixel data.
-    const PixelType* RowPtr(int y) const { return reinterpret_cast<const PixelType*>(data_.data() + y * stride_); }
+    const PixelType* RowPtr(int y) const { return reinterpret_cast<const PixelType*>(data() + y * stride_); }
 
     // Non-const pixel accessor.
     // This will be a pointer to the first pixel in the given row.
     // Accessing by row provides generally more performant way to access pixel data.
-    PixelType* RowPtr(int y) { return reinterpret_cast<PixelType*>(data_.data() + y * stride_); }
+    PixelType* RowPtr(int y) { return reinterpret_cast<PixelType*>(data() + y * stride_); }
 
 private:
     int width_;
     int height_;
     int stride_;
-    std::vector<uint8_t> data_;
+    std::vector<uint8_t, AlignedAllocator<uint8_t>> data_;
+    std::shared_ptr<uint8_t> view_;
 };
 
 }
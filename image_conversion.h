@@ -23,6 +23,40 @@ Image<float> ToFloat(const Image<Argb32>& src) {
     return dest;
 }
 
+Image<float> ToFloat(const Image<Bgr24>& src) {
+    Image<float> dest = Map<float>(src, [](Bgr24 src_pixel) {
+        // Using Rec.709 luma conversion as per sRGB
+        return src_pixel.RedFloat() * 0.2126f + src_pixel.GreenFloat() * 0.7152f + src_pixel.BlueFloat() * 0.0722f;
+    });
+
+    return dest;
+}
+
+Image<float> ToFloat(const Image<uint8_t>& src) {
+    Image<float> dest = Map<float>(src, [](uint8_t src_pixel) {
+        // Greyscale pixels are already luma
+        return static_cast<float>(src_pixel) / 255.0f;
+    });
+
+    return dest;
+}
+
+Image<Argb32> ToArgb32(const Image<Bgr24>& src) {
+    Image<Argb32> dest = Map<Argb32>(src, [](Bgr24 src_pixel) {
+        return Argb32(255, src_pixel.red, src_pixel.green, src_pixel.blue);
+    });
+
+    return dest;
+}
+
+Image<Argb32> ToArgb32(const Image<uint8_t>& src) {
+    Image<Argb32> dest = Map<Argb32>(src, [](uint8_t src_pixel) {
+        return Argb32(255, src_pixel, src_pixel, src_pixel);
+    });
+
+    return dest;
+}
+
 Image<Argb32> ToArgb32(const Image<float>& src) {
     Image<Argb32> dest = Map<Argb32>(src, [](float src_pixel) { 
         return Argb32(1.0f, src_pixel, src_pixel, src_pixel); 
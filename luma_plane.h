@@ -0,0 +1,16 @@
+#pragma once
+// Reads the luma of raw YUV 4:2:0 video frames
+
+#include "opencv2/opencv.hpp"
+
+namespace harris {
+
+// Returns the Y plane of a raw YUV 4:2:0 video frame as a greyscale image without copying it.
+// Decoders return these frames (I420, YV12 or NV12) as a single channel image of width columns and height * 3 / 2 rows,
+// with the Y plane in the first height rows followed by the chroma rows. Returns an empty image for any other frame (e.g. if
+// the decoder converted it to BGR anyway, or returned another raw layout), so that the caller can fall back to BGR frames.
+inline cv::Mat LumaPlane(const cv::Mat& frame, int width, int height) {
+    if (frame.type() != CV_8UC1 || frame.cols != width || frame.rows != height * 3 / 2) return cv::Mat();
+    return frame.rowRange(0, height);
+}
+}
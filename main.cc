@@ -1,31 +1,79 @@
+#include <algorithm>
+#include <cctype>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <deque>
 #include <functional>
 #include <iostream>
+#include <iterator>
 #include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "opencv2/opencv.hpp"
 #include "harris_cpp.h"
 #include "harris_opencv.h"
 #include "harris_opencl.h"
+#include "harris_opencl_multi.h"
+#include "harris_remote.h"
+#include "harris_scheduler.h"
+#include "backend_selector.h"
+#include "corner_file.h"
+#include "deadline_governor.h"
+#include "detection_service.h"
+#include "frame_archive.h"
+#include "frame_prefetcher.h"
+#include "frame_stream.h"
+#include "luma_plane.h"
+#include "stream_queues.h"
+#include "thread_pool.h"
 
 const cv::String keys =
     "{help h usage ? |      | Print this message                                                                                            }"
     "{@input         |      | Input image or video                                                                                          }"
     "{o output       |      | Outputs a version of the input with markers on each corner (use a file that ends with .m4v to output a video) }"
     "{s show         |      | Displays a window containing a version of the input with markers on each corner                               }"
-    "{b benchmark    |      | Prints the rendering time for each frame as it's converted                                                    }"
+    "{corners        |      | Write the corners of every frame to a binary corner file (much cheaper than writing an --output video)        }"
+    "{b benchmark    |      | Prints the rendering time for each frame as it's converted (and the time of each OpenCL kernel with --opencl) }"
+    "{batch          |      | Find the corners of every image in a directory or matching a glob pattern and write them to <image>.corners   }"
+    "{multi          |      | Process several comma separated videos at once on one pool of workers and report each stream's throughput     }"
+    "{multi-deadline |      | With --multi, serve the stream whose oldest frame is closest to its deadline first rather than round robin    }"
+    "{prefetch       |    4 | The number of video frames decoded ahead on a separate thread                                                 }"
+    "{realtime       |      | Keep the latency of each frame within this many ms by dropping frames or detecting at half resolution         }"
+    "{stream         |      | Read Y4M or HARRIS-RAW frames from the input (- for stdin) and write a line of corners per frame to stdout    }"
+    "{serve          |      | Run as a detection service on this UNIX socket, with a warmed-up detector per backend for --connect clients   }"
+    "{connect        |      | Send frames to the detection service on this UNIX socket rather than creating a detector in this process      }"
+    "{archive        |      | Convert the input image or video to a raw frame archive that can be used as a much faster input, then exit    }"
     "{smoothing      |    5 | The size (in pixels) of the gaussian smoothing kernel. This must be an odd number                             }"
     "{structure      |    5 | The size (in pixels) of the window used to define the structure tensor of each pixel                          }"
     "{suppression    |    9 | The size (in pixels) of the non-maximum suppression window                                                    }"
     "{k harris_k     | 0.04 | The value of the Harris free parameter                                                                        }"
     "{threshold      |  0.5 | The Harris response suppression threshold defined as a ratio of the maximum response value                    }"
     "{opencv         |      | Use the OpenCV algorithm rather than the pure C++ method                                                      }"
+    "{auto           |      | Time every backend on frames at the input resolution and use the fastest (the choice is cached for this host) }"
+    "{cv-umat        |      | Run the OpenCV algorithm on cv::UMat so OpenCV can use OpenCL (use with --opencv)                             }"
+    "{luma           |      | Ask the video decoder for raw YUV frames and detect corners on the Y plane without any colour conversion      }"
     "{opencl         |      | Use the OpenCL algorithm rather than the pure C++ method                                                      }"
     "{cl-platform    |    0 | The index of the platform to use when runnning OpenCL algorithm                                               }"
     "{cl-device      |   -1 | The index of the device to use when runnning OpenCL algorithm (use -1 to select first GPU if available)       }"
+    "{cl-cache       |      | Directory used to cache compiled OpenCL programs (defaults to ~/.cache/harris/opencl, use 'none' to disable)  }"
+    "{cl-multi       |      | Split each frame into bands processed by every OpenCL device of every platform                                }"
+    "{schedule       |      | Send each frame to whichever of the C++ and OpenCL detectors is free, with several frames in flight           }"
+    "{cl-tune        |      | Tune the OpenCL work group sizes for this device and frame size (results are kept in the --cl-cache directory)}"
+    "{cl-specialize  |      | Compile the OpenCL program for the given parameters rather than passing them to the kernels as arguments      }"
     ;
 
 using namespace harris;
 
+// Frames the demo keeps in flight on a HarrisScheduler for each of its detectors
+constexpr int kScheduledFramesPerDetector = 2;
+
 // Measures the time taken by a lambda function in ms
 double MeasureTimeMs(std::function<void()> func) {
         // Start the timer
@@ -41,6 +89,22 @@ double MeasureTimeMs(std::function<void()> func) {
         return time_in_ms;
 }
 
+// Runs a function when it goes out of scope, however the scope is left
+class ScopeExit {
+public:
+    explicit ScopeExit(std::function<void()> func) : func_(std::move(func)) {}
+    ~ScopeExit() { func_(); }
+
+    // Rule of five: Neither movable nor copyable
+    ScopeExit(const ScopeExit&) = delete;
+    ScopeExit(ScopeExit&&) = delete;
+    ScopeExit& operator=(const ScopeExit&) = delete;
+    ScopeExit& operator=(ScopeExit&&) = delete;
+
+private:
+    std::function<void()> func_;
+};
+
 // Takes a Harris corner matrix and puts rectangles at each point on the corresponding image matrix
 void HighlightCorners(Image<float> corners, cv::Mat image, int block_size = 5) {
     const auto half_block = block_size / 2;
@@ -53,6 +117,525 @@ void HighlightCorners(Image<float> corners, cv::Mat image, int block_size = 5) {
     }
 }
 
+// Returns an image that views the pixels of an OpenCV image without copying them. The cv::Mat must outlive the image.
+template <class P>
+Image<P> ImageView(const cv::Mat& image) {
+    return Image<P>(std::shared_ptr<uint8_t>(std::shared_ptr<uint8_t>(), image.data), image.cols, image.rows, image.step[0]);
+}
+
+// Runs a Harris corner detector on an 8 bit BGR, BGRA or greyscale OpenCV image without converting or copying its pixels first
+Image<float> FindCorners(HarrisBase& harris, const cv::Mat& image) {
+    switch (image.type()) {
+    case CV_8UC1:
+        return harris.FindCorners(ImageView<uint8_t>(image));
+    case CV_8UC3:
+        return harris.FindCorners(ImageView<Bgr24>(image));
+    case CV_8UC4:
+        return harris.FindCorners(ImageView<Argb32>(image));
+    default:
+        throw std::invalid_argument("Only 8 bit greyscale, BGR and BGRA images are supported");
+    }
+}
+
+// Runs a Harris corner detector on an 8 bit BGR, BGRA or greyscale OpenCV image and returns the list of corners
+CornerList FindCornerList(HarrisBase& harris, const cv::Mat& image) {
+    switch (image.type()) {
+    case CV_8UC1:
+        return harris.FindCornerList(ImageView<uint8_t>(image));
+    case CV_8UC3:
+        return harris.FindCornerList(ImageView<Bgr24>(image));
+    case CV_8UC4:
+        return harris.FindCornerList(ImageView<Argb32>(image));
+    default:
+        throw std::invalid_argument("Only 8 bit greyscale, BGR and BGRA images are supported");
+    }
+}
+
+// Runs a Harris corner detector on a downscaled copy of an OpenCV image and returns the corners at full resolution
+Image<float> FindCornersDownscaled(HarrisBase& harris, const cv::Mat& image, double scale) {
+    cv::Mat small_image;
+    cv::resize(image, small_image, cv::Size(), scale, scale, cv::INTER_AREA);
+
+    Image<float> corners(image.cols, image.rows);
+    for (const auto& corner : FindCornerList(harris, small_image)) {
+        const auto x = std::min(static_cast<int>((corner.x + 0.5) / scale), image.cols - 1);
+        const auto y = std::min(static_cast<int>((corner.y + 0.5) / scale), image.rows - 1);
+        corners.RowPtr(y)[x] = corner.response;
+    }
+
+    return corners;
+}
+
+// Queues an 8 bit BGR, BGRA or greyscale OpenCV image on a scheduler without copying it. The cv::Mat must not change until
+// its corners have been returned.
+void SubmitFrame(HarrisScheduler& scheduler, const cv::Mat& image) {
+    switch (image.type()) {
+    case CV_8UC1:
+        return scheduler.Submit(ImageView<uint8_t>(image));
+    case CV_8UC3:
+        return scheduler.Submit(ImageView<Bgr24>(image));
+    case CV_8UC4:
+        return scheduler.Submit(ImageView<Argb32>(image));
+    default:
+        throw std::invalid_argument("Only 8 bit greyscale, BGR and BGRA images are supported");
+    }
+}
+
+// Returns the fastest backend for frames of the same size and pixel format as an 8 bit BGR, BGRA or greyscale OpenCV image
+BackendSelector::Selection SelectBackend(BackendSelector& selector, const cv::Mat& image) {
+    switch (image.type()) {
+    case CV_8UC1:
+        return selector.Select<uint8_t>(image.cols, image.rows);
+    case CV_8UC3:
+        return selector.Select<Bgr24>(image.cols, image.rows);
+    case CV_8UC4:
+        return selector.Select<Argb32>(image.cols, image.rows);
+    default:
+        throw std::invalid_argument("Only 8 bit greyscale, BGR and BGRA images are supported");
+    }
+}
+
+// Adds the time of a stage to the running total for the stage with the same name (keeping the order stages first ran in)
+void AddStageTiming(const StageTiming& timing, std::vector<StageTiming>& totals) {
+    const auto total = std::find_if(totals.begin(), totals.end(), [&](const StageTiming& t) { return t.name == timing.name; });
+    if (total == totals.end()) {
+        totals.push_back(timing);
+        return;
+    }
+
+    total->queued_ms += timing.queued_ms;
+    total->run_ms += timing.run_ms;
+}
+
+// Runs Harris corner detection on every frame of a stream and writes one line of corners per frame to stdout
+template <class P>
+void RunStream(HarrisBase& harris, FrameStreamReader& reader, bool benchmark_enabled) {
+    CornerLineWriter writer(stdout);
+    Image<P> frame;
+    auto num_frames = 0;
+    auto total_time_ms = 0.0;
+    while (reader.Read(frame)) {
+        CornerList corners;
+        const auto time_in_ms = MeasureTimeMs([&]() { corners = harris.FindCornerList(frame); });
+        total_time_ms += time_in_ms;
+
+        // Flush every frame so the next stage of a pipeline receives each frame as soon as it is ready
+        writer.Write(num_frames++, corners);
+        writer.Flush();
+
+        // stdout carries the corners, so timing goes to stderr
+        if (benchmark_enabled) std::cerr << time_in_ms << "ms" << std::endl;
+    }
+
+    std::cerr << num_frames << " frames were processed in " << total_time_ms / 1e3 << " seconds";
+    if (num_frames > 0) std::cerr << " with an average processing time of " << total_time_ms / num_frames << " ms";
+    std::cerr << "\n";
+}
+
+// Opens a stream of raw frames (a file, a FIFO or stdin if the name is -) and runs Harris corner detection on each frame
+int RunStream(HarrisBase& harris, const std::string& input_file, bool benchmark_enabled) {
+    const auto use_stdin = input_file == "-";
+    const auto file = use_stdin ? stdin : std::fopen(input_file.c_str(), "rb");
+    if (file == nullptr) {
+        std::cerr << "Failed to open input stream " << input_file << std::endl;
+        return 2;
+    }
+
+    // Frames are read in large blocks rather than the default buffer size
+    std::setvbuf(file, nullptr, _IOFBF, 1 << 20);
+
+    auto result = 0;
+    try {
+        FrameStreamReader reader(file);
+        switch (reader.format()) {
+            case StreamPixelFormat::kBgra: RunStream<Argb32>(harris, reader, benchmark_enabled); break;
+            case StreamPixelFormat::kBgr: RunStream<Bgr24>(harris, reader, benchmark_enabled); break;
+            case StreamPixelFormat::kGrey: RunStream<uint8_t>(harris, reader, benchmark_enabled); break;
+        }
+    } catch (const std::invalid_argument& e) {
+        std::cerr << "Failed to read input stream " << input_file << ": " << e.what() << std::endl;
+        result = 2;
+    }
+
+    if (!use_stdin) std::fclose(file);
+    return result;
+}
+
+// Returns a frame of an archive as an OpenCV image that views the mapped archive
+cv::Mat ArchiveFrame(FrameArchive& archive, size_t index) {
+    return cv::Mat(archive.height(), archive.width(), CV_8UC(BytesPerPixel(archive.format())), archive.FrameData(index), archive.stride());
+}
+
+// Converts an image or video readable by OpenCV into a raw frame archive
+int ConvertToArchive(const std::string& input_file, const std::string& archive_file) {
+    cv::VideoCapture input_video;
+    auto frame = cv::imread(input_file, cv::IMREAD_UNCHANGED);
+    if (frame.empty() && (!input_video.open(input_file) || !input_video.read(frame))) {
+        std::cerr << "Failed to load input file " << input_file << std::endl;
+        return 2;
+    }
+
+    try {
+        const auto format = frame.type() == CV_8UC4 ? StreamPixelFormat::kBgra : frame.type() == CV_8UC3 ? StreamPixelFormat::kBgr : StreamPixelFormat::kGrey;
+        if (frame.type() != CV_8UC1 && format == StreamPixelFormat::kGrey) throw std::invalid_argument("Only 8 bit greyscale, BGR and BGRA images are supported");
+
+        FrameArchiveWriter writer(archive_file, frame.cols, frame.rows, format);
+        do {
+            if (frame.size() != cv::Size(writer.width(), writer.height()) || BytesPerPixel(format) != frame.elemSize()) throw std::invalid_argument("Every frame must have the same size and pixel format");
+            writer.Append(frame.data, frame.step[0]);
+        } while (input_video.isOpened() && input_video.read(frame));
+
+        const auto frame_count = writer.frame_count();
+        if (!writer.Close()) throw std::invalid_argument("Failed to write frame archive " + archive_file);
+        std::cout << frame_count << " frames were written to " << archive_file << std::endl;
+    } catch (const std::invalid_argument& e) {
+        std::cerr << e.what() << std::endl;
+        return 3;
+    }
+
+    return 0;
+}
+
+// Returns true if a file has the extension of an image format cv::imread can decode
+bool HasImageExtension(const std::string& path) {
+    static const std::vector<std::string> kExtensions = {
+        "bmp", "dib", "jpeg", "jpg", "jpe", "jp2", "png", "webp", "pbm", "pgm", "ppm", "pxm", "pnm", "pfm", "sr", "ras", "tiff", "tif", "exr", "hdr", "pic"
+    };
+
+    const auto dot = path.find_last_of('.');
+    if (dot == std::string::npos || path.find_first_of('/', dot) != std::string::npos) return false;
+
+    auto extension = path.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return std::find(kExtensions.begin(), kExtensions.end(), extension) != kExtensions.end();
+}
+
+// Finds the corners of every image in a directory or matching a glob pattern and writes each list to <image>.corners
+// (in output_directory if it is not empty). Images are decoded and processed concurrently, one image per worker, and the
+// corner files are written on a separate thread. If share_detector is set every worker takes turns with a single detector
+// (e.g. for OpenCL), otherwise each worker has its own.
+int RunBatch(const std::string& pattern, const std::string& output_directory, const std::function<std::shared_ptr<HarrisBase>()>& create_harris, bool share_detector, bool benchmark_enabled) {
+    // Only image files are processed, so the .corners files of an earlier run (or anything else) in a directory are skipped
+    std::vector<cv::String> matches;
+    cv::glob(pattern, matches, false);
+    std::vector<cv::String> files;
+    std::copy_if(matches.begin(), matches.end(), std::back_inserter(files), [](const cv::String& file) { return HasImageExtension(file); });
+    if (files.empty()) {
+        std::cerr << "No images match " << pattern << std::endl;
+        return 2;
+    }
+
+    // With at least as many images as cores each image runs on one core. Parallelising within an image only adds
+    // overhead then, so each worker limits OpenMP to a single thread. With fewer images the cores are shared out.
+    const auto cores = std::max(1U, std::thread::hardware_concurrency());
+    const auto workers = std::min<size_t>(cores, files.size());
+    const auto openmp_threads = static_cast<int>(std::max<size_t>(1, cores / workers));
+
+    // Workers take an idle detector for each image and give it back when done
+    std::vector<std::shared_ptr<HarrisBase>> idle_detectors;
+    for (auto i = 0U; i < (share_detector ? 1 : workers); ++i) {
+        idle_detectors.push_back(create_harris());
+    }
+
+    std::mutex detector_mutex;
+    std::condition_variable detector_released;
+    std::mutex output_mutex;
+
+    // Declared before the workers so it outlives every task that writes to it
+    ThreadPool writer(1);
+    ThreadPool pool(workers, [openmp_threads]() {
+#ifdef _OPENMP
+        omp_set_num_threads(openmp_threads);
+#endif
+    });
+
+    std::vector<std::future<double>> image_times;
+    for (const std::string file : files) {
+        image_times.push_back(pool.Submit([&, file]() {
+            const auto image = cv::imread(file, cv::IMREAD_UNCHANGED);
+            if (image.empty()) {
+                std::lock_guard<std::mutex> lock(output_mutex);
+                std::cerr << "Failed to load input file " << file << std::endl;
+                return -1.0;
+            }
+
+            CornerList corners;
+            double time_in_ms;
+            {
+                std::shared_ptr<HarrisBase> harris;
+                {
+                    std::unique_lock<std::mutex> lock(detector_mutex);
+                    detector_released.wait(lock, [&]() { return !idle_detectors.empty(); });
+                    harris = idle_detectors.back();
+                    idle_detectors.pop_back();
+                }
+
+                // Gives the detector back however the image ends, so a failed image can't leave the other workers waiting
+                const ScopeExit release([&]() {
+                    {
+                        std::lock_guard<std::mutex> lock(detector_mutex);
+                        idle_detectors.push_back(harris);
+                    }
+
+                    detector_released.notify_one();
+                });
+
+                try {
+                    time_in_ms = MeasureTimeMs([&]() { corners = FindCornerList(*harris, image); });
+                } catch (const std::exception& e) {
+                    std::lock_guard<std::mutex> lock(output_mutex);
+                    std::cerr << "Failed to process input file " << file << ": " << e.what() << std::endl;
+                    return -1.0;
+                }
+            }
+
+            const auto name = output_directory.empty() ? file : output_directory + "/" + file.substr(file.find_last_of('/') + 1);
+            writer.Submit([&, corners = std::move(corners), path = name + ".corners"]() {
+                const auto corner_file = std::fopen(path.c_str(), "w");
+                if (corner_file != nullptr) {
+                    CornerLineWriter(corner_file).Write(0, corners);
+                    if (std::fclose(corner_file) == 0) return;
+                }
+
+                std::lock_guard<std::mutex> lock(output_mutex);
+                std::cerr << "Failed to write corner file " << path << std::endl;
+            });
+
+            return time_in_ms;
+        }));
+    }
+
+    auto total_time_ms = 0.0;
+    auto num_images = 0;
+    for (auto i = 0U; i < files.size(); ++i) {
+        const auto time_in_ms = image_times[i].get();
+        if (time_in_ms < 0.0) continue;
+        if (benchmark_enabled) std::cout << files[i] << ": " << time_in_ms << "ms" << std::endl;
+        total_time_ms += time_in_ms;
+        ++num_images;
+    }
+
+    std::cout << num_images << " images were processed by " << workers << " workers";
+    if (num_images > 0) std::cout << " with an average processing time of " << total_time_ms / num_images << " ms";
+    std::cout << "\n";
+    return num_images == static_cast<int>(files.size()) ? 0 : 2;
+}
+
+// Processing statistics of one stream in multi-stream mode
+struct StreamStats {
+    size_t frames = 0;
+    size_t failed_frames = 0;     // Frames that couldn't be processed (e.g. an unsupported pixel format)
+    double detect_ms = 0.0;       // Total time spent finding corners
+    double latency_ms = 0.0;      // Total time from a frame being decoded to its corners being found
+    double max_latency_ms = 0.0;
+    double elapsed_ms = 0.0;      // Time from the start until the last frame was processed
+};
+
+// Finds the corners of several videos at once on one pool of workers and writes each video's corners to <video>.corners
+// (in output_directory if one is given), one line per frame in the same format as --stream.
+// Each video is decoded on its own thread into a short queue. Workers take frames from the queues round robin (or by
+// deadline, which is the time the next frame arrives), and only one frame of a video is processed at a time.
+// A frame the detector rejects is skipped, while any other error stops every stream.
+int RunMultiStream(const std::string& inputs, const std::string& output_directory, const std::function<std::shared_ptr<HarrisBase>()>& create_harris, bool share_detector, bool deadline_enabled, bool benchmark_enabled) {
+    std::vector<std::string> files;
+    std::stringstream input_stream(inputs);
+    for (std::string file; std::getline(input_stream, file, ',');) {
+        if (!file.empty()) files.push_back(file);
+    }
+
+    if (files.empty()) {
+        std::cerr << "--multi needs at least one video" << std::endl;
+        return 1;
+    }
+
+    std::vector<cv::VideoCapture> captures(files.size());
+    std::vector<double> frame_interval_ms(files.size());
+    std::vector<FILE*> corner_files(files.size());
+    for (auto i = 0U; i < files.size(); ++i) {
+        if (!captures[i].open(files[i])) {
+            std::cerr << "Failed to load input file " << files[i] << std::endl;
+            return 2;
+        }
+
+        const auto fps = captures[i].get(cv::CAP_PROP_FPS);
+        frame_interval_ms[i] = 1e3 / (fps > 0.0 ? fps : 29.97);
+    }
+
+    for (auto i = 0U; i < files.size(); ++i) {
+        const auto name = output_directory.empty() ? files[i] : output_directory + "/" + files[i].substr(files[i].find_last_of('/') + 1);
+        corner_files[i] = std::fopen((name + ".corners").c_str(), "w");
+        if (corner_files[i] == nullptr) {
+            std::cerr << "Failed to create corner file " << name << ".corners" << std::endl;
+            for (auto j = 0U; j < i; ++j) {
+                std::fclose(corner_files[j]);
+            }
+
+            return 3;
+        }
+    }
+
+    // As in batch mode, each worker gets an equal share of the cores for OpenMP rather than every stream using all of them
+    const auto cores = std::max(1U, std::thread::hardware_concurrency());
+    const auto workers = std::min<size_t>(cores, files.size());
+    const auto openmp_threads = static_cast<int>(std::max<size_t>(1, cores / workers));
+
+    // OpenCL devices are shared by every worker, one frame at a time
+    std::vector<std::shared_ptr<HarrisBase>> detectors;
+    for (auto i = 0U; i < (share_detector ? 1 : workers); ++i) {
+        detectors.push_back(create_harris());
+    }
+
+    std::vector<std::mutex> detector_mutexes(detectors.size());
+    std::vector<StreamStats> stats(files.size());
+    std::mutex output_mutex;
+    auto aborted = false;
+
+    using Queues = StreamQueues<cv::Mat>;
+    Queues queues(files.size(), 2, deadline_enabled ? Queues::Policy::kDeadline : Queues::Policy::kRoundRobin);
+    const auto start = Queues::Clock::now();
+
+    // Frames are due when the next frame of their stream arrives
+    std::vector<std::thread> readers;
+    for (auto i = 0U; i < files.size(); ++i) {
+        readers.emplace_back([&, i]() {
+            cv::Mat frame;
+            while (captures[i].read(frame)) {
+                // Latency and deadline both start when the frame was decoded, so time spent waiting for space in the queue counts
+                const auto decoded = Queues::Clock::now();
+                const auto deadline = decoded + std::chrono::duration_cast<Queues::Clock::duration>(std::chrono::duration<double, std::milli>(frame_interval_ms[i]));
+                if (!queues.Push(i, frame, decoded, deadline)) break;
+
+                // The queued frame is still in use, so the next one is decoded into new memory
+                frame = cv::Mat();
+            }
+
+            queues.Finish(i);
+        });
+    }
+
+    {
+        ThreadPool pool(workers, [openmp_threads]() {
+#ifdef _OPENMP
+            omp_set_num_threads(openmp_threads);
+#endif
+        });
+
+        for (auto worker = 0U; worker < workers; ++worker) {
+            pool.Submit([&, worker]() {
+                const auto detector = worker % detectors.size();
+                Queues::Entry entry;
+                while (queues.Pop(entry)) {
+                    // Lets the next frame of the stream be taken however this one ends
+                    const ScopeExit done([&]() { queues.Done(entry.stream); });
+                    auto& stream = stats[entry.stream];
+                    CornerList corners;
+                    double time_in_ms;
+                    try {
+                        std::lock_guard<std::mutex> lock(detector_mutexes[detector]);
+                        time_in_ms = MeasureTimeMs([&]() { corners = FindCornerList(*detectors[detector], entry.item); });
+                    } catch (const std::invalid_argument& e) {
+                        std::lock_guard<std::mutex> lock(output_mutex);
+                        std::cerr << "Skipped frame " << stream.frames + stream.failed_frames << " of " << files[entry.stream] << ": " << e.what() << std::endl;
+                        ++stream.failed_frames;
+                        continue;
+                    } catch (const std::exception& e) {
+                        // The detector itself failed (e.g. the OpenCL device was lost), so the other workers stop too
+                        std::lock_guard<std::mutex> lock(output_mutex);
+                        std::cerr << "Failed to process " << files[entry.stream] << ": " << e.what() << std::endl;
+                        aborted = true;
+                        queues.Close();
+                        return;
+                    }
+
+                    // Only one frame of a stream is processed at a time, so its statistics and corner file need no lock
+                    const auto now = Queues::Clock::now();
+                    const auto latency_ms = std::chrono::duration<double, std::milli>(now - entry.decoded).count();
+                    CornerLineWriter(corner_files[entry.stream]).Write(stream.frames + stream.failed_frames, corners);
+
+                    stream.detect_ms += time_in_ms;
+                    stream.latency_ms += latency_ms;
+                    stream.max_latency_ms = std::max(stream.max_latency_ms, latency_ms);
+                    stream.elapsed_ms = std::chrono::duration<double, std::milli>(now - start).count();
+                    ++stream.frames;
+
+                    if (benchmark_enabled) {
+                        std::lock_guard<std::mutex> lock(output_mutex);
+                        std::cout << files[entry.stream] << " frame " << stream.frames << ": " << time_in_ms << "ms (" << latency_ms << "ms after decoding)" << std::endl;
+                    }
+                }
+            });
+        }
+    }
+
+    for (auto& reader : readers) {
+        reader.join();
+    }
+
+    auto failed = false;
+    auto skipped = false;
+    auto total_frames = 0U;
+    for (auto i = 0U; i < files.size(); ++i) {
+        const auto& stream = stats[i];
+        if (std::fclose(corner_files[i]) != 0) failed = true;
+        total_frames += stream.frames;
+        if (stream.failed_frames != 0) {
+            std::cout << files[i] << ": " << stream.failed_frames << " frames were skipped\n";
+            skipped = true;
+        }
+
+        if (stream.frames == 0) {
+            std::cout << files[i] << ": no frames\n";
+            continue;
+        }
+
+        std::cout << files[i] << ": " << stream.frames << " frames at " << stream.frames * 1e3 / stream.elapsed_ms << " fps, average processing time of " << stream.detect_ms / stream.frames << " ms, average latency of " << stream.latency_ms / stream.frames << " ms (at most " << stream.max_latency_ms << " ms)\n";
+    }
+
+    const auto elapsed_s = std::chrono::duration<double>(Queues::Clock::now() - start).count();
+    std::cout << total_frames << " frames of " << files.size() << " streams were processed by " << workers << " workers in " << elapsed_s << " seconds (" << total_frames / elapsed_s << " fps)\n";
+    if (failed) {
+        std::cerr << "Failed to write corner files" << std::endl;
+        return 3;
+    }
+
+    return aborted || skipped ? 2 : 0;
+}
+
+// The running detection service, stopped by SIGINT and SIGTERM
+DetectionServer* running_server = nullptr;
+
+// Hosts a detector for each backend that is available on this machine and serves clients until interrupted
+int RunServer(const std::string& socket_path, const std::function<std::shared_ptr<HarrisBase>(const std::string&)>& create_backend) {
+    std::vector<DetectionServer::Backend> backends;
+    for (const std::string name : { "cpp", "opencv", "opencl" }) {
+        try {
+            backends.emplace_back(name, create_backend(name));
+        } catch (const std::exception& e) {
+            std::cerr << "The " << name << " detector is not available: " << e.what() << std::endl;
+        }
+    }
+
+    try {
+        DetectionServer server(socket_path, backends);
+        running_server = &server;
+        std::signal(SIGINT, [](int) { running_server->Stop(); });
+        std::signal(SIGTERM, [](int) { running_server->Stop(); });
+
+        std::cout << "Serving on " << socket_path << std::endl;
+        server.Run();
+
+        std::signal(SIGINT, SIG_DFL);
+        std::signal(SIGTERM, SIG_DFL);
+        running_server = nullptr;
+        std::cout << server.frames() << " frames were processed in " << server.batches() << " batches\n";
+    } catch (const std::invalid_argument& e) {
+        std::cerr << e.what() << std::endl;
+        return 2;
+    }
+
+    return 0;
+}
+
 // Returns true if a string ends with a given substring
 inline bool ends_with(std::string const & value, std::string const & ending)
 {
@@ -76,8 +659,13 @@ int main(int argc, char* argv[]) {
     auto benchmark_enabled = parser.has("benchmark");
     auto output_enabled = parser.has("output");
     auto output_file = output_enabled ? parser.get<cv::String>("output") : cv::String();
+    auto corners_enabled = parser.has("corners");
+    auto corners_file = corners_enabled ? std::string(parser.get<cv::String>("corners")) : std::string();
     auto use_opencv = parser.has("opencv");
     auto use_opencl = parser.has("opencl");
+    auto auto_enabled = parser.has("auto");
+    auto luma_enabled = parser.has("luma");
+    auto cv_umat = parser.has("cv-umat");
     auto smoothing_size = parser.get<int>("smoothing");
     auto structure_size = parser.get<int>("structure");
     auto suppression_size = parser.get<int>("suppression");
@@ -85,6 +673,27 @@ int main(int argc, char* argv[]) {
     auto threshold_ratio = parser.get<float>("threshold");
     auto cl_platform = parser.get<int>("cl-platform");
     auto cl_device = parser.get<int>("cl-device");
+    auto cl_cache = parser.has("cl-cache") ? std::string(parser.get<cv::String>("cl-cache")) : DefaultCacheDirectory("opencl");
+    if (cl_cache == "none") cl_cache.clear();
+    auto cl_specialize = parser.has("cl-specialize");
+    auto cl_multi = parser.has("cl-multi");
+    auto schedule_enabled = parser.has("schedule");
+    auto cl_tune = parser.has("cl-tune");
+    auto prefetch_depth = parser.get<int>("prefetch");
+    auto realtime_enabled = parser.has("realtime");
+    auto realtime_budget_ms = realtime_enabled ? parser.get<double>("realtime") : 0.0;
+    auto stream_enabled = parser.has("stream");
+    auto archive_enabled = parser.has("archive");
+    auto archive_file = archive_enabled ? std::string(parser.get<cv::String>("archive")) : std::string();
+    auto serve_enabled = parser.has("serve");
+    auto serve_socket = serve_enabled ? std::string(parser.get<cv::String>("serve")) : std::string();
+    auto connect_enabled = parser.has("connect");
+    auto connect_socket = connect_enabled ? std::string(parser.get<cv::String>("connect")) : std::string();
+    auto multi_enabled = parser.has("multi");
+    auto multi_inputs = multi_enabled ? std::string(parser.get<cv::String>("multi")) : std::string();
+    auto multi_deadline = parser.has("multi-deadline");
+    auto batch_enabled = parser.has("batch");
+    auto batch_pattern = batch_enabled ? std::string(parser.get<cv::String>("batch")) : std::string();
 
     // Check for command line errors or --help param
     if (!parser.check())
@@ -93,28 +702,123 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    // Read the input image
-    auto input_image = cv::imread(input_file, cv::IMREAD_UNCHANGED);
+    // Converting to an archive doesn't run the detector
+    if (archive_enabled) {
+        return ConvertToArchive(input_file, archive_file);
+    }
+
+    // In stream mode stdout only carries corners, so diagnostic messages (e.g. OpenCL device information) go to stderr
+    if (stream_enabled) std::cout.rdbuf(std::cerr.rdbuf());
+
+    // Creates a harris algorithm by name
+    std::function<std::shared_ptr<HarrisBase>(const std::string&)> create_backend;
+    create_backend = [&](const std::string& backend) -> std::shared_ptr<HarrisBase> {
+        if (connect_enabled && backend != "schedule") {
+            return std::make_shared<HarrisRemote>(connect_socket, backend, smoothing_size, structure_size, harris_k, threshold_ratio, suppression_size);
+        } else if (backend == "schedule") {
+            return std::make_shared<HarrisScheduler>(std::vector<std::shared_ptr<HarrisBase>>{ create_backend("opencl"), create_backend("cpp") });
+        } else if (backend == "opencv" || backend == "opencv-umat") {
+            return std::make_shared<HarrisOpenCV>(smoothing_size, structure_size, harris_k, threshold_ratio, suppression_size, backend == "opencv-umat");
+        } else if (backend == "opencl-multi") {
+            auto harris_opencl = std::make_shared<HarrisOpenCLMulti>(HarrisOpenCLMulti::AllDevices(), smoothing_size, structure_size, harris_k, threshold_ratio, suppression_size, cl_cache, cl_specialize);
+            harris_opencl->SetProfiling(benchmark_enabled);
+            return harris_opencl;
+        } else if (backend == "opencl") {
+            auto harris_opencl = std::make_shared<HarrisOpenCL>(cl_platform, cl_device, smoothing_size, structure_size, harris_k, threshold_ratio, suppression_size, cl_cache, cl_specialize);
+            harris_opencl->SetProfiling(benchmark_enabled);
+            harris_opencl->SetAutotune(cl_tune);
+            return harris_opencl;
+        } else {
+            return std::make_shared<HarrisCpp>(smoothing_size, structure_size, harris_k, threshold_ratio, suppression_size);
+        }
+    };
+
+    // Creates the harris algorithm selected on the command line
+    std::string backend = schedule_enabled ? "schedule" : use_opencv ? (cv_umat ? "opencv-umat" : "opencv") : use_opencl ? (cl_multi ? "opencl-multi" : "opencl") : "cpp";
+    auto create_harris = [&]() { return create_backend(backend); };
+
+    // Batches and streams don't have a single input resolution to time the backends at
+    if (auto_enabled && (batch_enabled || multi_enabled || stream_enabled)) {
+        std::cerr << "--auto can't be used with --batch, --multi or --stream" << std::endl;
+        return 1;
+    }
+
+    // The scheduler only helps when several frames are in flight, which only the frame loop below does
+    if (schedule_enabled && (batch_enabled || multi_enabled || stream_enabled || realtime_enabled)) {
+        std::cerr << "--schedule can't be used with --batch, --multi, --stream or --realtime" << std::endl;
+        return 1;
+    }
+
+    // The service only hosts the cpp, opencv and opencl detectors
+    if (connect_enabled && (cv_umat || cl_multi)) {
+        std::cerr << "--cv-umat and --cl-multi can't be used with --connect" << std::endl;
+        return 1;
+    }
+
+    // In serve mode the process only hosts detectors for other processes, until it is interrupted
+    if (serve_enabled) {
+        if (connect_enabled) {
+            std::cerr << "--serve can't be used with --connect" << std::endl;
+            return 1;
+        }
+
+        return RunServer(serve_socket, create_backend);
+    }
+
+    // In batch mode --output is the directory the corner files are written to (by default they are written next to each image).
+    // OpenCL devices are shared by every worker since each detector holds a context and compiled program.
+    if (batch_enabled) {
+        return RunBatch(batch_pattern, output_file, create_harris, use_opencl, benchmark_enabled);
+    }
+
+    // In multi-stream mode every video shares one pool of workers
+    if (multi_enabled) {
+        return RunMultiStream(multi_inputs, output_file, create_harris, backend.compare(0, 6, "opencl") == 0, multi_deadline, benchmark_enabled);
+    }
+
+    // In stream mode the input is read as raw frames and only the corners are written out
+    if (stream_enabled) {
+        return RunStream(*create_harris(), input_file, benchmark_enabled);
+    }
+
+    // Map the input if it is a frame archive, otherwise read the input image
+    std::unique_ptr<FrameArchive> input_archive;
+    try {
+        if (FrameArchive::IsArchive(input_file)) input_archive = std::make_unique<FrameArchive>(input_file);
+    } catch (const std::invalid_argument& e) {
+        std::cerr << e.what() << std::endl;
+        return 2;
+    }
+
+    auto is_archive_input = input_archive != nullptr;
+    auto input_image = is_archive_input ? cv::Mat() : cv::imread(input_file, cv::IMREAD_UNCHANGED);
     cv::VideoCapture input_video;
 
     // Check if the input is a single image or video
     auto is_image_input = !input_image.empty();
-    auto is_video_input = !is_image_input && input_video.open(input_file);
+    auto is_video_input = !is_archive_input && !is_image_input && input_video.open(input_file);
 
     // If image can't be loaded, exit now
-    if (!is_image_input && !is_video_input) {
+    if (!is_archive_input && !is_image_input && !is_video_input) {
         std::cerr << "Failed to load input file " << input_file << std::endl;
         return 2;
     }
 
-    // Create the appropriate harris algorithm
-    std::shared_ptr<HarrisBase> harris;
-    if (use_opencv) {
-        harris = std::make_shared<HarrisOpenCV>(smoothing_size, structure_size, harris_k, threshold_ratio, suppression_size);
-    } else if (use_opencl) {
-        harris = std::make_shared<HarrisOpenCL>(cl_platform, cl_device, smoothing_size, structure_size, harris_k, threshold_ratio, suppression_size);
-    } else {
-        harris = std::make_shared<HarrisCpp>(smoothing_size, structure_size, harris_k, threshold_ratio, suppression_size);
+    // Decoders produce YUV, so asking for it directly skips the conversion to BGR as well as the conversion back to luma.
+    // Backends that can't return raw frames ignore the request, and others may return a raw layout other than 4:2:0, so the
+    // first frame is decoded to check it. The video is then reopened to start again from the first frame, with BGR frames
+    // unless the first frame was a 4:2:0 frame of the size of the video.
+    const auto video_width = is_video_input ? static_cast<int>(input_video.get(cv::CAP_PROP_FRAME_WIDTH)) : 0;
+    const auto video_height = is_video_input ? static_cast<int>(input_video.get(cv::CAP_PROP_FRAME_HEIGHT)) : 0;
+    if (is_video_input && luma_enabled) {
+        cv::Mat first_frame;
+        luma_enabled = input_video.set(cv::CAP_PROP_CONVERT_RGB, 0) && input_video.read(first_frame) &&
+            !LumaPlane(first_frame, video_width, video_height).empty();
+        if (!input_video.open(input_file) || (luma_enabled && !input_video.set(cv::CAP_PROP_CONVERT_RGB, 0))) {
+            std::cerr << "Failed to load input file " << input_file << std::endl;
+            return 2;
+        }
+        if (!luma_enabled) std::cerr << "The video decoder can't return raw YUV 4:2:0 frames, so BGR frames will be used" << std::endl;
     }
 
     // Create the output video if requested
@@ -122,8 +826,8 @@ int main(int argc, char* argv[]) {
     bool is_video_output = output_file.rfind(".m4v") == output_file.length() - 4;
     cv::VideoWriter output_video;
     if (is_video_output) {
-        const auto width = is_video_input ? static_cast<int>(input_video.get(cv::CAP_PROP_FRAME_WIDTH)) : input_image.cols;
-        const auto height = is_video_input ? static_cast<int>(input_video.get(cv::CAP_PROP_FRAME_HEIGHT)) : input_image.rows;
+        const auto width = is_video_input ? static_cast<int>(input_video.get(cv::CAP_PROP_FRAME_WIDTH)) : is_archive_input ? input_archive->width() : input_image.cols;
+        const auto height = is_video_input ? static_cast<int>(input_video.get(cv::CAP_PROP_FRAME_HEIGHT)) : is_archive_input ? input_archive->height() : input_image.rows;
         const auto fps = is_video_input ? input_video.get(cv::CAP_PROP_FPS) : 29.97;
         if (!output_video.open(output_file, CV_FOURCC('a', 'v', 'c', '1'), fps, cv::Size(width, height))) { // AVC1 is the fourcc code for h.264
             std::cerr << "Failed to load output file " << output_file << std::endl;
@@ -131,34 +835,107 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    // Create the corner file if requested
+    std::unique_ptr<CornerFileWriter> corner_writer;
+    if (corners_enabled) {
+        try {
+            corner_writer = std::make_unique<CornerFileWriter>(corners_file);
+        } catch (const std::invalid_argument& e) {
+            std::cerr << e.what() << std::endl;
+            return 3;
+        }
+    }
+
     // Placeholders for timing information
     auto total_time_ms = 0.0;
     auto num_frames = 0.0;
+    std::vector<StageTiming> total_stage_timings;
+
+    // In real-time mode frames arrive at the rate of the source and are dropped or downscaled to stay within the budget
+    std::unique_ptr<DeadlineGovernor> governor;
+    if (realtime_enabled && !is_image_input) {
+        const auto source_fps = is_video_input ? input_video.get(cv::CAP_PROP_FPS) : 0.0;
+        try {
+            governor = std::make_unique<DeadlineGovernor>(realtime_budget_ms, 1e3 / (source_fps > 0.0 ? source_fps : 29.97));
+        } catch (const std::invalid_argument& e) {
+            std::cerr << e.what() << std::endl;
+            return 1;
+        }
+    }
+
+    // Decode video frames on a separate thread so decoding overlaps with corner detection. The scheduler keeps two frames
+    // in flight for each of its detectors (OpenCL and C++), and each of them is held in the ring until its corners are back.
+    std::unique_ptr<FramePrefetcher> prefetcher;
+    if (schedule_enabled) prefetch_depth = std::max(prefetch_depth, kScheduledFramesPerDetector * 2);
+    if (is_video_input) prefetcher = std::make_unique<FramePrefetcher>(input_video, prefetch_depth);
+
+    // Moves to the next frame of a video or archive. Archive frames are used in place without being copied or decoded.
+    // If hold_frames is set, earlier video frames stay valid until they are released from the prefetcher.
+    size_t archive_frame = 0;
+    auto hold_frames = false;
+    auto next_frame = [&]() {
+        if (!is_archive_input) {
+            if (!is_video_input || !(hold_frames ? prefetcher->Take(input_image) : prefetcher->Next(input_image))) return false;
+            if (luma_enabled) {
+                // Frames that aren't 4:2:0 after all can't be read as BGR either, so stop rather than detect on garbage
+                input_image = LumaPlane(input_image, video_width, video_height);
+                if (input_image.empty()) std::cerr << "The video decoder stopped returning raw YUV 4:2:0 frames" << std::endl;
+                return !input_image.empty();
+            }
+            return true;
+        }
+
+        if (archive_frame >= input_archive->frame_count()) return false;
+        input_image = ArchiveFrame(*input_archive, archive_frame++);
+        return true;
+    };
 
     // Loop through each image, run Harris corner detection and display the output (if set)
-    auto has_image = is_image_input || input_video.read(input_image);
-    while(has_image) {
-        // Convert image to Argb32 (the only supported format for RunHarris)
-        if (input_image.type() == CV_8UC3) {
-            cv::cvtColor(input_image, input_image, cv::COLOR_BGR2BGRA);
+    auto has_image = is_image_input || next_frame();
+
+    // In auto mode the backends are timed once the size and pixel format of the frames are known, and the detector that was
+    // timed is kept rather than creating (and warming up) another one
+    std::shared_ptr<HarrisBase> harris;
+    if (auto_enabled && has_image) {
+        BackendSelector selector;
+        selector.SetParameters(smoothing_size, structure_size, harris_k, threshold_ratio, suppression_size);
+        selector.SetOpenCLOptions(cl_platform, cl_device, cl_tune, cl_specialize);
+        selector.SetRemote(connect_enabled);
+        selector.Add("cpp", [&]() { return create_backend("cpp"); });
+        selector.Add("opencv", [&]() { return create_backend("opencv"); });
+        selector.Add("opencv-umat", [&]() { return create_backend("opencv-umat"); });
+        selector.Add("opencl", [&]() { return create_backend("opencl"); });
+        selector.Add("opencl-multi", [&]() { return create_backend("opencl-multi"); });
+        try {
+            auto selection = SelectBackend(selector, input_image);
+            backend = selection.name;
+            harris = std::move(selection.harris);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+            return 2;
         }
+    }
 
-        // Run Harris corner detection
-        const Image<Argb32> input(input_image.data, input_image.cols, input_image.rows, input_image.step[0]);
-        Image<float> corners;
-        const auto time_in_ms = MeasureTimeMs([&]() { corners = harris->FindCorners(input); });
+    if (!harris) harris = create_harris();
+
+    // In real-time mode reduced resolution frames have a detector of their own, so switching resolution never makes a
+    // detector reallocate its device memory for the other frame size (which would be timed as part of the frame)
+    const auto downscaled_harris = governor ? create_harris() : nullptr;
 
+    // Records, writes, highlights and shows the corners of a frame
+    auto handle_corners = [&](Image<float> corners, double time_in_ms, cv::Mat& image) {
         // Record the time
         total_time_ms += time_in_ms;
         ++num_frames;
 
         // If we are going to output a
         if (show_enabled || output_enabled) {
-            HighlightCorners(corners, input_image);
+            if (image.channels() == 1) cv::cvtColor(image, image, cv::COLOR_GRAY2BGR);
+            HighlightCorners(corners, image);
         }
 
         if (show_enabled) {
-            cv::imshow("Corners", input_image);
+            cv::imshow("Corners", image);
             cv::waitKey(1);
         }
 
@@ -169,25 +946,108 @@ int main(int argc, char* argv[]) {
 
         if (benchmark_enabled) {
             std::cout << time_in_ms << "ms" << std::endl;
+            for (const auto& timing : harris->StageTimings()) {
+                std::cout << "    " << timing.name << ": " << timing.run_ms << "ms (queued for " << timing.queued_ms << "ms)\n";
+                AddStageTiming(timing, total_stage_timings);
+            }
         }
 
         if (output_enabled && is_video_output) {
-            cv::cvtColor(input_image, input_image, cv::COLOR_BGRA2BGR);
-            output_video.write(input_image);
+            if (image.channels() == 4) cv::cvtColor(image, image, cv::COLOR_BGRA2BGR);
+            output_video.write(image);
         }
 
-        // If this is a video, move to the next frame
-        has_image = is_video_input && input_video.read(input_image);
+        // The corners are extracted from the corner image, encoded and written on a separate thread (frames whose corner list
+        // was found directly have already been queued)
+        if (corner_writer && corners) corner_writer->Append(std::move(corners));
+    };
+
+    // When the corner file is the only output, the detector returns the corner list itself (e.g. compacted on the OpenCL
+    // device) rather than a full resolution corner image for the writer to scan
+    const auto list_only = corner_writer && !show_enabled && !output_enabled;
+
+    // The scheduler keeps two frames in flight per detector. Decoded frames are held in the prefetcher's ring until their
+    // corners are returned, so they aren't copied. The time of each frame is the time since the previous frame's corners were
+    // returned.
+    const auto scheduler = std::dynamic_pointer_cast<HarrisScheduler>(harris);
+    if (scheduler) {
+        const auto max_in_flight = static_cast<size_t>(kScheduledFramesPerDetector) * scheduler->size();
+        if (is_video_input && max_in_flight > prefetcher->depth()) throw std::logic_error("The prefetcher can't hold every frame in flight");
+
+        std::deque<cv::Mat> in_flight;
+        auto last_result = std::chrono::high_resolution_clock::now();
+        hold_frames = true;
+        while (has_image || !in_flight.empty()) {
+            while (has_image && in_flight.size() < max_in_flight) {
+                in_flight.push_back(input_image);
+                SubmitFrame(*scheduler, in_flight.back());
+                has_image = !is_image_input && next_frame();
+            }
+
+            auto corners = scheduler->Next();
+            const auto now = std::chrono::high_resolution_clock::now();
+            const auto time_in_ms = std::chrono::duration<double, std::milli>(now - last_result).count();
+            last_result = now;
+
+            input_image = in_flight.front();
+            in_flight.pop_front();
+            handle_corners(std::move(corners), time_in_ms, input_image);
+            if (is_video_input) prefetcher->Release();
+        }
+
+        for (auto i = 0U; i < scheduler->size(); ++i) {
+            std::cout << "\nDetector " << i << " processed " << scheduler->frame_count(i) << " frames with an average processing time of " << scheduler->average_ms(i) << " ms";
+        }
+    }
+
+    size_t source_frame = 0;
+    while(has_image && !scheduler) {
+        // Decide whether the frame can be processed in time
+        auto action = DeadlineGovernor::Action::kProcess;
+        if (governor) action = governor->Decide(governor->WaitForFrame(source_frame++));
+        if (action == DeadlineGovernor::Action::kDrop) {
+            has_image = next_frame();
+            continue;
+        }
+
+        // Run Harris corner detection on the decoded pixels as they are (BGR for videos, BGR, BGRA or greyscale for images)
+        Image<float> corners;
+        CornerList corner_list;
+        const auto time_in_ms = MeasureTimeMs([&]() {
+            if (action == DeadlineGovernor::Action::kDownscale) corners = FindCornersDownscaled(*downscaled_harris, input_image, governor->downscale());
+            else if (list_only) corner_list = FindCornerList(*harris, input_image);
+            else corners = FindCorners(*harris, input_image);
+        });
+        if (governor) governor->Record(action, time_in_ms);
+        if (list_only && !corners) corner_writer->Append(std::move(corner_list));
+        handle_corners(std::move(corners), time_in_ms, input_image);
+
+        // If this is a video or archive, move to the next frame
+        has_image = !is_image_input && next_frame();
     }
 
-    // If this is not a video, just output the last frame
-    if (output_enabled && !is_video_output) {
-        cv::cvtColor(input_image, input_image, cv::COLOR_BGRA2BGR);
+    // If this is not a video, just output the last frame (an archive may not have any frames)
+    if (output_enabled && !is_video_output && !input_image.empty()) {
+        if (input_image.channels() == 4) cv::cvtColor(input_image, input_image, cv::COLOR_BGRA2BGR);
         cv::imwrite(output_file, input_image);
     }
 
+    if (corner_writer && !corner_writer->Close()) {
+        std::cerr << "Failed to write corner file " << corners_file << std::endl;
+        return 3;
+    }
+
     // Print the statistics for the 
-    std::cout << "\n" << num_frames << " frames were processed in " << total_time_ms / 1e3 << " seconds with an average processing time of " << total_time_ms / num_frames << " ms\n";
+    std::cout << "\n" << num_frames << " frames were processed in " << total_time_ms / 1e3 << " seconds";
+    if (num_frames > 0) std::cout << " with an average processing time of " << total_time_ms / num_frames << " ms";
+    if (governor) std::cout << " (" << governor->fps() << " fps in real time, " << governor->dropped() << " frames dropped, " << governor->downscaled() << " at reduced resolution)";
+    std::cout << "\n";
+    if (num_frames > 0 && !total_stage_timings.empty()) {
+        std::cout << "Average time per stage:\n";
+        for (const auto& timing : total_stage_timings) {
+            std::cout << "    " << timing.name << ": " << timing.run_ms / num_frames << "ms (queued for " << timing.queued_ms / num_frames << "ms)\n";
+        }
+    }
 
     // If show is enabled, pause on the last image.
     if (show_enabled) {
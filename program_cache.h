@@ -0,0 +1,104 @@
+#pragma once
+// On-disk cache of compiled OpenCL program binaries
+
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+
+#include "cl.hpp"
+#include "cache_directory.h"
+
+namespace harris {
+
+// Computes the 64 bit FNV-1a hash of a string, continuing from a previous hash value
+uint64_t Fnv1a64(const std::string& value, uint64_t hash = 14695981039346656037ULL) {
+    for (const auto c : value) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+// Stores program binaries (CL_PROGRAM_BINARIES) on disk so later processes can skip compiling the program source.
+// Binaries are keyed by device, driver version, source and build options so any change to those causes a rebuild.
+class ProgramCache {
+public:
+
+    // Creates a cache that stores binaries in the given directory. An empty directory disables the cache.
+    explicit ProgramCache(std::string directory = DefaultCacheDirectory("opencl")) :
+        directory_(std::move(directory)) {
+    }
+
+    bool enabled() const { return !directory_.empty(); }
+    const std::string& directory() const { return directory_; }
+
+    // Loads and builds a cached program binary for the given device, source and build options.
+    // Returns an empty program (i.e. program() == nullptr) if there is no usable binary in the cache.
+    cl::Program Load(const cl::Context& context, const cl::Device& device, const std::string& source, const std::string& options) {
+        if (!enabled()) return cl::Program();
+
+        std::ifstream in(BinaryPath(device, source, options), std::ios::binary);
+        if (!in) return cl::Program();
+        const std::vector<char> binary((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        if (binary.empty()) return cl::Program();
+
+        const std::vector<cl::Device> devices({ device });
+        try
+        {
+            // Binaries still need to be built, but this only links the already compiled code.
+            cl::Program program(context, devices, cl::Program::Binaries({ { binary.data(), binary.size() } }));
+            program.build(devices, options.c_str());
+            return program;
+        }
+        catch(const cl::Error& e)
+        {
+            // A stale or corrupted binary is not fatal. The caller will rebuild it from source.
+            std::cerr << "Ignoring cached program binary: " << e.what() << ": " << e.err() << '\n';
+            return cl::Program();
+        }
+    }
+
+    // Stores the binary of a built program so that it can be loaded for the same device, source and build options.
+    void Store(const cl::Program& program, const cl::Device& device, const std::string& source, const std::string& options) {
+        if (!enabled()) return;
+        if (!CreateDirectories(directory_)) return;
+
+        const auto sizes = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
+        auto binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+
+        if (!sizes.empty() && sizes[0] > 0 && binaries[0] != nullptr) {
+            WriteFileAtomically(BinaryPath(device, source, options), [&](std::ostream& out) { out.write(binaries[0], sizes[0]); });
+        }
+
+        // cl.hpp allocates the binaries with new[] and leaves it to the caller to release them
+        for (auto binary : binaries) {
+            delete[] binary;
+        }
+    }
+
+private:
+    std::string directory_;
+
+    // Returns the file name used for a given device, source and build options
+    std::string BinaryPath(const cl::Device& device, const std::string& source, const std::string& options) const {
+        auto hash = Fnv1a64(device.getInfo<CL_DEVICE_NAME>());
+        hash = Fnv1a64(device.getInfo<CL_DEVICE_VENDOR>(), hash);
+        hash = Fnv1a64(device.getInfo<CL_DEVICE_VERSION>(), hash);
+        hash = Fnv1a64(device.getInfo<CL_DRIVER_VERSION>(), hash);
+        hash = Fnv1a64(source, hash);
+        hash = Fnv1a64(options, hash);
+
+        std::stringstream path_stream;
+        path_stream << directory_ << "/" << std::hex << std::setw(16) << std::setfill('0') << hash << ".bin";
+        return path_stream.str();
+    }
+};
+}
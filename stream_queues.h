@@ -0,0 +1,146 @@
+#pragma once
+// Per-stream frame queues shared fairly by one pool of workers
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace harris {
+
+// A bounded queue of frames for each of several streams, from which a shared pool of workers takes the next frame.
+// At most one frame of each stream is processed at a time, so a stream's results come out in order and a stream with a
+// backlog can't hold every worker while others wait. Among the streams that have a frame waiting and none in progress:
+//   - kRoundRobin takes from the next stream after the one last served, so every stream gets the same share of the workers.
+//   - kDeadline takes the frame with the earliest deadline, so streams with a higher frame rate (and so tighter deadlines)
+//     are served more often.
+// A stream whose queue is full waits in Push, so a slow pool slows the readers down rather than dropping frames.
+template <class T>
+class StreamQueues {
+public:
+
+    using Clock = std::chrono::steady_clock;
+
+    enum class Policy {
+        kRoundRobin,
+        kDeadline,
+    };
+
+    // A frame taken from a queue
+    struct Entry {
+        size_t stream;
+        T item;
+        Clock::time_point decoded;   // When the frame was decoded (any time spent waiting in Push for space counts)
+        Clock::time_point deadline;  // When its result is due
+    };
+
+    StreamQueues(size_t streams, size_t depth, Policy policy = Policy::kRoundRobin) :
+        streams_(streams),
+        depth_(depth),
+        policy_(policy),
+        next_(0),
+        closed_(false) {
+        if (streams == 0) throw std::invalid_argument("The streams parameter must be larger than zero");
+        if (depth == 0) throw std::invalid_argument("The depth parameter must be larger than zero");
+    }
+
+    size_t size() const { return streams_.size(); }
+
+    // Queues a frame of a stream that was decoded at the given time, waiting while the stream's queue is full.
+    // Returns false if the queues have been closed.
+    bool Push(size_t stream, T item, Clock::time_point decoded, Clock::time_point deadline) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto& queue = streams_.at(stream);
+        changed_.wait(lock, [&]() { return closed_ || queue.entries.size() < depth_; });
+        if (closed_) return false;
+
+        queue.entries.push_back(Entry{ stream, std::move(item), decoded, deadline });
+        changed_.notify_all();
+        return true;
+    }
+
+    // Marks that a stream has no more frames
+    void Finish(size_t stream) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        streams_.at(stream).finished = true;
+        changed_.notify_all();
+    }
+
+    // Takes the next frame, waiting until one can be taken. Done must be called once the frame has been processed.
+    // Returns false once every stream has finished and its queue is empty.
+    bool Pop(Entry& entry) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            const auto stream = NextStream();
+            if (stream < streams_.size()) {
+                auto& queue = streams_[stream];
+                entry = std::move(queue.entries.front());
+                queue.entries.pop_front();
+                queue.busy = true;
+                next_ = (stream + 1) % streams_.size();
+                changed_.notify_all();
+                return true;
+            }
+
+            if (closed_ || AllDone()) return false;
+            changed_.wait(lock);
+        }
+    }
+
+    // Lets the next frame of a stream be taken
+    void Done(size_t stream) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        streams_.at(stream).busy = false;
+        changed_.notify_all();
+    }
+
+    // Wakes every waiting reader and worker. Frames still queued are never taken.
+    void Close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        changed_.notify_all();
+    }
+
+private:
+    struct Stream {
+        std::deque<Entry> entries;
+        bool busy = false;
+        bool finished = false;
+    };
+
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::vector<Stream> streams_;
+    size_t depth_;
+    Policy policy_;
+    size_t next_;
+    bool closed_;
+
+    // Returns the stream to take a frame from, or size() if no stream has a frame that can be taken
+    size_t NextStream() const {
+        if (closed_) return streams_.size();
+
+        auto best = streams_.size();
+        for (auto i = 0U; i < streams_.size(); ++i) {
+            const auto stream = (next_ + i) % streams_.size();
+            const auto& queue = streams_[stream];
+            if (queue.busy || queue.entries.empty()) continue;
+            if (policy_ == Policy::kRoundRobin) return stream;
+            if (best == streams_.size() || queue.entries.front().deadline < streams_[best].entries.front().deadline) best = stream;
+        }
+
+        return best;
+    }
+
+    bool AllDone() const {
+        for (const auto& stream : streams_) {
+            if (!stream.finished || !stream.entries.empty()) return false;
+        }
+
+        return true;
+    }
+};
+}
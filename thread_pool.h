@@ -0,0 +1,92 @@
+#pragma once
+// A fixed-size pool of worker threads
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace harris {
+
+// Runs submitted tasks on a fixed number of threads, in the order they were submitted.
+// Each worker runs thread_init (if given) once before taking any task, e.g. to limit the OpenMP threads it uses.
+class ThreadPool {
+public:
+
+    explicit ThreadPool(size_t threads, std::function<void()> thread_init = std::function<void()>()) :
+        stopped_(false) {
+        if (threads == 0) throw std::invalid_argument("The threads parameter must be larger than zero");
+
+        for (auto i = 0U; i < threads; ++i) {
+            workers_.emplace_back([this, thread_init]() {
+                if (thread_init) thread_init();
+                RunTasks();
+            });
+        }
+    }
+
+    // Rule of five: Neither movable nor copyable
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool(ThreadPool&&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ThreadPool& operator=(ThreadPool&&) = delete;
+
+    // Finishes every submitted task before returning
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopped_ = true;
+        }
+
+        queued_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    size_t size() const { return workers_.size(); }
+
+    // Queues a task. The future returns its result, or rethrows anything it threw.
+    template <class F>
+    std::future<typename std::result_of<F()>::type> Submit(F task) {
+        using Result = typename std::result_of<F()>::type;
+        const auto packaged_task = std::make_shared<std::packaged_task<Result()>>(std::move(task));
+        auto result = packaged_task->get_future();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            tasks_.emplace_back([packaged_task]() { (*packaged_task)(); });
+        }
+
+        queued_.notify_one();
+        return result;
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable queued_;
+    std::deque<std::function<void()>> tasks_;
+    bool stopped_;
+    std::vector<std::thread> workers_;
+
+    void RunTasks() {
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                queued_.wait(lock, [this]() { return stopped_ || !tasks_.empty(); });
+                if (tasks_.empty()) return;
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+
+            task();
+        }
+    }
+};
+}
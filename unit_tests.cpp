@@ -1,11 +1,35 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <thread>
+
 #include "gtest/gtest.h"
 
 #include "opencv2/opencv.hpp"
 
 #include "harris_cpp.h"
 #include "harris_opencl.h"
+#include "harris_opencl_multi.h"
 #include "harris_opencv.h"
+#include "harris_remote.h"
+#include "harris_scheduler.h"
+#include "backend_selector.h"
+#include "corner_file.h"
+#include "deadline_governor.h"
+#include "detection_service.h"
+#include "frame_archive.h"
+#include "frame_prefetcher.h"
+#include "frame_stream.h"
+#include "luma_plane.h"
+#include "stream_queues.h"
 #include "image.h"
+#include "thread_pool.h"
 
 using namespace harris;
 
@@ -31,6 +55,25 @@ void CheckCorners(const Image<float>& output) {
     }
 }
 
+// Checks that two implementations found the same corners. With a tolerance the corners must be in the same place, but their
+// responses only have to be within that fraction of each other (for implementations that round differently).
+void AssertSameCorners(const Image<float>& expected, const Image<float>& output, float tolerance = 0.0f) {
+    ASSERT_EQ(output.width(), expected.width());
+    ASSERT_EQ(output.height(), expected.height());
+    for (auto y = 0; y < expected.height(); ++y) {
+        for (auto x = 0; x < expected.width(); ++x) {
+            const auto expected_pixel = expected.RowPtr(y)[x];
+            const auto output_pixel = output.RowPtr(y)[x];
+            if (tolerance == 0.0f) {
+                ASSERT_FLOAT_EQ(output_pixel, expected_pixel) << "At point (" << x << "," << y << ")";
+            } else {
+                ASSERT_EQ(output_pixel > 0.0f, expected_pixel > 0.0f) << "At point (" << x << "," << y << ")";
+                ASSERT_NEAR(output_pixel, expected_pixel, tolerance * std::abs(expected_pixel)) << "At point (" << x << "," << y << ")";
+            }
+        }
+    }
+}
+
 // Tests pure C++ implementation
 TEST(AlgorithmTest, Cpp) {
     HarrisCpp harris;
@@ -47,6 +90,239 @@ TEST(AlgorithmTest, OpenCL) {
     CheckCorners(output);
 }
 
+// Tests the OpenCL implementation using the float buffer kernels (the default on CPU devices)
+TEST(AlgorithmTest, OpenCLBuffers) {
+    HarrisOpenCL harris;
+    harris.SetBufferKernels(true);
+    auto input = LoadImage("lines.png");
+    auto output = harris.FindCorners(input);
+    CheckCorners(output);
+}
+
+// Tests that frames smaller than the algorithm's windows are rejected by both kernel families, as they are by HarrisCpp
+TEST(AlgorithmTest, OpenCLSmallFrames) {
+    HarrisOpenCL harris;
+    for (const auto buffers : { false, true }) {
+        harris.SetBufferKernels(buffers);
+        ASSERT_THROW(harris.FindCorners(Image<Argb32>(4, 64)), std::invalid_argument);
+        ASSERT_THROW(harris.FindCornerList(Image<uint8_t>(64, 4)), std::invalid_argument);
+        ASSERT_NO_THROW(harris.FindCorners(Image<Argb32>(5, 5)));
+    }
+
+    ASSERT_NO_THROW(HarrisCpp().FindCorners(Image<Argb32>(5, 5)));
+}
+
+// Tests that profiling times every kernel, upload and readback of a frame, and that nothing is timed without it
+TEST(AlgorithmTest, OpenCLProfiling) {
+    const auto input = LoadImage("lines.png");
+    for (const auto buffers : { false, true }) {
+        HarrisOpenCL harris;
+        harris.SetBufferKernels(buffers);
+        harris.SetZeroCopy(false);
+        harris.FindCorners(input);
+        ASSERT_TRUE(harris.StageTimings().empty());
+
+        harris.SetProfiling(true);
+        harris.FindCorners(input);
+        const auto timings = harris.StageTimings();
+        const auto suffix = std::string(buffers ? "Buffer" : "");
+        for (const auto& name : { "Upload", "Readback", "Max" }) {
+            ASSERT_TRUE(std::any_of(timings.begin(), timings.end(), [&](const StageTiming& timing) { return timing.name == name; })) << name;
+        }
+
+        for (const auto& kernel : { "SmoothingPacked", "DiffX", "DiffY", "Structure", "Response", "RowMax", "NonMaxSuppression" }) {
+            const auto name = kernel + suffix;
+            ASSERT_TRUE(std::any_of(timings.begin(), timings.end(), [&](const StageTiming& timing) { return timing.name == name; })) << name;
+        }
+
+        for (const auto& timing : timings) {
+            ASSERT_GE(timing.run_ms, 0.0) << timing.name;
+            ASSERT_GE(timing.queued_ms, 0.0) << timing.name;
+        }
+
+        harris.SetProfiling(false);
+        harris.FindCorners(input);
+        ASSERT_TRUE(harris.StageTimings().empty());
+    }
+}
+
+// Tests that using host memory in place gives the same corners as copying it, with both kernel families
+TEST(AlgorithmTest, OpenCLZeroCopy) {
+    const auto input = LoadImage("lines.png");
+
+    // A view whose rows are padded, so every row but the first starts part way into a page
+    const auto padded_width = input.width() + 3;
+    Image<Argb32> padded(padded_width, input.height());
+    for (auto y = 0; y < input.height(); ++y) {
+        std::memcpy(padded.RowPtr(y), input.RowPtr(y), input.width() * sizeof(Argb32));
+    }
+
+    const Image<Argb32> view(std::shared_ptr<uint8_t>(std::shared_ptr<uint8_t>(), padded.data()), input.width(), input.height(), padded.stride());
+    ASSERT_NE(view.stride() % 4096, 0U);
+    ASSERT_TRUE(view.is_view());
+    ASSERT_FALSE(input.is_view());
+
+    for (const auto buffers : { false, true }) {
+        HarrisOpenCL harris;
+        harris.SetBufferKernels(buffers);
+        harris.SetZeroCopy(false);
+        const auto expected = harris.FindCorners(input);
+        harris.SetZeroCopy(true);
+        for (const auto& image : { input, view }) {
+            const auto output = harris.FindCorners(image);
+            CheckCorners(output);
+            AssertSameCorners(expected, output);
+        }
+    }
+}
+
+// Tests that the 8 pixel wide buffer kernels give the same corners as the 4 pixel wide ones
+TEST(AlgorithmTest, OpenCLVectorWidth) {
+    HarrisOpenCL harris;
+    harris.SetBufferKernels(true);
+    auto input = LoadImage("lines.png");
+    harris.SetVectorWidth(4);
+    auto expected = harris.FindCorners(input);
+    harris.SetVectorWidth(8);
+    auto output = harris.FindCorners(input);
+    CheckCorners(output);
+    AssertSameCorners(expected, output);
+}
+
+// Tests that processing a frame in tiles gives the same corners as processing it at once
+TEST(AlgorithmTest, OpenCLTiled) {
+    HarrisOpenCL harris;
+    auto input = LoadImage("lines.png");
+    auto expected = harris.FindCorners(input);
+
+    // 13 rows leaves a shorter last tile
+    for (const auto tile_rows : { 16, 13 }) {
+        SCOPED_TRACE("With " + std::to_string(tile_rows) + " rows per tile");
+        harris.SetMaxTileRows(tile_rows);
+        auto output = harris.FindCorners(input);
+        CheckCorners(output);
+        AssertSameCorners(expected, output);
+    }
+}
+
+// Tests that the OpenCL implementation reads 24 bit BGR and greyscale pixels directly
+TEST(AlgorithmTest, OpenCLPixelFormats) {
+    HarrisOpenCL harris;
+    cv::Mat bgr = cv::imread("lines.png", cv::IMREAD_COLOR);
+    cv::Mat bgra;
+    cv::cvtColor(bgr, bgra, cv::COLOR_BGR2BGRA);
+    cv::Mat grey = cv::imread("lines.png", cv::IMREAD_GRAYSCALE);
+
+    auto expected = harris.FindCorners(Image<Argb32>(bgra.data, bgra.cols, bgra.rows, bgra.step[0]));
+    auto output = harris.FindCorners(Image<Bgr24>(bgr.data, bgr.cols, bgr.rows, bgr.step[0]));
+    CheckCorners(output);
+    AssertSameCorners(expected, output);
+
+    CheckCorners(harris.FindCorners(Image<uint8_t>(grey.data, grey.cols, grey.rows, grey.step[0])));
+}
+
+// Tests that the OpenCL implementation weights the colour channels of Argb32 pixels the same way as the C++ implementation
+TEST(AlgorithmTest, OpenCLColour) {
+    HarrisCpp harris_cpp;
+    HarrisOpenCL harris_opencl;
+
+    // Red, green and blue all differ, so the response changes if any two channels are weighted the wrong way round
+    cv::Mat grey = cv::imread("lines.png", cv::IMREAD_GRAYSCALE);
+    Image<Argb32> input(grey.cols, grey.rows);
+    for (auto y = 0; y < input.height(); ++y) {
+        for (auto x = 0; x < input.width(); ++x) {
+            const auto value = static_cast<int>(grey.at<uint8_t>(y, x));
+            input.RowPtr(y)[x] = Argb32(255, value, value / 4, value / 2);
+        }
+    }
+
+    auto expected = harris_cpp.FindCorners(input);
+    auto output = harris_opencl.FindCorners(input);
+    CheckCorners(output);
+    AssertSameCorners(expected, output, 1e-3f);
+}
+
+// Tests that the compacted OpenCL corner list matches the corner image
+TEST(AlgorithmTest, OpenCLCornerList) {
+    HarrisOpenCL harris;
+    auto input = LoadImage("lines.png");
+    auto expected = ToCornerList(harris.FindCorners(input));
+    auto output = harris.FindCornerList(input);
+    std::sort(output.begin(), output.end(), [](const Corner& a, const Corner& b) { return a.y != b.y ? a.y < b.y : a.x < b.x; });
+    ASSERT_EQ(output.size(), expected.size());
+    for (auto i = 0; i < output.size(); ++i) {
+        ASSERT_EQ(output[i].x, expected[i].x);
+        ASSERT_EQ(output[i].y, expected[i].y);
+        ASSERT_FLOAT_EQ(output[i].response, expected[i].response);
+    }
+}
+
+// Tests that tuned local work sizes give the same corners as the driver's choice
+TEST(AlgorithmTest, OpenCLTuned) {
+    HarrisOpenCL harris(0, -1, 5, 5, 0.04, 0.5, 9, "");
+    auto input = LoadImage("lines.png");
+    auto expected = harris.FindCorners(input);
+    harris.Tune(input);
+    auto output = harris.FindCorners(input);
+    CheckCorners(output);
+    AssertSameCorners(expected, output);
+
+    // Tiled frames are tuned at the size of their tiles
+    HarrisOpenCL tiled(0, -1, 5, 5, 0.04, 0.5, 9, "");
+    tiled.SetMaxTileRows(16);
+    tiled.SetAutotune(true);
+    output = tiled.FindCorners(input);
+    ASSERT_FALSE(tiled.local_sizes().empty());
+    AssertSameCorners(expected, output);
+}
+
+// Tests that splitting a frame into bands (here all on the same device) gives the same corners as the whole frame
+TEST(AlgorithmTest, OpenCLMultiDevice) {
+    HarrisOpenCL single;
+    HarrisOpenCLMulti harris({ { 0, -1 }, { 0, -1 }, { 0, -1 } });
+    auto input = LoadImage("lines.png");
+    auto expected = single.FindCorners(input);
+    auto output = harris.FindCorners(input);
+    CheckCorners(output);
+    AssertSameCorners(expected, output);
+}
+
+// Tests that bands follow the rate of each device, but that a device that looks very slow still gets a band to be timed on
+TEST(AlgorithmTest, OpenCLMultiDeviceSplit) {
+    const auto bands = HarrisOpenCLMulti::SplitRows(480, { 3.0, 1e-9, 1.0 }, 6);
+    ASSERT_EQ(bands.size(), 3U);
+    ASSERT_EQ(bands.front().first, 0);
+    ASSERT_EQ(bands.back().second, 480);
+    for (auto i = 1U; i < bands.size(); ++i) {
+        ASSERT_EQ(bands[i].first, bands[i - 1].second);
+    }
+
+    // The slow device keeps the minimum band (give or take rounding)
+    ASSERT_GE(bands[1].second - bands[1].first, 6);
+    ASSERT_LE(bands[1].second - bands[1].first, 7);
+
+    // The rows beyond the minimum go to the other devices by rate
+    ASSERT_NEAR(bands[0].second - bands[0].first - 6, 3 * (bands[2].second - bands[2].first - 6), 3);
+
+    // Frames too short for every minimum are split evenly
+    for (const auto& band : HarrisOpenCLMulti::SplitRows(8, { 3.0, 1e-9, 1.0, 1.0 }, 6)) {
+        ASSERT_EQ(band.second - band.first, 2);
+    }
+}
+
+// Tests that the C++ and OpenCV implementations read BGR and greyscale images directly
+TEST(AlgorithmTest, PixelFormats) {
+    HarrisCpp harris_cpp;
+    HarrisOpenCV harris_opencv;
+    cv::Mat bgr = cv::imread("lines.png", cv::IMREAD_COLOR);
+    cv::Mat grey = cv::imread("lines.png", cv::IMREAD_GRAYSCALE);
+
+    for (HarrisBase* harris : { static_cast<HarrisBase*>(&harris_cpp), static_cast<HarrisBase*>(&harris_opencv) }) {
+        CheckCorners(harris->FindCorners(Image<Bgr24>(bgr.data, bgr.cols, bgr.rows, bgr.step[0])));
+        CheckCorners(harris->FindCorners(Image<uint8_t>(grey.data, grey.cols, grey.rows, grey.step[0])));
+    }
+}
+
 // Tests pure C++ implementation
 TEST(AlgorithmTest, OpenCV) {
     HarrisOpenCV harris;
@@ -54,3 +330,739 @@ TEST(AlgorithmTest, OpenCV) {
     auto output = harris.FindCorners(input);
     CheckCorners(output);
 }
+
+// Non-maximal suppression as a direct scan of each window, as HarrisOpenCV did before it used a max filter
+cv::Mat ScanNonMaxSuppression(const cv::Mat& src, int block_size, double threshold) {
+    cv::Mat dest(src.rows, src.cols, CV_32F);
+    const auto half_block = block_size / 2;
+    for (auto row = 0; row < src.rows; ++row) {
+        auto src_row = src.ptr<float>(row);
+        auto dest_row = dest.ptr<float>(row);
+        for (auto col = 0; col < src.cols; ++col) {
+            const auto src_pixel = src_row[col];
+            if (src_pixel < threshold) {
+                dest_row[col] = 0.0f;
+                continue;
+            }
+
+            auto dest_pixel = src_pixel;
+            for (auto w_row = row - half_block; dest_pixel > 0.0 && w_row <= row + half_block; ++w_row) {
+                if (w_row < 0) continue;
+                if (w_row >= src.rows) continue;
+                auto window_row = src.ptr<float>(w_row);
+                for (auto w_col = col - half_block; w_col <= col + half_block; ++w_col) {
+                    if (w_col < 0) continue;
+                    if (w_col >= src.cols) continue;
+                    const auto window_pixel = window_row[w_col];
+                    if (window_pixel > dest_pixel) {
+                        dest_pixel = 0.0f;
+                        break;
+                    }
+                }
+            }
+            dest_row[col] = dest_pixel;
+        }
+    }
+
+    return dest;
+}
+
+void CheckSameSuppression(const cv::Mat& response, int block_size, double threshold) {
+    const auto expected = ScanNonMaxSuppression(response, block_size, threshold);
+    cv::Mat output;
+    HarrisOpenCV::NonMaxSuppression(response, output, block_size, threshold);
+    ASSERT_EQ(output.size(), expected.size());
+    ASSERT_EQ(output.type(), CV_32F);
+    for (auto row = 0; row < expected.rows; ++row) {
+        ASSERT_EQ(std::memcmp(output.ptr<float>(row), expected.ptr<float>(row), sizeof(float) * expected.cols), 0) << "Row " << row << " with threshold " << threshold;
+    }
+}
+
+// Tests that the max filter suppression of the OpenCV implementation gives exactly the corners of a scan of each window
+TEST(AlgorithmTest, OpenCVSuppression) {
+    // The Harris response of lines.png, computed as HarrisOpenCV does
+    const auto lines = cv::imread("lines.png", cv::IMREAD_UNCHANGED);
+    cv::Mat grey;
+    cv::Mat response;
+    cv::cvtColor(lines, grey, cv::COLOR_BGRA2GRAY);
+    grey.convertTo(grey, CV_32F, 1.0 / 255.0);
+    cv::cornerHarris(grey, response, 5, 5, 0.04);
+    double min, max;
+    cv::minMaxLoc(response, &min, &max);
+    CheckSameSuppression(response, 9, min + 0.5 * (max - min));
+
+    // Plateaus and ties, including at the edges, values exactly at the threshold and responses that aren't positive
+    cv::Mat plateaus(48, 64, CV_32F, cv::Scalar::all(0.0));
+    plateaus(cv::Rect(4, 4, 6, 6)).setTo(1.0);
+    plateaus(cv::Rect(20, 4, 3, 3)).setTo(0.5);
+    plateaus.at<float>(6, 25) = 0.5f;
+    plateaus.at<float>(0, 63) = 1.0f;
+    plateaus.at<float>(1, 62) = 1.0f;
+    plateaus.at<float>(47, 0) = 0.75f;
+    plateaus(cv::Rect(0, 30, 64, 10)).setTo(-0.25);
+    plateaus.at<float>(35, 30) = -0.125f;
+    for (auto col = 30; col < 60; ++col) {
+        plateaus.at<float>(20, col) = static_cast<float>(col % 7) * 0.125f;
+    }
+
+    for (const auto threshold : { 0.5, 0.1, 0.0, -1.0 }) {
+        CheckSameSuppression(plateaus, 9, threshold);
+        CheckSameSuppression(plateaus, 3, threshold);
+    }
+}
+
+// Tests that the OpenCV implementation gives the same corners when run on cv::UMat
+TEST(AlgorithmTest, OpenCVUMat) {
+    HarrisOpenCV reference;
+    HarrisOpenCV harris(5, 5, 0.04, 0.5, 9, true);
+    auto input = LoadImage("lines.png");
+    auto expected = reference.FindCorners(input);
+    auto output = harris.FindCorners(input);
+    CheckCorners(output);
+
+    // The result views the mapped cv::UMat rather than copying it
+    ASSERT_TRUE(output.is_view());
+
+    // OpenCV may run cv::UMat steps as OpenCL kernels that round differently, so the responses of the corners (which are
+    // all in the same place) only have to be close
+    AssertSameCorners(expected, output, 1e-4f);
+}
+
+// Tests that prefetched video frames match the frames read directly from the video
+TEST(FramePrefetcherTest, Video) {
+    cv::VideoCapture expected_video("aruco.m4v");
+    cv::VideoCapture video("aruco.m4v");
+    ASSERT_TRUE(expected_video.isOpened());
+    FramePrefetcher prefetcher(video, 2);
+
+    cv::Mat expected;
+    cv::Mat frame;
+    auto num_frames = 0;
+    while (expected_video.read(expected)) {
+        ASSERT_TRUE(prefetcher.Next(frame)) << "Missing frame " << num_frames;
+        ASSERT_EQ(cv::norm(frame, expected, cv::NORM_INF), 0.0) << "Frame " << num_frames << " differs";
+        ++num_frames;
+    }
+
+    ASSERT_GT(num_frames, 0);
+    ASSERT_FALSE(prefetcher.Next(frame));
+}
+
+// Tests that frames held with Take stay valid while later frames are decoded, until they are released
+TEST(FramePrefetcherTest, Take) {
+    cv::VideoCapture expected_video("aruco.m4v");
+    cv::VideoCapture video("aruco.m4v");
+    ASSERT_TRUE(expected_video.isOpened());
+    FramePrefetcher prefetcher(video, 2);
+
+    std::deque<cv::Mat> expected;
+    std::deque<cv::Mat> held;
+    cv::Mat frame;
+    for (auto i = 0; i < 10; ++i) {
+        while (held.size() < prefetcher.depth() + 1) {
+            ASSERT_TRUE(expected_video.read(frame));
+            expected.push_back(frame.clone());
+            ASSERT_TRUE(prefetcher.Take(frame));
+            held.push_back(frame);
+        }
+
+        ASSERT_THROW(prefetcher.Take(frame), std::logic_error);
+        ASSERT_EQ(cv::norm(held.front(), expected.front(), cv::NORM_INF), 0.0) << "Frame " << i << " differs";
+        held.pop_front();
+        expected.pop_front();
+        prefetcher.Release();
+    }
+}
+
+// Tests that the Y plane of I420 and NV12 frames is read in place and that any other frame is rejected
+TEST(LumaPlaneTest, Yuv420) {
+    const auto width = 6;
+    const auto height = 4;
+
+    // Both layouts have the Y plane in the first rows, followed by either planar (I420) or interleaved (NV12) chroma
+    cv::Mat i420(height * 3 / 2, width, CV_8UC1, cv::Scalar(200));
+    cv::Mat nv12(height * 3 / 2, width, CV_8UC1, cv::Scalar(200));
+    for (auto y = 0; y < height; ++y) {
+        for (auto x = 0; x < width; ++x) {
+            i420.at<uint8_t>(y, x) = static_cast<uint8_t>(y * width + x);
+            nv12.at<uint8_t>(y, x) = static_cast<uint8_t>(y * width + x);
+        }
+    }
+    for (auto i = 0; i < width * height / 2; ++i) {
+        i420.at<uint8_t>(height + i / width, i % width) = static_cast<uint8_t>(i < width * height / 4 ? 100 : 150);
+        nv12.at<uint8_t>(height + i / width, i % width) = static_cast<uint8_t>(i % 2 == 0 ? 100 : 150);
+    }
+
+    for (const auto& frame : {i420, nv12}) {
+        const auto luma = LumaPlane(frame, width, height);
+        ASSERT_EQ(luma.type(), CV_8UC1);
+        ASSERT_EQ(luma.cols, width);
+        ASSERT_EQ(luma.rows, height);
+        ASSERT_EQ(luma.data, frame.data);
+        for (auto y = 0; y < height; ++y) {
+            for (auto x = 0; x < width; ++x) {
+                ASSERT_EQ(luma.at<uint8_t>(y, x), y * width + x) << "At point (" << x << "," << y << ")";
+            }
+        }
+    }
+
+    // A BGR frame, a greyscale frame without chroma rows and a frame of another width are not 4:2:0 frames of the video
+    ASSERT_TRUE(LumaPlane(cv::Mat(height, width, CV_8UC3, cv::Scalar::all(0)), width, height).empty());
+    ASSERT_TRUE(LumaPlane(cv::Mat(height, width, CV_8UC1, cv::Scalar(0)), width, height).empty());
+    ASSERT_TRUE(LumaPlane(cv::Mat(height * 3 / 2, width * 2, CV_8UC1, cv::Scalar(0)), width, height).empty());
+    ASSERT_TRUE(LumaPlane(cv::Mat(height * 2, width, CV_8UC1, cv::Scalar(0)), width, height).empty());
+}
+
+// Tests that the Y plane of each Y4M frame is read and the chroma planes are skipped
+TEST(FrameStreamTest, Y4m) {
+    const auto file = std::tmpfile();
+    ASSERT_NE(file, nullptr);
+    std::fputs("YUV4MPEG2 W3 H2 F30:1 Ip A1:1 C420jpeg\n", file);
+    for (auto frame = 0; frame < 2; ++frame) {
+        std::fputs("FRAME\n", file);
+        for (auto i = 0; i < 6; ++i) std::fputc(frame * 10 + i, file);
+        for (auto i = 0; i < 4; ++i) std::fputc(255, file);
+    }
+    std::rewind(file);
+
+    FrameStreamReader reader(file);
+    ASSERT_EQ(reader.width(), 3);
+    ASSERT_EQ(reader.height(), 2);
+    ASSERT_EQ(reader.format(), StreamPixelFormat::kGrey);
+
+    Image<uint8_t> image;
+    for (auto frame = 0; frame < 2; ++frame) {
+        ASSERT_TRUE(reader.Read(image));
+        for (auto y = 0; y < 2; ++y) {
+            for (auto x = 0; x < 3; ++x) {
+                ASSERT_EQ(image.RowPtr(y)[x], frame * 10 + y * 3 + x);
+            }
+        }
+    }
+
+    ASSERT_FALSE(reader.Read(image));
+    std::fclose(file);
+}
+
+// Tests that frames written to an archive are mapped back unchanged and page aligned
+TEST(FrameArchiveTest, RoundTrip) {
+    const auto input = LoadImage("lines.png");
+    const std::string path = "frame_archive_test.hfa";
+    {
+        FrameArchiveWriter writer(path, input.width(), input.height(), StreamPixelFormat::kBgra);
+        writer.Append(input);
+        writer.Append(input);
+        ASSERT_TRUE(writer.Close());
+    }
+
+    ASSERT_TRUE(FrameArchive::IsArchive(path));
+    ASSERT_FALSE(FrameArchive::IsArchive("lines.png"));
+
+    FrameArchive archive(path);
+    ASSERT_EQ(archive.frame_count(), 2U);
+    ASSERT_EQ(archive.format(), StreamPixelFormat::kBgra);
+    for (auto i = 0; i < 2; ++i) {
+        const auto frame = archive.Frame<Argb32>(i);
+        ASSERT_TRUE(IsAligned(frame.data()));
+        for (auto y = 0; y < input.height(); ++y) {
+            ASSERT_EQ(std::memcmp(frame.RowPtr(y), input.RowPtr(y), input.width() * sizeof(Argb32)), 0);
+        }
+    }
+
+    std::remove(path.c_str());
+}
+
+// Tests that an archive without frames can be opened, and that frame counts too large for the file are rejected even when the
+// size they add up to wraps around
+TEST(FrameArchiveTest, FrameCount) {
+    const std::string path = "frame_archive_test.hfa";
+    {
+        FrameArchiveWriter writer(path, 64, 48, StreamPixelFormat::kGrey);
+        ASSERT_TRUE(writer.Close());
+    }
+
+    {
+        FrameArchive archive(path);
+        ASSERT_EQ(archive.frame_count(), 0U);
+        ASSERT_THROW(archive.FrameData(0), std::out_of_range);
+    }
+
+    FrameArchiveHeader header;
+    {
+        std::ifstream in(path, std::ios::binary);
+        ASSERT_TRUE(in.read(reinterpret_cast<char*>(&header), sizeof(header)));
+    }
+
+    for (const auto frame_count : { uint64_t(1), std::numeric_limits<uint64_t>::max() / header.frame_size + 1 }) {
+        header.frame_count = frame_count;
+        {
+            std::fstream out(path, std::ios::binary | std::ios::in | std::ios::out);
+            ASSERT_TRUE(out.write(reinterpret_cast<const char*>(&header), sizeof(header)));
+        }
+
+        ASSERT_THROW(FrameArchive archive(path), std::invalid_argument) << "With " << frame_count << " frames";
+    }
+
+    std::remove(path.c_str());
+}
+
+// Tests that corner lists written to a corner file are read back unchanged, in any order
+TEST(CornerFileTest, RoundTrip) {
+    HarrisCpp harris;
+    const auto corners = harris.FindCornerList(LoadImage("lines.png"));
+    const std::vector<CornerList> frames = { corners, CornerList(), { { 5, 3, 0.25f }, { 2, 4, 0.5f } } };
+    const std::string path = "corner_file_test.hcf";
+
+    for (const auto delta_encode : { false, true }) {
+        CornerFileWriter writer(path, delta_encode);
+        for (const auto& frame : frames) {
+            writer.Append(frame);
+        }
+        ASSERT_TRUE(writer.Close());
+
+        CornerFile file(path);
+        ASSERT_EQ(file.frame_count(), frames.size());
+        ASSERT_EQ(file.delta_encoded(), delta_encode);
+        for (auto i = static_cast<int>(frames.size()) - 1; i >= 0; --i) {
+            const auto frame = file.Frame(i);
+            ASSERT_EQ(frame.size(), frames[i].size());
+            for (auto j = 0; j < frame.size(); ++j) {
+                ASSERT_EQ(frame[j].x, frames[i][j].x);
+                ASSERT_EQ(frame[j].y, frames[i][j].y);
+                ASSERT_EQ(frame[j].response, frames[i][j].response);
+            }
+        }
+    }
+
+    std::remove(path.c_str());
+}
+
+// Tests that corner images are written as the same corner lists as the lists extracted from them
+TEST(CornerFileTest, CornerImage) {
+    HarrisCpp harris;
+    auto corners = harris.FindCorners(LoadImage("lines.png"));
+    const auto expected = ToCornerList(corners);
+    const std::string path = "corner_file_image_test.hcf";
+
+    CornerFileWriter writer(path);
+    writer.Append(std::move(corners));
+    writer.Append(Image<float>(4, 4));
+    ASSERT_TRUE(writer.Close());
+
+    CornerFile file(path);
+    ASSERT_EQ(file.frame_count(), 2);
+    const auto frame = file.Frame(0);
+    ASSERT_GT(frame.size(), 0);
+    ASSERT_EQ(frame.size(), expected.size());
+    for (auto j = 0; j < frame.size(); ++j) {
+        ASSERT_EQ(frame[j].x, expected[j].x);
+        ASSERT_EQ(frame[j].y, expected[j].y);
+        ASSERT_EQ(frame[j].response, expected[j].response);
+    }
+    ASSERT_EQ(file.Frame(1).size(), 0);
+
+    std::remove(path.c_str());
+}
+
+// Tests that every frame is written in order when Append has to wait for the writing thread
+TEST(CornerFileTest, FullQueue) {
+    const std::string path = "corner_file_queue_test.hcf";
+    const auto frames = 50;
+    {
+        CornerFileWriter writer(path, true, 1);
+        for (auto i = 0; i < frames; ++i) {
+            Image<float> corners(64, 64);
+            corners.RowPtr(i)[i] = 1.0f;
+            writer.Append(std::move(corners));
+        }
+
+        ASSERT_TRUE(writer.Close());
+    }
+
+    CornerFile file(path);
+    ASSERT_EQ(file.frame_count(), frames);
+    for (auto i = 0; i < frames; ++i) {
+        const auto frame = file.Frame(i);
+        ASSERT_EQ(frame.size(), 1U);
+        ASSERT_EQ(frame[0].x, i);
+        ASSERT_EQ(frame[0].y, i);
+    }
+
+    ASSERT_THROW(CornerFileWriter(path, true, 0), std::invalid_argument);
+    std::remove(path.c_str());
+}
+
+// Tests that every task submitted to a thread pool runs on a worker that was initialised
+TEST(ThreadPoolTest, Tasks) {
+    std::atomic<int> initialised(0);
+    std::vector<std::future<int>> results;
+    {
+        ThreadPool pool(4, [&]() { ++initialised; });
+        for (auto i = 0; i < 100; ++i) {
+            results.push_back(pool.Submit([i]() { return i * i; }));
+        }
+    }
+
+    // Every worker has started by the time the pool has been destroyed
+    ASSERT_EQ(initialised.load(), 4);
+    for (auto i = 0; i < 100; ++i) {
+        ASSERT_EQ(results[i].get(), i * i);
+    }
+}
+
+// Tests that the deadline governor falls back to reduced resolution and then drops frames as the detector gets slower
+TEST(DeadlineGovernorTest, Decide) {
+    DeadlineGovernor governor(10.0, 33.0);
+    using Action = DeadlineGovernor::Action;
+
+    // Nothing has been timed yet, so the first frames are processed at full resolution. The first one isn't timed.
+    ASSERT_EQ(governor.Decide(0.0), Action::kProcess);
+    governor.Record(Action::kProcess, 100.0);
+    ASSERT_EQ(governor.Decide(0.0), Action::kProcess);
+    governor.Record(Action::kProcess, 20.0);
+
+    // 20ms is over budget, but a quarter of the pixels (about 5ms) is not
+    ASSERT_EQ(governor.Decide(0.0), Action::kDownscale);
+    governor.Record(Action::kDownscale, 15.0);
+    ASSERT_EQ(governor.Decide(0.0), Action::kDownscale);
+    governor.Record(Action::kDownscale, 15.0);
+
+    // Even reduced resolution is over budget now, but the newest frame is still processed
+    ASSERT_EQ(governor.Decide(5.0), Action::kDownscale);
+
+    // A frame older than the frame interval has been replaced by a newer one, so it is dropped
+    ASSERT_EQ(governor.Decide(40.0), Action::kDrop);
+
+    ASSERT_EQ(governor.processed(), 4U);
+    ASSERT_EQ(governor.downscaled(), 2U);
+    ASSERT_EQ(governor.dropped(), 1U);
+}
+
+// Tests that a slow first frame doesn't keep the governor at reduced resolution
+TEST(DeadlineGovernorTest, SlowFirstFrame) {
+    DeadlineGovernor governor(10.0, 33.0);
+    using Action = DeadlineGovernor::Action;
+
+    // The first frame (e.g. building an OpenCL program) is left out of the estimate
+    ASSERT_EQ(governor.Decide(0.0), Action::kProcess);
+    governor.Record(Action::kProcess, 500.0);
+    for (auto i = 0; i < 5; ++i) {
+        ASSERT_EQ(governor.Decide(0.0), Action::kProcess);
+        governor.Record(Action::kProcess, 4.0);
+    }
+
+    // A slow patch moves to reduced resolution, and full resolution is tried again once reduced resolution is fast again
+    governor.Record(Action::kProcess, 200.0);
+    ASSERT_EQ(governor.Decide(0.0), Action::kDownscale);
+    governor.Record(Action::kDownscale, 1.0);
+    ASSERT_EQ(governor.Decide(0.0), Action::kDownscale);
+    governor.Record(Action::kDownscale, 1.0);
+    ASSERT_EQ(governor.Decide(0.0), Action::kProcess);
+    governor.Record(Action::kProcess, 4.0);
+
+    // Without any hint that it fits, full resolution is still tried again after a while
+    governor.Record(Action::kProcess, 500.0);
+    governor.Record(Action::kProcess, 500.0);
+
+    // but not on a frame that is only kept because it is the newest, which would go far over budget at full resolution
+    for (auto i = 0; i < 30; ++i) {
+        governor.Record(Action::kDownscale, 9.0);
+    }
+
+    for (auto i = 0; i < 100; ++i) {
+        ASSERT_EQ(governor.Decide(5.0), Action::kDownscale);
+        governor.Record(Action::kDownscale, 9.0);
+    }
+
+    auto probed = false;
+    for (auto i = 0; i < 100 && !probed; ++i) {
+        const auto action = governor.Decide(0.0);
+        probed = action == Action::kProcess;
+        governor.Record(action, action == Action::kProcess ? 4.0 : 9.0);
+    }
+
+    ASSERT_TRUE(probed);
+}
+
+// Tests that cache files are replaced whole, and that no temporary file is left behind when one can't be written
+TEST(CacheDirectoryTest, WriteFileAtomically) {
+    const std::string directory = "cache_directory_test";
+    ASSERT_TRUE(CreateDirectories(directory + "/subdirectory"));
+    const auto path = directory + "/file";
+    const auto temp_path = path + ".tmp" + std::to_string(getpid());
+    ASSERT_TRUE(WriteFileAtomically(path, [](std::ostream& out) { out << "first"; }));
+    ASSERT_TRUE(WriteFileAtomically(path, [](std::ostream& out) { out << "second"; }));
+    std::string contents;
+    ASSERT_TRUE(std::getline(std::ifstream(path), contents));
+    ASSERT_EQ(contents, "second");
+    ASSERT_FALSE(std::ifstream(temp_path).good());
+
+    // A directory can't be replaced by a file, so the rename fails
+    const auto directory_path = directory + "/subdirectory";
+    ASSERT_FALSE(WriteFileAtomically(directory_path, [](std::ostream& out) { out << "third"; }));
+    ASSERT_FALSE(std::ifstream(directory_path + ".tmp" + std::to_string(getpid())).good());
+
+    // Failing to write stops before the rename
+    ASSERT_FALSE(WriteFileAtomically(path, [](std::ostream& out) { out.setstate(std::ios::failbit); }));
+    ASSERT_FALSE(std::ifstream(temp_path).good());
+    ASSERT_TRUE(std::getline(std::ifstream(path), contents));
+    ASSERT_EQ(contents, "second");
+
+    std::remove(path.c_str());
+    std::remove(directory_path.c_str());
+    std::remove(directory.c_str());
+}
+
+// A detector that takes at least 20ms per frame
+class SlowHarris : public HarrisCpp {
+public:
+    Image<float> FindCorners(const Image<Argb32>& image) override {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        return HarrisCpp::FindCorners(image);
+    }
+};
+
+// Tests that the fastest available backend is selected and that the choice is reused without timing again
+TEST(BackendSelectorTest, Select) {
+    const std::string directory = "backend_selector_test";
+    std::stringstream log;
+    {
+        BackendSelector selector(directory, log);
+        selector.Add("slow", []() { return std::make_shared<SlowHarris>(); });
+        selector.Add("missing", []() -> std::shared_ptr<HarrisBase> { throw std::runtime_error("No device"); });
+        std::shared_ptr<HarrisBase> created;
+        selector.Add("cpp", [&]() { return created = std::make_shared<HarrisCpp>(); });
+        const auto selection = selector.Select<Argb32>(64, 48);
+        ASSERT_EQ(selection.name, "cpp");
+
+        // The detector that was timed is returned rather than a new one
+        ASSERT_EQ(selection.harris, created);
+    }
+
+    // The choice is read back from the cache, and only the selected backend is created
+    auto timed = false;
+    {
+        BackendSelector selector(directory, log);
+        selector.Add("slow", [&]() { timed = true; return std::make_shared<SlowHarris>(); });
+        selector.Add("cpp", []() { return std::make_shared<HarrisCpp>(); });
+        const auto selection = selector.Select<Argb32>(64, 48);
+        ASSERT_EQ(selection.name, "cpp");
+        ASSERT_NE(selection.harris, nullptr);
+        ASSERT_FALSE(timed);
+
+        // Other frame sizes are timed separately
+        ASSERT_EQ(selector.Select<Argb32>(32, 24).name, "cpp");
+        ASSERT_TRUE(timed);
+
+        // So are other detector parameters
+        timed = false;
+        selector.SetParameters(5, 5, 0.04f, 0.5f, 15);
+        ASSERT_EQ(selector.Select<Argb32>(64, 48).name, "cpp");
+        ASSERT_TRUE(timed);
+        std::remove(selector.CachePath(64, 48, sizeof(Argb32)).c_str());
+        selector.SetParameters(5, 5, 0.04f, 0.5f, 9);
+
+        // Other OpenCL devices and options
+        timed = false;
+        selector.SetOpenCLOptions(0, 1, true, false);
+        ASSERT_EQ(selector.Select<Argb32>(64, 48).name, "cpp");
+        ASSERT_TRUE(timed);
+        std::remove(selector.CachePath(64, 48, sizeof(Argb32)).c_str());
+        selector.SetOpenCLOptions(0, 0, false, false);
+
+        // And detectors in a detection service
+        timed = false;
+        selector.SetRemote(true);
+        ASSERT_EQ(selector.Select<Argb32>(64, 48).name, "cpp");
+        ASSERT_TRUE(timed);
+        std::remove(selector.CachePath(64, 48, sizeof(Argb32)).c_str());
+        selector.SetRemote(false);
+
+        std::remove(selector.CachePath(64, 48, sizeof(Argb32)).c_str());
+        std::remove(selector.CachePath(32, 24, sizeof(Argb32)).c_str());
+    }
+
+    // Nothing is selected or stored when no backend can run
+    {
+        BackendSelector selector(directory, log);
+        selector.Add("missing", []() -> std::shared_ptr<HarrisBase> { throw std::runtime_error("No device"); });
+        ASSERT_THROW(selector.Select<Argb32>(16, 16), std::runtime_error);
+        ASSERT_FALSE(std::ifstream(selector.CachePath(16, 16, sizeof(Argb32))).good());
+    }
+
+    std::remove(directory.c_str());
+}
+
+// A detector whose first frames are slow (e.g. while an OpenCL program is built and tuned)
+class SlowStartHarris : public HarrisCpp {
+public:
+    Image<float> FindCorners(const Image<Argb32>& image) override {
+        if (frames_++ < 2) std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        return HarrisCpp::FindCorners(image);
+    }
+
+private:
+    int frames_ = 0;
+};
+
+// Tests that a detector that was slow once still gets frames once it is fast
+TEST(HarrisSchedulerTest, SlowStart) {
+    HarrisScheduler scheduler({ std::make_shared<SlowHarris>(), std::make_shared<SlowStartHarris>() });
+    const Image<Argb32> image(64, 64);
+    const auto frames = 100;
+    for (auto i = 0; i < frames; ++i) {
+        scheduler.Submit(image);
+    }
+
+    for (auto i = 0; i < frames; ++i) {
+        scheduler.Next();
+    }
+
+    ASSERT_GT(scheduler.frame_count(1), scheduler.frame_count(0));
+    ASSERT_LT(scheduler.average_ms(1), scheduler.average_ms(0));
+}
+
+// A detector that only waits a given time per frame and finds no corners, so the time taken is the same on any host
+class DelayedHarris : public HarrisCpp {
+public:
+    explicit DelayedHarris(int delay_ms) : delay_ms_(delay_ms) {}
+
+    Image<float> FindCorners(const Image<Argb32>& image) override {
+        std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms_));
+        return Image<float>(image.width(), image.height());
+    }
+
+private:
+    int delay_ms_;
+};
+
+// Runs frames through a scheduler with two frames in flight per detector, as the demo does, and returns the time taken in ms
+double RunScheduled(HarrisScheduler& scheduler, int frames) {
+    const Image<Argb32> image(64, 64);
+    const auto start = std::chrono::steady_clock::now();
+    for (auto submitted = 0, returned = 0; returned < frames; ++returned) {
+        for (; submitted < frames && scheduler.pending() < 2 * scheduler.size(); ++submitted) {
+            scheduler.Submit(image);
+        }
+
+        scheduler.Next();
+    }
+
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Tests that a detector 20 times slower than the other hardly holds up the frames returned in order
+TEST(HarrisSchedulerTest, SlowDetector) {
+    const auto frames = 400;
+    HarrisScheduler fast({ std::make_shared<DelayedHarris>(2) });
+    const auto fast_ms = RunScheduled(fast, frames);
+
+    HarrisScheduler both({ std::make_shared<DelayedHarris>(2), std::make_shared<DelayedHarris>(40) });
+    const auto both_ms = RunScheduled(both, frames);
+    ASSERT_LT(both_ms, 1.5 * fast_ms);
+    ASSERT_LT(both.frame_count(1), 10U);
+}
+
+// Tests that frames spread over several detectors are returned in the order they were submitted
+TEST(HarrisSchedulerTest, InOrder) {
+    const auto lines = LoadImage("lines.png");
+    const Image<Argb32> blank(lines.width(), lines.height());
+    const auto expected = HarrisCpp().FindCornerList(lines);
+    ASSERT_FALSE(expected.empty());
+
+    HarrisScheduler scheduler({ std::make_shared<HarrisCpp>(), std::make_shared<SlowHarris>() });
+    const auto frames = 20;
+    for (auto i = 0; i < frames; ++i) {
+        scheduler.Submit(i % 2 == 0 ? lines : blank);
+    }
+
+    for (auto i = 0; i < frames; ++i) {
+        const auto corners = ToCornerList(scheduler.Next());
+        ASSERT_EQ(corners.size(), i % 2 == 0 ? expected.size() : 0U);
+    }
+
+    ASSERT_EQ(scheduler.pending(), 0U);
+    ASSERT_EQ(scheduler.frame_count(0) + scheduler.frame_count(1), static_cast<size_t>(frames));
+    ASSERT_FALSE(ToCornerList(scheduler.FindCorners(lines)).empty());
+}
+
+// Tests that a detection service returns the same corners as the detector it hosts, to several clients
+TEST(DetectionServiceTest, RoundTrip) {
+    const auto lines = LoadImage("lines.png");
+    const auto expected = HarrisCpp().FindCornerList(lines);
+    const std::string socket_path = "detection_service_test.sock";
+    std::stringstream log;
+
+    DetectionServer server(socket_path, { { "cpp", std::make_shared<HarrisCpp>() } }, log);
+    std::thread thread([&]() { server.Run(); });
+    {
+        HarrisRemote remote(socket_path, "cpp");
+        const auto corners = remote.FindCornerList(lines);
+        ASSERT_EQ(corners.size(), expected.size());
+        for (auto i = 0U; i < corners.size(); ++i) {
+            ASSERT_EQ(corners[i].x, expected[i].x);
+            ASSERT_EQ(corners[i].y, expected[i].y);
+            ASSERT_EQ(corners[i].response, expected[i].response);
+        }
+
+        // Frames written straight into the shared memory, with every slot in flight
+        DetectionClient client(socket_path, "cpp", HarrisCpp(), 3, lines.width() * lines.height() * sizeof(Argb32));
+        for (auto slot = 0U; slot < client.slot_count(); ++slot) {
+            auto frame = client.SlotImage<Argb32>(slot, lines.width(), lines.height());
+            for (auto y = 0; y < lines.height(); ++y) {
+                std::memcpy(frame.RowPtr(y), lines.RowPtr(y), lines.width() * sizeof(Argb32));
+            }
+
+            client.Submit(slot, frame);
+        }
+
+        for (auto slot = 0U; slot < client.slot_count(); ++slot) {
+            ASSERT_EQ(client.Receive().size(), expected.size());
+        }
+
+        ASSERT_THROW(HarrisRemote(socket_path, "opencl"), std::invalid_argument);
+        ASSERT_THROW(HarrisRemote(socket_path, "cpp", 3), std::invalid_argument);
+    }
+
+    server.Stop();
+    thread.join();
+    ASSERT_EQ(server.frames(), 4U);
+}
+
+// Tests the order in which frames of several streams are taken under each policy
+TEST(StreamQueuesTest, Fairness) {
+    using Queues = StreamQueues<int>;
+    for (const auto policy : { Queues::Policy::kRoundRobin, Queues::Policy::kDeadline }) {
+        Queues queues(2, 3, policy);
+        const auto now = Queues::Clock::now();
+
+        // Stream 1 has twice the frame rate of stream 0
+        for (auto i = 0; i < 3; ++i) {
+            queues.Push(0, i, now, now + std::chrono::milliseconds(40 * (i + 1)));
+            queues.Push(1, 10 + i, now, now + std::chrono::milliseconds(20 * (i + 1)));
+        }
+
+        queues.Finish(0);
+        queues.Finish(1);
+
+        // A stream's next frame can't be taken until its current frame is done
+        Queues::Entry first;
+        Queues::Entry second;
+        ASSERT_TRUE(queues.Pop(first));
+        ASSERT_TRUE(queues.Pop(second));
+        ASSERT_NE(first.stream, second.stream);
+        ASSERT_EQ(first.decoded, now);
+        queues.Done(first.stream);
+        queues.Done(second.stream);
+
+        std::vector<int> order = { first.item, second.item };
+        Queues::Entry entry;
+        while (queues.Pop(entry)) {
+            order.push_back(entry.item);
+            queues.Done(entry.stream);
+        }
+
+        const auto expected = policy == Queues::Policy::kRoundRobin ? std::vector<int>{ 0, 10, 1, 11, 2, 12 } : std::vector<int>{ 10, 0, 11, 12, 1, 2 };
+        ASSERT_EQ(order, expected);
+    }
+}
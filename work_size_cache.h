@@ -0,0 +1,81 @@
+#pragma once
+// On-disk cache of tuned OpenCL local work sizes
+
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+
+#define __CL_ENABLE_EXCEPTIONS
+
+#include "cl.hpp"
+#include "cache_directory.h"
+#include "program_cache.h"
+
+namespace harris {
+
+// Local work size (x, y) of a 2D kernel. (0, 0) leaves the choice to the driver (i.e. cl::NullRange).
+using LocalSize = std::pair<size_t, size_t>;
+
+// Local work sizes for each kernel, keyed by kernel function name
+using LocalSizeMap = std::map<std::string, LocalSize>;
+
+// Stores the local work sizes found by autotuning so later processes can reuse them.
+// Results are keyed by device, driver version, frame size and kernel variant (the kernel family and input pixel format)
+// since the best sizes depend on all of them.
+class WorkSizeCache {
+public:
+
+    // Creates a cache that stores results in the given directory. An empty directory disables the cache.
+    explicit WorkSizeCache(std::string directory = DefaultCacheDirectory("opencl")) :
+        directory_(std::move(directory)) {
+    }
+
+    bool enabled() const { return !directory_.empty(); }
+
+    // Loads the local sizes tuned for a device, frame size and kernel variant.
+    // Returns an empty map if nothing has been stored for them.
+    LocalSizeMap Load(const cl::Device& device, size_t width, size_t height, const std::string& variant) const {
+        LocalSizeMap local_sizes;
+        if (!enabled()) return local_sizes;
+
+        std::ifstream in(Path(device, width, height, variant));
+        std::string name;
+        LocalSize local_size;
+        while (in >> name >> local_size.first >> local_size.second) {
+            local_sizes[name] = local_size;
+        }
+
+        return local_sizes;
+    }
+
+    // Stores the local sizes tuned for a device, frame size and kernel variant
+    void Store(const cl::Device& device, size_t width, size_t height, const std::string& variant, const LocalSizeMap& local_sizes) const {
+        if (!enabled()) return;
+        if (!CreateDirectories(directory_)) return;
+
+        WriteFileAtomically(Path(device, width, height, variant), [&](std::ostream& out) {
+            for (const auto& local_size : local_sizes) {
+                out << local_size.first << ' ' << local_size.second.first << ' ' << local_size.second.second << '\n';
+            }
+        });
+    }
+
+private:
+    std::string directory_;
+
+    // Returns the file name used for a given device, frame size and kernel variant
+    std::string Path(const cl::Device& device, size_t width, size_t height, const std::string& variant) const {
+        auto hash = Fnv1a64(device.getInfo<CL_DEVICE_NAME>());
+        hash = Fnv1a64(device.getInfo<CL_DEVICE_VENDOR>(), hash);
+        hash = Fnv1a64(device.getInfo<CL_DRIVER_VERSION>(), hash);
+        hash = Fnv1a64(variant, hash);
+
+        std::stringstream path_stream;
+        path_stream << directory_ << "/" << std::hex << std::setw(16) << std::setfill('0') << hash << std::dec << "-" << width << "x" << height << ".worksize";
+        return path_stream.str();
+    }
+};
+}